@@ -14,7 +14,7 @@ set DISALBED_WARNINGS=^
 -Wno-nested-anon-types -Wno-gnu-anonymous-struct ^
 -Wno-double-promotion -Wno-sign-conversion -Wno-shorten-64-to-32 -Wno-conversion -Wno-float-conversion -Wno-sign-compare
 
-set STD_FLAGS=-Xclang -fexceptions -Xclang -fcxx-exceptions -std:c++17 %WARNINGS% %DISALBED_WARNINGS% 
+set STD_FLAGS=-Xclang -fexceptions -Xclang -fcxx-exceptions -std:c++20 %WARNINGS% %DISALBED_WARNINGS% 
 set DBG_FLAGS=-DDEBUG -Z7
 set REL_FLAGS=-DRELEASE -Ofast
 
@@ -182,7 +182,7 @@ namespace mod {
     // TODO add string value option for vsync config
     JSONItem* vsync_item = json.get_object_item("vsync");
 
-    vsync = vsync_item != NULL? vsync_item->get_number() : ApplicationVSyncMode::VBlank;
+    vsync = vsync_item != NULL? vsync_item->get_number() : static_cast<f64_t>(ApplicationVSyncMode::VBlank);
 
     if (vsync == ApplicationVSyncMode::VBlank) {
       m_assert(SDL_GL_SetSwapInterval(1) == 0, "Failed to enable VBlank VSync mode");
@@ -204,7 +204,7 @@ namespace mod {
     // TODO add string value option for window mode config
     JSONItem* window_mode_item = json.get_object_item("window_mode");
 
-    set_window_mode(window_mode_item != NULL? window_mode_item->get_number() : ApplicationWindowMode::Windowed);
+    set_window_mode(window_mode_item != NULL? window_mode_item->get_number() : static_cast<f64_t>(ApplicationWindowMode::Windowed));
 
 
     JSONItem* resolution_item = json.get_object_item("resolution");
@@ -245,6 +245,18 @@ namespace mod {
     show_info = show_info_item != NULL? show_info_item->get_boolean() : false;
 
 
+    // 0 or absent uses one worker per logical processor besides the main thread
+    JSONItem* job_threads_item = json.get_object_item("job_threads");
+    JSONItem* pin_job_threads_item = json.get_object_item("pin_job_threads");
+    JSONItem* reserved_job_threads_item = json.get_object_item("reserved_job_threads");
+
+    JobSystem.init(
+      job_threads_item != NULL? static_cast<u32_t>(job_threads_item->get_number()) : 0,
+      pin_job_threads_item != NULL? pin_job_threads_item->get_boolean() : false,
+      reserved_job_threads_item != NULL? static_cast<u32_t>(reserved_job_threads_item->get_number()) : 0
+    );
+
+
     json.destroy();
 
 
@@ -324,6 +336,8 @@ namespace mod {
     AssetManager.destroy();
 
     AudioContext.destroy();
+
+    JobSystem.destroy();
     
 
     fonts.destroy();
@@ -463,6 +477,10 @@ namespace mod {
     Input.process_raw_input(!ig_io->WantCaptureMouse, resolution);
 
 
+    // Run after the GL context is made current, as these are mostly uploads from asynchronous Tasks
+    JobSystem.run_main_thread_jobs();
+
+
     return true;
   }
 
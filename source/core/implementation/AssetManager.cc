@@ -7,22 +7,18 @@ namespace mod {
 
   AssetManager_t& AssetManager_t::init () {
     have_lock = false;
-    watch_list.shutdown = false;
+    watch_list.scan_job = { };
+    watch_list.last_scan = 0;
     mtx_init_safe(&watch_list.mtx, mtx_plain);
-    thrd_create_safe(&watch_list.thrd, static_cast<thrd_start_t>(AssetManager_t::watch_files), NULL);
     return *this;
   }
 
   void AssetManager_t::destroy () {
     m_assert(!have_lock, "Unknown error occurred: Already had mutex lock at start of AssetManager::destroy");
 
-    mtx_lock_safe(&watch_list.mtx);
-
-    watch_list.shutdown = true;
-
-    mtx_unlock_safe(&watch_list.mtx);
+    if (JobSystem.is_initialized()) JobSystem.get_pool().await(watch_list.scan_job);
 
-    thrd_join_safe(AssetManager.watch_list.thrd, NULL);
+    mtx_destroy(&watch_list.mtx);
 
     watch_list.destroy();
 
@@ -38,34 +34,25 @@ namespace mod {
     audio.destroy();
   }
 
-  s32_t AssetManager_t::watch_files (void*) {
-    while (true) {
-      mtx_lock_safe(&AssetManager.watch_list.mtx);
+  void AssetManager_t::scan_watched_files (void*) {
+    // The main thread holds the list while it processes updates; rather than block a worker, skip the scan until the next interval
+    if (mtx_trylock(&AssetManager.watch_list.mtx) != thrd_success) return;
 
-      if (AssetManager.watch_list.shutdown == true) {
-        mtx_unlock_safe(&AssetManager.watch_list.mtx);
+    for (auto [ i, file ] : AssetManager.watch_list.files) {
+      if (file.needs_update) continue;
 
-        return 0;
-      }
-
-      for (auto [ i, file ] : AssetManager.watch_list.files) {
-        if (file.needs_update) continue;
+      struct stat file_stats;
 
-        struct stat file_stats;
+      // TODO should we stop tracking deleted files? They could be replaced but not sure how this should be handled yet
+      if (stat(AssetManager.watch_list.paths[i].value, &file_stats) != 0) continue;
 
-        // TODO should we stop tracking deleted files? They could be replaced but not sure how this should be handled yet
-        if (stat(AssetManager.watch_list.paths[i].value, &file_stats) != 0) continue;
 
+      f64_t time_diff = difftime(file_stats.st_mtime, file.last_update);
 
-        f64_t time_diff = difftime(file_stats.st_mtime, file.last_update);
-
-        if (time_diff > 0.0) file.needs_update = true;
-      }
-
-      mtx_unlock_safe(&AssetManager.watch_list.mtx);
-
-      thrd_sleep_safe(&WatchedFileList::sleep_interval, NULL);
+      if (time_diff > 0.0) file.needs_update = true;
     }
+
+    mtx_unlock_safe(&AssetManager.watch_list.mtx);
   }
 
 
@@ -75,6 +62,18 @@ namespace mod {
 
     m_assert(!have_lock, "Unknown error occurred, already had mutex lock at start of AssetManager::update_watched_files");
 
+    ThreadPool& pool = JobSystem.get_pool();
+
+    u64_t scan_time = SDL_GetPerformanceCounter();
+    u64_t scan_interval = static_cast<u64_t>(WatchedFileList::sleep_interval.tv_sec) * SDL_GetPerformanceFrequency()
+                        + static_cast<u64_t>(WatchedFileList::sleep_interval.tv_nsec) * SDL_GetPerformanceFrequency() / 1000000000ull;
+
+    // Scans are started from here rather than by a dedicated thread, and reports are picked up by the first call after one completes
+    if (pool.is_complete(watch_list.scan_job) && scan_time - watch_list.last_scan >= scan_interval) {
+      watch_list.last_scan = scan_time;
+      watch_list.scan_job = pool.submit(AssetManager_t::scan_watched_files, NULL, NULL, 0, JobPriority::Background);
+    }
+
     mtx_lock_safe(&watch_list.mtx);
     have_lock = true;
 
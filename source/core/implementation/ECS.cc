@@ -1,6 +1,7 @@
 #include "../include/ECS.hh"
 #include "../include/String.hh"
 #include "../include/Hierarchy.hh"
+#include "../include/MappedFile.hh"
 
 namespace mod {
   void* EntityHandle::create_component_by_id (ComponentType::ID type_id) {
@@ -34,28 +35,20 @@ namespace mod {
 
   
   bool EntityHandle::update () {
-    if (id == 0) return false;
-    
-    Entity* entity = index < ecs->entity_count? ecs->entities + index : NULL;
+    if (id == 0 || id > ecs->entity_slots.count) return false;
 
-    if (entity != NULL && entity->id == id) return true;
-    else {
-      for (uint64_t i = 0; i < ecs->entity_count; i ++) {
-        entity = ecs->entities + i;
+    EntitySlot& slot = ecs->get_entity_slot(id);
 
-        if (entity->id == id) {
-          index = i;
-          return true;
-        }
-      }
+    if (slot.generation != generation) return false;
 
-      return false;
-    }
+    index = slot.index;
+
+    return true;
   }
 
 
   EntityHandle& EntityHandle::verified () {
-    m_assert(update(), "Failed to verify EntityHandle: the Handle's ID (%" PRIu64 ") was invalid", static_cast<u64_t>(id));
+    m_assert(update(), "Failed to verify EntityHandle: the Handle's ID (%" PRIu64 ") and generation (%" PRIu32 ") were invalid", static_cast<u64_t>(id), generation);
     return *this;
   }
 
@@ -66,7 +59,7 @@ namespace mod {
 
   Entity* EntityHandle::get_verified_pointer () {
     Entity* ptr = get_pointer();
-    m_assert(ptr != NULL, "Could not get verified pointer from EntityHandle: the Handle's ID (%" PRIu64 ") was invalid", static_cast<u64_t>(id));
+    m_assert(ptr != NULL, "Could not get verified pointer from EntityHandle: the Handle's ID (%" PRIu64 ") and generation (%" PRIu32 ") were invalid", static_cast<u64_t>(id), generation);
     return ptr;
   }
 
@@ -85,512 +78,2488 @@ namespace mod {
 
 
 
-  void System::iterator_execution_instance (SystemIteratorArg* arg) {
-    for (u32_t i = arg->range_base; i < arg->range_ext; i ++) {
-      if (arg->ecs->entities[i].enabled_components.match_subset(arg->sys->required_components)) {
-        arg->sys->iterator_callback(arg->ecs, i);
-      }
-    }
-  }
+  // Chunks are over allocated so their base can be aligned for Streamed columns,
+  // the original allocation address is stored just before the aligned base
+  static u8_t* allocate_chunk (size_t chunk_bytes) {
+    u8_t* allocation = memory::allocate<u8_t>(chunk_bytes + sizeof(u8_t*) + Archetype::stream_alignment);
 
-  void System::execute_parallel (ECS* ecs) const {
-    u32_t entities_per_job = ecs->entity_count / ecs->max_iterators;
+    m_assert(allocation != NULL, "Out of memory or other null pointer error while allocating Archetype chunk with size %zu", chunk_bytes);
 
-    if (ecs->entity_count % ecs->max_iterators != 0) ++ entities_per_job;
+    uintptr_t base = reinterpret_cast<uintptr_t>(allocation) + sizeof(u8_t*);
+    u8_t* chunk = reinterpret_cast<u8_t*>((base + Archetype::stream_alignment - 1) & ~(Archetype::stream_alignment - 1));
 
-    u32_t arg_base = 0;
+    memory::copy(reinterpret_cast<u8_t**>(chunk) - 1, &allocation);
 
-    for (u32_t i = 0; i < ecs->max_iterators; i ++) {
-      u32_t remaining_ents = ecs->entity_count - arg_base;
-      u32_t arg_ents = num::min(entities_per_job, remaining_ents);
-      u32_t arg_ext = arg_base + arg_ents;
+    return chunk;
+  }
 
-      SystemIteratorArg& arg = ecs->system_iterator_args[i];
+  static void deallocate_chunk (u8_t* chunk) {
+    u8_t* allocation;
 
-      arg.sys = const_cast<System*>(this);
-      arg.range_base = arg_base;
-      arg.range_ext = arg_ext;
+    memory::copy(&allocation, reinterpret_cast<u8_t**>(chunk) - 1);
 
-      ecs->thread_pool->queue(reinterpret_cast<Job::Callback>(System::iterator_execution_instance), &arg);
+    memory::deallocate(allocation);
+  }
 
-      arg_base = arg_ext;
-    }
 
-    ecs->thread_pool->await_all();
-  }
+  Archetype::Archetype (ComponentMask const& in_mask, ComponentType const* types, ComponentType::ID type_count)
+  : mask(in_mask)
+  , count(0)
+  , chunk_capacity(0)
+  , chunk_bytes(0)
+  , column_count(0)
+  {
+    size_t row_size = sizeof(u32_t);
+    bool streamed = false;
 
-  void System::execute_sequential (ECS* ecs) const {
-    SystemIteratorArg arg = {
-      ecs, const_cast<System*>(this),
-      0, ecs->entity_count
-    };
-    
-    iterator_execution_instance(&arg);
-  }
+    for (ComponentType::ID i = 0; i < type_count; i ++) {
+      if (mask.match_index(i) && ComponentStorage::chunked(types[i].storage)) {
+        column_type_ids[column_count] = i;
+        ++ column_count;
 
-  void System::execute (ECS* ecs) const {
-    if (enabled) {
-      if (custom) {
-        custom_callback(ecs);
-      } else {
-        if (parallel && ecs->thread_pool != NULL) {
-          execute_parallel(ecs);
-        } else {
-          execute_sequential(ecs);
-        }
+        row_size += types[i].instance_size;
+
+        if (types[i].storage == ComponentStorage::Streamed) streamed = true;
       }
     }
-  }
 
+    size_t padding = (column_count + 1) * (streamed? stream_alignment : column_alignment);
 
-  ECS::ECS (u32_t in_entity_capacity, u32_t in_entity_thread_threshold, uint8_t in_max_threads, uint8_t thread_iterator_ratio)
-  : entities(memory::allocate<Entity>(in_entity_capacity))
-  , entity_count(0)
-  , entity_capacity(in_entity_capacity)
-  , entity_id_counter(1)
-  , component_type_count(0)
-  , system_count(0)
-  , system_id_counter(1)
-  , system_iterator_args(NULL)
-  , max_threads(in_max_threads)
-  , max_iterators(thread_iterator_ratio * in_max_threads)
-  , entity_thread_threshold(in_entity_thread_threshold)
-  , thread_pool(NULL)
-  {
-    memory::clear(systems, System::max_systems);
-    m_assert(entities != NULL, "Out of memory or other null pointer error while allocating ECS entities with starting capacity %" PRIu32, entity_capacity);
-    create_component_type<Transform3D>();
-    create_component_type<Child>();
-    create_component_type<Parent>();
-    create_component_type<SkeletonState>();
-  }
+    if (chunk_size > padding) chunk_capacity = (chunk_size - padding) / row_size;
 
+    if (streamed && chunk_capacity > stream_width) chunk_capacity -= chunk_capacity % stream_width;
 
-  void ECS::enable_thread_pool () {
-    if (thread_pool == NULL) {
-      system_iterator_args = memory::allocate<SystemIteratorArg>(max_iterators);
+    if (chunk_capacity == 0) chunk_capacity = 1;
 
-      for (u32_t i = 0; i < max_iterators; i ++) {
-        system_iterator_args[i].ecs = this;
-      }
+    size_t offset = chunk_capacity * sizeof(u32_t);
 
-      thread_pool = new ThreadPool { max_threads };
-    }
-  }
+    for (u32_t i = 0; i < column_count; i ++) {
+      size_t alignment = types[column_type_ids[i]].storage == ComponentStorage::Streamed? stream_alignment : column_alignment;
 
-  void ECS::disable_thread_pool () {
-    if (thread_pool != NULL) {
-      thread_pool->destroy();
-      delete thread_pool;
+      offset = (offset + alignment - 1) & ~(alignment - 1);
 
-      thread_pool = NULL;
+      column_offsets[column_type_ids[i]] = offset;
+
+      offset += chunk_capacity * types[column_type_ids[i]].instance_size;
     }
-  }
 
+    chunk_bytes = offset;
 
-  void ECS::destroy () {
-    disable_thread_pool();
+    for (size_t i = 0; i < ComponentType::max_component_types; i ++) edges[i] = no_edge;
+  }
 
-    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
-      for (size_t j = 0; j < entity_count; j ++) {
-        if (entities[j].enabled_components[i]) component_types[i].destroy_instance(j);
-      }
 
-      component_types[i].destroy();
-    }
+  u32_t Archetype::append_row (u32_t entity_index, u64_t version) {
+    u32_t row = count;
+    u32_t chunk_index = row / chunk_capacity;
 
-    memory::deallocate(entities);
+    if (chunk_index == chunks.count) {
+      chunks.append(allocate_chunk(chunk_bytes));
 
-    for (System::ID i = 0; i < system_count; i ++) {
-      systems[i].destroy();
+      chunk_versions.reallocate(chunks.count * ComponentType::max_component_types);
+      chunk_versions.count = chunks.count * ComponentType::max_component_types;
+
+      memory::clear(get_chunk_versions(chunk_index), ComponentType::max_component_types);
     }
 
-    delete this;
-  }
+    get_entity_indices(chunk_index)[row % chunk_capacity] = entity_index;
 
+    // New data in a chunk counts as a change to all of its columns
+    std::atomic<u64_t>* versions = get_chunk_versions(chunk_index);
 
-  void ECS::grow_allocation (u32_t additional_count) {
-    u32_t new_count = entity_count + additional_count;
-    u32_t new_capacity = entity_capacity;
+    for (u32_t i = 0; i < column_count; i ++) versions[column_type_ids[i]].store(version, std::memory_order_relaxed);
 
-    while (new_capacity < new_count) new_capacity *= 2;
+    ++ count;
 
-    if (new_capacity > entity_capacity) {
-      memory::reallocate(entities, new_capacity);
+    return row;
+  }
 
-      m_assert(entities != NULL, "Out of memory or other null pointer error while reallocating ECS entities for capacity %" PRIu32, new_capacity);
+  u32_t Archetype::append_rows (u32_t first_entity_index, u32_t row_count, u64_t version) {
+    u32_t first_row = count;
+    u32_t new_chunk_count = (count + row_count + chunk_capacity - 1) / chunk_capacity;
 
-      entity_capacity = new_capacity;
+    if (new_chunk_count > chunks.count) {
+      chunks.reallocate(new_chunk_count);
+      chunk_versions.reallocate(new_chunk_count * ComponentType::max_component_types);
 
-      for (ComponentType::ID i = 0; i < component_type_count; i ++) {
-        component_types[i].reallocate(entity_capacity);
+      while (chunks.count < new_chunk_count) {
+        chunks.append(allocate_chunk(chunk_bytes));
+        chunk_versions.count = chunks.count * ComponentType::max_component_types;
+
+        memory::clear(get_chunk_versions(chunks.count - 1), ComponentType::max_component_types);
       }
     }
-  }
-
-
-  EntityHandle ECS::create_entity () {
-    grow_allocation();
 
-    Entity* entity = entities + entity_count;
+    for (u32_t i = 0; i < row_count; i ++) get_entity_index(first_row + i) = first_entity_index + i;
 
-    *entity = {
-      entity_id_counter,
-      { }
-    };
+    count += row_count;
 
-    EntityHandle h = { this, entity_count, entity_id_counter };
+    for (u32_t chunk_index = first_row / chunk_capacity; chunk_index < new_chunk_count; chunk_index ++) {
+      std::atomic<u64_t>* versions = get_chunk_versions(chunk_index);
 
-    ++ entity_id_counter;
-    ++ entity_count;
+      for (u32_t i = 0; i < column_count; i ++) versions[column_type_ids[i]].store(version, std::memory_order_relaxed);
+    }
 
-    return h;
+    return first_row;
   }
 
-  void ECS::destroy_entity (u32_t index) {
-    if (index > entity_count) return;
+  u32_t Archetype::remove_row (u32_t row, ComponentType const* types, u64_t version) {
+    u32_t last_row = count - 1;
+    u32_t moved_entity_index = no_entity;
 
-    u32_t last_index = entity_count - 1;
+    if (row != last_row) {
+      moved_entity_index = get_entity_index(last_row);
 
-    if (index != last_index) {
-      Entity* last_entity = entities + last_index;
+      get_entity_index(row) = moved_entity_index;
 
-      for (ComponentType::ID i = 0; i < ComponentType::max_component_types; i ++) {
-        if (last_entity->enabled_components.match_index(i)) {
-          component_types[i].swap_instances(index, last_index);
-        }
+      for (u32_t i = 0; i < column_count; i ++) {
+        copy_instance(types[column_type_ids[i]], row, *this, last_row);
       }
 
-      entities[index] = *last_entity;
+      std::atomic<u64_t>* versions = get_chunk_versions(row / chunk_capacity);
+
+      for (u32_t i = 0; i < column_count; i ++) versions[column_type_ids[i]].store(version, std::memory_order_relaxed);
     }
 
-    -- entity_count;
-  }
+    -- count;
 
-  void ECS::destroy_entity (EntityHandle& handle) {
-    Entity& entity = *handle;
-    
-    u32_t last_index = entity_count - 1;
+    // Keep one spare chunk around so entities moving back and forth over a chunk boundary do not thrash the allocator
+    if (chunks.count > get_chunk_count() + 1) {
+      -- chunks.count;
+      deallocate_chunk(chunks.elements[chunks.count]);
 
-    if (handle.index != last_index) {
-      Entity* last_entity = entities + last_index;
+      chunk_versions.count -= ComponentType::max_component_types;
+    }
 
-      for (ComponentType::ID i = 0; i < ComponentType::max_component_types; i ++) {
-        if (last_entity->enabled_components.match_index(i)) {
-          component_types[i].destroy_instance(handle.index);
-          component_types[i].swap_instances(handle.index, last_index);
-        }
-      }
+    return moved_entity_index;
+  }
 
-      entity = *last_entity;
-    }
+  void Archetype::read_instance (ComponentType const& type, u32_t row, void* out) const {
+    if (type.storage == ComponentStorage::Streamed) {
+      u32_t const* streams = static_cast<u32_t const*>(get_column(row / chunk_capacity, type.id)) + row % chunk_capacity;
+      u32_t* lanes = static_cast<u32_t*>(out);
 
-    -- entity_count;
+      for (size_t i = 0; i < type.instance_size / sizeof(u32_t); i ++) lanes[i] = streams[i * chunk_capacity];
+    } else {
+      memory::copy(out, get_instance_by_id(type, row), type.instance_size);
+    }
   }
 
+  void Archetype::write_instance (ComponentType const& type, u32_t row, void const* data) {
+    if (type.storage == ComponentStorage::Streamed) {
+      u32_t* streams = static_cast<u32_t*>(get_column(row / chunk_capacity, type.id)) + row % chunk_capacity;
+      u32_t const* lanes = static_cast<u32_t const*>(data);
 
-  ComponentType& ECS::get_component_type_by_name (char const* name) const {
-    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
-      if (str_cmp_caseless(component_types[i].name, name) == 0) return const_cast<ComponentType&>(component_types[i]);
+      for (size_t i = 0; i < type.instance_size / sizeof(u32_t); i ++) streams[i * chunk_capacity] = lanes != NULL? lanes[i] : 0;
+    } else if (data != NULL) {
+      memory::copy(get_instance_by_id(type, row), data, type.instance_size);
+    } else {
+      memory::clear(get_instance_by_id(type, row), type.instance_size);
     }
-    
-    String types;
-    for (ComponentType::ID i = 0; i < component_type_count; i ++) types.fmt_append("'%s', \n", component_types[i].name);
-    m_error("Could not find ComponentType matching name %s. Registered component type names are:\n%s", name, types.value);
   }
 
+  void Archetype::copy_instance (ComponentType const& type, u32_t dst_row, Archetype const& src, u32_t src_row) {
+    if (type.storage == ComponentStorage::Streamed) {
+      u32_t* dst_streams = static_cast<u32_t*>(get_column(dst_row / chunk_capacity, type.id)) + dst_row % chunk_capacity;
+      u32_t const* src_streams = static_cast<u32_t const*>(src.get_column(src_row / src.chunk_capacity, type.id)) + src_row % src.chunk_capacity;
 
-  void* ECS::create_component_by_id (u32_t index, ComponentType::ID type_id) {
-    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+      for (size_t i = 0; i < type.instance_size / sizeof(u32_t); i ++) dst_streams[i * chunk_capacity] = src_streams[i * src.chunk_capacity];
+    } else {
+      memory::copy(get_instance_by_id(type, dst_row), src.get_instance_by_id(type, src_row), type.instance_size);
+    }
+  }
 
-    Entity& entity = get_entity(index);
-    ComponentType& type = component_types[type_id];
+  void Archetype::destroy () {
+    for (auto [ i, chunk ] : chunks) deallocate_chunk(chunk);
 
-    m_assert(
-      !entity.enabled_components.match_index(type_id),
-      "Cannot create Component of type %s on Entity with ID %" PRIu64 " because a Component of this type already exists",
-      type.name, static_cast<u64_t>(entity.id)
-    );
+    chunks.destroy();
+    chunk_versions.destroy();
+  }
 
-    entity.enabled_components.set(type_id);
-    
-    void* ptr = type.get_instance_by_id(index);
 
-    memory::clear(ptr, type.instance_size);
 
-    return ptr;
+
+  void Query::update (ECS const* ecs) {
+    for (; archetype_cursor < ecs->archetypes.count; archetype_cursor ++) {
+      if (ecs->archetypes[archetype_cursor].mask.match_subset(required_components)) archetype_indices.append(archetype_cursor);
+    }
   }
 
-  void* ECS::create_component_by_id (EntityHandle& handle, ComponentType::ID type_id) {
-    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+  u32_t Query::get_match_count (ECS const* ecs) const {
+    u32_t match_count = 0;
 
-    Entity& entity = *handle;
-    ComponentType& type = component_types[type_id];
+    for (auto [ i, archetype_index ] : archetype_indices) match_count += ecs->archetypes[archetype_index].count;
 
-    m_assert(
-      !entity.enabled_components.match_index(type_id),
-      "Cannot create Component of type %s on Entity with ID %" PRIu64 " because a Component of this type already exists",
-      type.name, static_cast<u64_t>(entity.id)
-    );
+    return match_count;
+  }
 
-    entity.enabled_components.set(type_id);
-    
-    void* ptr = type.get_instance_by_id(handle.index);
 
-    memory::clear(ptr, type.instance_size);
 
-    return ptr;
-  }
 
-  void* ECS::add_component_by_id (u32_t index, ComponentType::ID type_id, void const* data) {
-    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+  f64_t SystemProfile::get_average_ms () const {
+    if (sample_count == 0) return 0;
 
-    Entity& entity = get_entity(index);
-    ComponentType& type = component_types[type_id];
+    u64_t total = 0;
 
-    m_assert(
-      !entity.enabled_components.match_index(type_id),
-      "Cannot add Component of type %s on Entity with ID %" PRIu64 " because a Component of this type already exists",
-      type.name, static_cast<u64_t>(entity.id)
-    );
+    for (u32_t i = 0; i < sample_count; i ++) total += samples[i].ticks;
 
-    entity.enabled_components.set(type_id);
-    
-    void* ptr = type.get_instance_by_id(index);
+    return ticks_to_ms(total) / static_cast<f64_t>(sample_count);
+  }
 
-    memory::copy(ptr, data, type.instance_size);
+  static s32_t compare_ticks (void const* l, void const* r) {
+    u64_t a = *static_cast<u64_t const*>(l);
+    u64_t b = *static_cast<u64_t const*>(r);
 
-    return ptr;
+    return a < b? -1 : (a > b? 1 : 0);
   }
 
-  void* ECS::add_component_by_id (EntityHandle& handle, ComponentType::ID type_id, void const* data) {
-    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+  f64_t SystemProfile::get_percentile_ms (f64_t percentile) const {
+    if (sample_count == 0) return 0;
 
-    Entity& entity = *handle;
-    ComponentType& type = component_types[type_id];
+    u64_t ticks [history_size];
 
-    m_assert(
-      !entity.enabled_components.match_index(type_id),
-      "Cannot add Component of type %s on Entity with ID %" PRIu64 " because a Component of this type already exists",
-      type.name, static_cast<u64_t>(entity.id)
-    );
+    for (u32_t i = 0; i < sample_count; i ++) ticks[i] = samples[i].ticks;
 
-    entity.enabled_components.set(type_id);
-    
-    void* ptr = type.get_instance_by_id(handle.index);
+    qsort(ticks, sample_count, sizeof(u64_t), compare_ticks);
 
-    memory::copy(ptr, data, type.instance_size);
+    f64_t rank = num::clamp(percentile, 0.0, 100.0) / 100.0 * static_cast<f64_t>(sample_count - 1);
 
-    return ptr;
+    return ticks_to_ms(ticks[static_cast<u32_t>(rank + 0.5)]);
   }
 
+  f64_t SystemProfile::get_average_visited () const {
+    if (sample_count == 0) return 0;
 
-  void* ECS::get_component_by_id (u32_t index, ComponentType::ID type_id) const {
-    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
-
-    Entity& entity = get_entity(index);
-    ComponentType const& type = component_types[type_id];
+    u64_t total = 0;
 
-    m_assert(
-      entity.enabled_components.match_index(type_id),
-      "Cannot get Component of type %s on Entity with ID %" PRIu64 " because a Component of this type does not exist for the given Entity",
-      type.name, static_cast<u64_t>(entity.id)
-    );
+    for (u32_t i = 0; i < sample_count; i ++) total += samples[i].visited;
 
-    return type.get_instance_by_id(index);
+    return static_cast<f64_t>(total) / static_cast<f64_t>(sample_count);
   }
 
-  void* ECS::get_component_by_id (EntityHandle& handle, ComponentType::ID type_id) const {
-    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+  f64_t SystemProfile::get_average_matched () const {
+    if (sample_count == 0) return 0;
 
-    Entity& entity = *handle;
-    ComponentType const& type = component_types[type_id];
+    u64_t total = 0;
 
-    m_assert(
-      entity.enabled_components.match_index(type_id),
-      "Cannot get Component of type %s on Entity with ID %" PRIu64 " because a Component of this type does not exist for the given Entity",
-      type.name, static_cast<u64_t>(entity.id)
-    );
+    for (u32_t i = 0; i < sample_count; i ++) total += samples[i].matched;
 
-    return type.get_instance_by_id(handle.index);
+    return static_cast<f64_t>(total) / static_cast<f64_t>(sample_count);
   }
 
-  void ECS::destroy_component_by_id (u32_t index, ComponentType::ID type_id) {
-    Entity& ent = get_entity(index);
+  void SystemProfile::clear () {
+    memory::clear(samples, history_size);
 
-    if (ent.enabled_components.match_index(type_id)) {
-      ent.enabled_components.unset(type_id);
-      component_types[type_id].destroy_instance(index);
-    }
+    sample_count = 0;
+    next_sample = 0;
   }
 
-  void ECS::destroy_component_by_id (EntityHandle& handle, ComponentType::ID type_id) {
-    Entity& ent = *handle;
+  void SystemProfile::record (u64_t ticks, u32_t visited, u32_t matched) {
+    samples[next_sample] = { ticks, visited, matched };
 
-    if (ent.enabled_components.match_index(type_id)) {
-      ent.enabled_components.unset(type_id);
-      component_types[type_id].destroy_instance(handle.index);
-    }
+    next_sample = (next_sample + 1) % history_size;
+
+    if (sample_count < history_size) ++ sample_count;
   }
 
 
-  s32_t ECS::get_system_index_by_id (System::ID id) const {
-    for (System::ID i = 0; i < system_count; i ++) {
-      if (systems[i].id == id) return i;
-    }
 
-    return -1;
-  }
+  struct WriteVersion {
+    u32_t serial;
+    u64_t version;
+  };
 
-  s32_t ECS::get_system_index_by_name (char const* name) const {
-    for (System::ID i = 0; i < system_count; i ++) {
-      if (str_cmp_caseless(systems[i].name, name) == 0) return i;
-    }
+  // The run version of the System executing on this thread, so Component writes made by it are stamped with it
+  static thread_local WriteVersion write_version = { 0, 0 };
 
-    return -1;
+
+  void System::advance_version (ECS* ecs) {
+    last_run_version = run_version;
+    run_version = ecs->change_version.fetch_add(1, std::memory_order_relaxed) + 1;
   }
 
-  System& ECS::get_system_by_id (System::ID id) const {
-    for (System::ID i = 0; i < system_count; i ++) {
-      if (systems[i].id == id) return const_cast<System&>(systems[i]);
-    }
 
-    m_error("Could not find System with id %" PRIu64, static_cast<u64_t>(id));
+  u32_t System::get_grain_size (ECS const* ecs) const {
+    if (grain_size != 0) return grain_size;
+    if (ecs->parallel_tuning && tuned_grain_size != 0) return tuned_grain_size;
+    return ecs->system_grain_size;
   }
 
-  System& ECS::get_system_by_name (char const* name) const {
-    for (System::ID i = 0; i < system_count; i ++) {
-      if (str_cmp_caseless(systems[i].name, name) == 0) return const_cast<System&>(systems[i]);
-    }
+  void System::update_cost (ECS const* ecs, u64_t ticks, u32_t match_count) {
+    if (match_count == 0) return;
 
-    m_error("Could not find System with name %s", name);
-  }
+    f64_t cost = static_cast<f64_t>(ticks) / static_cast<f64_t>(match_count);
 
+    entity_cost = entity_cost < 0? cost : entity_cost + (cost - entity_cost) * ECS::tuning_rate;
 
-  System::ID ECS::create_system (char const* name, System::CustomCallback callback) {
-    validate_system_count();
-    
-    return init_system(system_count, name, callback);
+    // Systems too cheap to time get a grain size that keeps them sequential
+    tuned_grain_size = entity_cost > 0
+      ? static_cast<u32_t>(num::clamp(ecs->parallel_grain_ticks / entity_cost, 1.0, static_cast<f64_t>(std::numeric_limits<u32_t>::max())))
+      : std::numeric_limits<u32_t>::max();
   }
 
-  System::ID ECS::create_system_before (System::ID before_target, char const* name, System::CustomCallback callback) {
-    validate_system_count();
+  bool System::should_execute_parallel (ECS const* ecs, u32_t match_count) const {
+    if (!ecs->parallel_tuning) return ecs->thread_pool != NULL;
 
-    s32_t index = get_system_index_by_id(before_target);
-    
-    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s before it", static_cast<u64_t>(before_target), name);
+    // Unmeasured Systems run sequentially once to take their first measurement
+    if (entity_cost < 0) return false;
 
-    shift_systems(index);
+    u32_t grain = get_grain_size(ecs);
+    u32_t threads = ecs->thread_pool != NULL? num::min(ecs->max_threads, ecs->thread_pool->worker_count) : ecs->max_threads;
+    f64_t width = static_cast<f64_t>(num::min(threads + 1u, match_count / grain + (match_count % grain != 0)));
+    f64_t work = entity_cost * static_cast<f64_t>(match_count);
 
-    return init_system(index, name, callback);;
+    return work - work / width > ecs->parallel_overhead;
   }
 
-  System::ID ECS::create_system_before (char const* before_name, char const* name, System::CustomCallback callback) {
-    validate_system_count();
 
-    s32_t index = get_system_index_by_name(before_name);
-    
-    m_assert(index != -1, "Cannot find System with name %s in order to add new System %s before it", before_name, name);
+  u32_t System::iterator_execution_instance (SystemIteratorArg* arg) {
+    ECS* ecs = arg->ecs;
+    System* sys = arg->sys;
 
-    shift_systems(index);
+    u32_t archetype_base = 0;
+    u32_t visited = 0;
 
-    return init_system(index, name, callback);;
-  }
+    for (u32_t i = 0; i < sys->query.archetype_indices.count && archetype_base < arg->range_ext; i ++) {
+      Archetype& archetype = ecs->archetypes[sys->query.archetype_indices[i]];
 
-  System::ID ECS::create_system_after (System::ID after_target, char const* name, System::CustomCallback callback) {
-    validate_system_count();
-    
-    s32_t index = get_system_index_by_id(after_target);
-    
-    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s after it", static_cast<u64_t>(after_target), name);
+      u32_t archetype_ext = archetype_base + archetype.count;
 
-    ++ index;
+      if (archetype_ext > arg->range_base) {
+        u32_t row = num::max(arg->range_base, archetype_base) - archetype_base;
+        u32_t row_ext = num::min(arg->range_ext, archetype_ext) - archetype_base;
 
-    shift_systems(index);
+        while (row < row_ext) {
+          u32_t chunk_index = row / archetype.chunk_capacity;
+          u32_t chunk_row = row % archetype.chunk_capacity;
+          u32_t chunk_row_ext = num::min(archetype.chunk_capacity, chunk_row + (row_ext - row));
 
-    return init_system(index, name, callback);;
-  }
+          row += chunk_row_ext - chunk_row;
 
-  System::ID ECS::create_system_after (char const* after_name, char const* name, System::CustomCallback callback) {
-    validate_system_count();
-    
-    s32_t index = get_system_index_by_name(after_name);
+          if (sys->query.changed_components.any_bits()) {
+            ecs->each_changed_run(sys->query.changed_components, sys->last_run_version, archetype, chunk_index, chunk_row, chunk_row_ext, [&] (u32_t run_row, u32_t run_row_ext) {
+              sys->chunk_callback(ecs, archetype, chunk_index, run_row, run_row_ext);
+              visited += run_row_ext - run_row;
+            });
+          } else {
+            sys->chunk_callback(ecs, archetype, chunk_index, chunk_row, chunk_row_ext);
+            visited += chunk_row_ext - chunk_row;
+          }
+        }
+      }
+
+      archetype_base = archetype_ext;
+    }
+
+    return visited;
+  }
+
+  u64_t System::claim_ranges (SystemIteratorArg* arg) {
+    ECS* ecs = arg->ecs;
+    System* sys = arg->sys;
+
+    u64_t start = SDL_GetPerformanceCounter();
+
+    u32_t grain = sys->get_grain_size(ecs);
+    u32_t count = ecs->system_iterator_count;
+    u32_t base = ecs->system_iterator_cursor.load(std::memory_order_relaxed);
+    u32_t visited = 0;
+
+    while (base < count) {
+      // Claim large ranges while there is plenty of work left, shrinking toward the grain size so the tail balances across workers
+      u32_t claim = num::max(grain, (count - base) / (ecs->max_iterators * 2));
+      u32_t ext = num::min(count, base + claim);
+
+      if (ecs->system_iterator_cursor.compare_exchange_weak(base, ext, std::memory_order_relaxed)) {
+        SystemIteratorArg range = { ecs, sys, base, ext };
+
+        visited += iterator_execution_instance(&range);
+
+        base = ecs->system_iterator_cursor.load(std::memory_order_relaxed);
+      }
+    }
+
+    u64_t ticks = SDL_GetPerformanceCounter() - start;
+
+    ecs->system_iterator_visited.fetch_add(visited, std::memory_order_relaxed);
+    ecs->system_iterator_ticks.fetch_add(ticks, std::memory_order_relaxed);
+
+    return ticks;
+  }
+
+  void System::parallel_execution_instance (SystemIteratorArg* arg) {
+    ECS* ecs = arg->ecs;
+
+    WriteVersion saved_write_version = write_version;
+    write_version = { ecs->serial, arg->sys->run_version };
+
+    u64_t ticks = claim_ranges(arg);
+
+    write_version = saved_write_version;
+
+    // Slot 0 belongs to the thread which started the execution
+    if (ecs->system_profiles != NULL) ecs->system_profiles[arg->sys->id].worker_ticks[pointer_to_index(ecs->system_iterator_args, arg) + 1] = ticks;
+
+    arg->ecs->system_iterator_pending.fetch_sub(1, std::memory_order_release);
+  }
+
+  u32_t System::execute_parallel (ECS* ecs, u32_t match_count) const {
+    u32_t grain = get_grain_size(ecs);
+
+    if (match_count <= grain) return execute_sequential(ecs, match_count);
+
+    // The calling thread claims ranges too, so one fewer job is queued
+    u32_t job_count = num::min(ecs->max_iterators, (match_count + grain - 1) / grain) - 1;
+
+    SystemProfile* profile = ecs->system_profiles != NULL? ecs->system_profiles + id : NULL;
+
+    if (profile != NULL) {
+      profile->worker_ticks.clear();
+
+      for (u32_t i = 0; i <= job_count; i ++) profile->worker_ticks.append(static_cast<u64_t>(0));
+    }
+
+    ecs->system_iterator_count = match_count;
+    ecs->system_iterator_cursor.store(0, std::memory_order_relaxed);
+    ecs->system_iterator_pending.store(job_count, std::memory_order_relaxed);
+    ecs->system_iterator_visited.store(0, std::memory_order_relaxed);
+    ecs->system_iterator_ticks.store(0, std::memory_order_relaxed);
+
+    u64_t start = SDL_GetPerformanceCounter();
+
+    for (u32_t i = 0; i < job_count; i ++) {
+      SystemIteratorArg& arg = ecs->system_iterator_args[i];
+
+      arg.sys = const_cast<System*>(this);
+
+      ecs->thread_pool->queue(reinterpret_cast<Job::Callback>(System::parallel_execution_instance), &arg, JobPriority::High);
+    }
+
+    SystemIteratorArg arg = { ecs, const_cast<System*>(this), 0, 0 };
+
+    u64_t caller_ticks = claim_ranges(&arg);
+
+    if (profile != NULL) profile->worker_ticks[0] = caller_ticks;
+
+    ecs->thread_pool->await_counter(ecs->system_iterator_pending);
+
+    u64_t ticks = SDL_GetPerformanceCounter() - start;
+    u64_t work_ticks = ecs->system_iterator_ticks.load(std::memory_order_relaxed);
+
+    const_cast<System*>(this)->update_cost(ecs, work_ticks, match_count);
+
+    // Whatever the wall time exceeds a perfect split of the work by is attributed to dispatch;
+    // single samples may at most double the estimate, so a preempted execution cannot keep the pool disabled
+    f64_t overhead = static_cast<f64_t>(ticks) - static_cast<f64_t>(work_ticks) / static_cast<f64_t>(job_count + 1);
+    overhead = num::clamp(overhead, 0.0, ecs->parallel_overhead * 2.0);
+
+    ecs->parallel_overhead += (overhead - ecs->parallel_overhead) * ECS::tuning_rate;
+
+    return ecs->system_iterator_visited.load(std::memory_order_relaxed);
+  }
+
+  u32_t System::execute_sequential (ECS* ecs, u32_t match_count) const {
+    SystemIteratorArg arg = {
+      ecs, const_cast<System*>(this),
+      0, match_count
+    };
+
+    u64_t start = SDL_GetPerformanceCounter();
+    
+    u32_t visited = iterator_execution_instance(&arg);
+
+    const_cast<System*>(this)->update_cost(ecs, SDL_GetPerformanceCounter() - start, match_count);
+
+    return visited;
+  }
+
+  SystemProfile* System::begin_profile (ECS* ecs, u64_t& start) const {
+    if (ecs->system_profiles == NULL) return NULL;
+
+    SystemProfile* profile = ecs->system_profiles + id;
+
+    profile->worker_ticks.clear();
+
+    start = SDL_GetPerformanceCounter();
+
+    return profile;
+  }
+
+  void System::end_profile (SystemProfile* profile, u64_t start, u32_t visited, u32_t matched) const {
+    if (profile == NULL) return;
+
+    profile->record(SDL_GetPerformanceCounter() - start, visited, matched);
+  }
+
+  void System::execute_scheduled (ECS* ecs) const {
+    u64_t start;
+    SystemProfile* profile = begin_profile(ecs, start);
+
+    // Scheduled Systems already occupy a worker, so they iterate sequentially rather than awaiting the pool from inside it
+    WriteVersion saved_write_version = write_version;
+    write_version = { ecs->serial, run_version };
+
+    u32_t visited = 0;
+    u32_t match_count = 0;
+
+    if (custom) {
+      custom_callback(ecs);
+    } else {
+      const_cast<System*>(this)->query.update(ecs);
+
+      match_count = query.get_match_count(ecs);
+
+      ecs->begin_iteration();
+
+      visited = execute_sequential(ecs, match_count);
+
+      ecs->end_iteration();
+    }
+
+    write_version = saved_write_version;
+
+    end_profile(profile, start, visited, match_count);
+  }
+
+  void System::execute (ECS* ecs) const {
+    if (enabled) {
+      const_cast<System*>(this)->advance_version(ecs);
+
+      u64_t start;
+      SystemProfile* profile = begin_profile(ecs, start);
+
+      WriteVersion saved_write_version = write_version;
+      write_version = { ecs->serial, run_version };
+
+      u32_t visited = 0;
+      u32_t match_count = 0;
+
+      if (custom) {
+        custom_callback(ecs);
+      } else {
+        const_cast<System*>(this)->query.update(ecs);
+
+        match_count = query.get_match_count(ecs);
+
+        bool use_parallel = parallel && should_execute_parallel(ecs, match_count);
+
+        if (use_parallel) ecs->enable_thread_pool();
+
+        ecs->begin_iteration();
+
+        if (use_parallel) {
+          visited = execute_parallel(ecs, match_count);
+        } else {
+          visited = execute_sequential(ecs, match_count);
+        }
+
+        ecs->end_iteration();
+      }
+
+      write_version = saved_write_version;
+
+      end_profile(profile, start, visited, match_count);
+    }
+  }
+
+
+  void SystemScheduleNode::execution_instance (SystemScheduleNode* node) {
+    ECS* ecs = node->ecs;
+
+    node->sys->execute_scheduled(ecs);
+
+    for (u32_t i = 0; i < node->dependent_count; i ++) {
+      SystemScheduleNode* dependent = ecs->system_schedule + ecs->system_schedule_dependents[node->dependent_base + i];
+
+      if (dependent->dependency_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        ecs->thread_pool->queue(reinterpret_cast<Job::Callback>(SystemScheduleNode::execution_instance), dependent, JobPriority::High);
+      }
+    }
+
+    ecs->system_schedule_remaining.fetch_sub(1, std::memory_order_release);
+  }
+
+
+  DeferredEntity CommandBuffer::create_entity () {
+    record(CommandType::CreateEntity, 0, { { }, no_pending });
+
+    return { pending_count ++ };
+  }
+
+
+  void CommandBuffer::destroy_entity (u32_t index) {
+    record(CommandType::DestroyEntity, 0, get_target(index));
+  }
+
+  void CommandBuffer::destroy_entity (EntityHandle const& handle) {
+    record(CommandType::DestroyEntity, 0, get_target(handle));
+  }
+
+
+  void CommandBuffer::add_component_by_id (u32_t index, ComponentType::ID type_id, void const* data) {
+    memory::copy(record(CommandType::AddComponent, type_id, get_target(index), ecs->component_types[type_id].instance_size), data, ecs->component_types[type_id].instance_size);
+  }
+
+  void CommandBuffer::add_component_by_id (EntityHandle const& handle, ComponentType::ID type_id, void const* data) {
+    memory::copy(record(CommandType::AddComponent, type_id, get_target(handle), ecs->component_types[type_id].instance_size), data, ecs->component_types[type_id].instance_size);
+  }
+
+  void CommandBuffer::add_component_by_id (DeferredEntity entity, ComponentType::ID type_id, void const* data) {
+    memory::copy(record(CommandType::AddComponent, type_id, get_target(entity), ecs->component_types[type_id].instance_size), data, ecs->component_types[type_id].instance_size);
+  }
+
+
+  void CommandBuffer::destroy_component_by_id (u32_t index, ComponentType::ID type_id) {
+    record(CommandType::DestroyComponent, type_id, get_target(index));
+  }
+
+  void CommandBuffer::destroy_component_by_id (EntityHandle const& handle, ComponentType::ID type_id) {
+    record(CommandType::DestroyComponent, type_id, get_target(handle));
+  }
+
+  void CommandBuffer::destroy_component_by_id (DeferredEntity entity, ComponentType::ID type_id) {
+    record(CommandType::DestroyComponent, type_id, get_target(entity));
+  }
+
+
+  CommandBuffer::Target CommandBuffer::get_target (u32_t index) const {
+    return { ecs->get_handle(index), no_pending };
+  }
+
+  CommandBuffer::Target CommandBuffer::get_target (EntityHandle const& handle) const {
+    return { handle, no_pending };
+  }
+
+  CommandBuffer::Target CommandBuffer::get_target (DeferredEntity entity) const {
+    m_assert(entity.index < pending_count, "Cannot target DeferredEntity %" PRIu32 ", it was not created by this CommandBuffer", entity.index);
+
+    return { { }, entity.index };
+  }
+
+  void* CommandBuffer::record (u8_t type, ComponentType::ID type_id, Target const& target, size_t data_size) {
+    m_assert(type_id < ecs->component_type_count, "Cannot record %s command for out of range ComponentType with id %" PRIu64, CommandType::name(type), static_cast<u64_t>(type_id));
+
+    u32_t data_offset = static_cast<u32_t>((data.count + data_alignment - 1) & ~(data_alignment - 1));
+
+    if (data_size != 0) {
+      data.reallocate(data_offset + data_size);
+      data.count = data_offset + data_size;
+    }
+
+    commands.append({ type, type_id, commands.count, data_offset, this, target });
+
+    return data.elements + data_offset;
+  }
+
+  void CommandBuffer::clear () {
+    commands.clear();
+    data.clear();
+    created_entities.clear();
+    pending_count = 0;
+    playback_base = 0;
+  }
+
+  void CommandBuffer::destroy () {
+    commands.destroy();
+    data.destroy();
+    created_entities.destroy();
+  }
+
+
+  static s32_t compare_commands (void const* l, void const* r) {
+    auto a = static_cast<CommandBuffer::Command const*>(l);
+    auto b = static_cast<CommandBuffer::Command const*>(r);
+
+    // Targets are resolved before sorting, so all commands on one Entity are adjacent;
+    // they must keep their recorded order, as reordering e.g. a destroy and an add changes the result
+    if (a->target.handle.index != b->target.handle.index) return a->target.handle.index < b->target.handle.index? -1 : 1;
+    if (a->buffer != b->buffer) return a->buffer < b->buffer? -1 : 1;
+    if (a->sequence != b->sequence) return a->sequence < b->sequence? -1 : 1;
+    return 0;
+  }
+
+
+  static thread_local struct {
+    u32_t serial;
+    CommandBuffer* buffer;
+  } command_buffer_cache = { 0, NULL };
+
+
+  static std::atomic<u32_t> ecs_serial_counter { 1 };
+
+  ECS::ECS (u32_t in_entity_capacity, u32_t in_entity_thread_threshold, uint8_t in_max_threads, uint8_t thread_iterator_ratio, u8_t in_default_storage)
+  : serial(ecs_serial_counter.fetch_add(1, std::memory_order_relaxed))
+  , entities(memory::allocate<Entity>(in_entity_capacity))
+  , entity_count(0)
+  , entity_capacity(in_entity_capacity)
+  , free_entity_id(0)
+  , component_type_count(0)
+  , default_storage(in_default_storage)
+  , change_version(1)
+  , system_count(0)
+  , system_id_counter(1)
+  , system_iterator_args(NULL)
+  , max_threads(in_max_threads)
+  , max_iterators(thread_iterator_ratio * in_max_threads)
+  , system_grain_size(default_system_grain_size)
+  , system_iterator_count(0)
+  , system_iterator_cursor(0)
+  , system_iterator_pending(0)
+  , system_iterator_visited(0)
+  , system_iterator_ticks(0)
+  , entity_thread_threshold(in_entity_thread_threshold)
+  , parallel_tuning(true)
+  , parallel_overhead(default_parallel_overhead_us * static_cast<f64_t>(SDL_GetPerformanceFrequency()) / 1000000.0)
+  , parallel_grain_ticks(parallel_grain_us * static_cast<f64_t>(SDL_GetPerformanceFrequency()) / 1000000.0)
+  , parallel_systems(false)
+  , system_schedule(NULL)
+  , system_schedule_remaining(0)
+  , iteration_depth(0)
+  , system_profiles(NULL)
+  , hook_id_counter(1)
+  , hook_batch_depth(0)
+  , hook_invoke_depth(0)
+  , hook_removal_pending(false)
+  , thread_pool(NULL)
+  {
+    memory::clear(systems, System::max_systems);
+    mtx_init_safe(&command_buffer_mtx, mtx_plain);
+    m_assert(entities != NULL, "Out of memory or other null pointer error while allocating ECS entities with starting capacity %" PRIu32, entity_capacity);
+    m_assert(ComponentStorage::validate(default_storage), "Cannot create ECS with invalid default ComponentStorage %" PRIu8, default_storage);
+    m_assert(default_storage != ComponentStorage::Streamed, "Cannot create ECS with Streamed default ComponentStorage, Streamed storage must be chosen per ComponentType");
+    archetypes.append(Archetype { { }, component_types, 0 });
+    create_component_type<Transform3D>(NULL, NULL, transform3d_storage);
+    create_component_type<Child>();
+    create_component_type<Parent>();
+    create_component_type<SkeletonState>();
+    create_component_type<WorldTransform>();
+  }
+
+
+  void ECS::enable_thread_pool () {
+    if (thread_pool == NULL) {
+      system_iterator_args = memory::allocate<SystemIteratorArg>(max_iterators);
+
+      for (u32_t i = 0; i < max_iterators; i ++) {
+        system_iterator_args[i].ecs = this;
+      }
+
+      thread_pool = &JobSystem.get_pool();
+
+      thread_pool->set_trace_name(reinterpret_cast<Job::Callback>(System::parallel_execution_instance), "ECS System");
+      thread_pool->set_trace_name(reinterpret_cast<Job::Callback>(SystemScheduleNode::execution_instance), "ECS Schedule");
+    }
+  }
+
+  void ECS::disable_thread_pool () {
+    if (thread_pool != NULL) {
+      memory::deallocate(system_iterator_args);
+
+      thread_pool = NULL;
+    }
+  }
+
+
+  void ECS::destroy () {
+    disable_thread_pool();
+
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      ComponentType& type = component_types[i];
+
+      if (type.destroyer == NULL) continue;
+
+      for (u32_t j = 0; j < entity_count; j ++) {
+        if (entities[j].enabled_components[i]) type.destroyer(get_instance_by_id(j, i));
+      }
+    }
+
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      component_types[i].destroy();
+    }
+
+    for (auto [ i, archetype ] : archetypes) archetype.destroy();
+
+    archetypes.destroy();
+
+    memory::deallocate(entities);
+
+    entity_slots.destroy();
+
+    for (System::ID i = 0; i < system_count; i ++) {
+      systems[i].destroy();
+    }
+
+    if (system_schedule != NULL) memory::deallocate(system_schedule);
+
+    system_schedule_dependents.destroy();
+
+    disable_profiling();
+
+    for (auto [ i, buffer ] : command_buffers) {
+      buffer->destroy();
+      delete buffer;
+    }
+
+    command_buffers.destroy();
+    command_playback.destroy();
+
+    mtx_destroy(&command_buffer_mtx);
+
+    hook_events.destroy();
+
+    delete this;
+  }
+
+
+  void ECS::grow_allocation (u32_t additional_count) {
+    u32_t new_count = entity_count + additional_count;
+    u32_t new_capacity = entity_capacity;
+
+    while (new_capacity < new_count) new_capacity *= 2;
+
+    if (new_capacity > entity_capacity) {
+      memory::reallocate(entities, new_capacity);
+
+      m_assert(entities != NULL, "Out of memory or other null pointer error while reallocating ECS entities for capacity %" PRIu32, new_capacity);
+
+      entity_capacity = new_capacity;
+
+      for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+        component_types[i].reallocate(entity_capacity);
+      }
+    }
+  }
+
+
+  Entity::ID ECS::allocate_entity_id (u32_t index) {
+    Entity::ID id;
+
+    if (free_entity_id != 0) {
+      id = free_entity_id;
+
+      EntitySlot& slot = get_entity_slot(id);
+
+      free_entity_id = slot.index;
+
+      slot.index = index;
+    } else {
+      entity_slots.append({ index, 0 });
+
+      id = entity_slots.count;
+    }
+
+    return id;
+  }
+
+  EntityHandle ECS::create_entity () {
+    validate_structural_change("create an Entity");
+
+    grow_allocation();
+
+    Entity::ID id = allocate_entity_id(entity_count);
+
+    Entity* entity = entities + entity_count;
+
+    *entity = {
+      id,
+      { },
+      0, archetypes[0].append_row(entity_count, 0)
+    };
+
+    EntityHandle h = { this, entity_count, id, get_entity_slot(id).generation };
+
+    ++ entity_count;
+
+    return h;
+  }
+
+  u32_t ECS::create_entities (u32_t count, ComponentMask const& mask, void const* const* prototype_data, EntityHandle* out_handles) {
+    u32_t first_index = entity_count;
+
+    if (count == 0) return first_index;
+
+    validate_structural_change("create Entities");
+
+    m_assert(
+      mask.next_set_bit(component_type_count) == ComponentMask::bit_count,
+      "Cannot create Entities with out of range ComponentType with id %" PRIu64 " in mask",
+      static_cast<u64_t>(mask.next_set_bit(component_type_count))
+    );
+
+    if (prototype_data != NULL) {
+      u32_t prototype_index = 0;
+
+      for (size_t type_id = mask.next_set_bit(0); type_id < component_type_count; type_id = mask.next_set_bit(type_id + 1)) {
+        ComponentType const& type = component_types[type_id];
+
+        // Prototypes are copied bytewise into every new Entity, which is only sound for plain data with nothing to destroy
+        m_assert(
+          prototype_data[prototype_index] == NULL || type.destroyer == NULL,
+          "Cannot create Entities from a prototype for ComponentType %s, which has a destroyer; prototypes must be plain data",
+          type.name
+        );
+
+        ++ prototype_index;
+      }
+    }
+
+    grow_allocation(count);
+    entity_slots.reallocate(entity_slots.count + count);
+
+    u64_t version = get_write_version();
+    u32_t archetype_index = get_archetype(mask);
+    Archetype& archetype = archetypes[archetype_index];
+    u32_t first_row = archetype.append_rows(first_index, count, version);
+
+    for (u32_t i = 0; i < count; i ++) {
+      u32_t index = first_index + i;
+      Entity::ID id = allocate_entity_id(index);
+
+      entities[index] = { id, mask, archetype_index, first_row + i };
+
+      if (out_handles != NULL) out_handles[i] = { this, index, id, get_entity_slot(id).generation };
+    }
+
+    entity_count += count;
+
+    u32_t prototype_index = 0;
+
+    for (ComponentType::ID type_id = 0; type_id < component_type_count; type_id ++) {
+      if (!mask.match_index(type_id)) continue;
+
+      ComponentType& type = component_types[type_id];
+      void const* prototype = prototype_data != NULL? prototype_data[prototype_index] : NULL;
+
+      ++ prototype_index;
+
+      if (type.storage == ComponentStorage::Streamed) {
+        for (u32_t row = first_row; row < first_row + count; row ++) archetype.write_instance(type, row, prototype);
+      } else if (type.storage == ComponentStorage::Archetype) {
+        // Rows are contiguous within each chunk, so fill the first instance and then copy whole runs at once
+        for (u32_t row = first_row; row < first_row + count; ) {
+          u32_t chunk_index = row / archetype.chunk_capacity;
+          u32_t chunk_row = row % archetype.chunk_capacity;
+          u32_t run_count = num::min(archetype.chunk_capacity - chunk_row, first_row + count - row);
+
+          u8_t* base = static_cast<u8_t*>(archetype.get_column(chunk_index, type_id)) + chunk_row * type.instance_size;
+
+          if (prototype != NULL) {
+            for (u32_t j = 0; j < run_count; j ++) memory::copy(base + j * type.instance_size, prototype, type.instance_size);
+          } else {
+            memory::clear(base, run_count * type.instance_size);
+          }
+
+          row += run_count;
+        }
+      } else {
+        // Sparse slots handed out in a row are contiguous, just like the Dense instances of new Entities
+        if (type.storage == ComponentStorage::Sparse) {
+          for (u32_t j = 0; j < count; j ++) type.acquire_sparse_slot(first_index + j);
+        }
+
+        u8_t* base = static_cast<u8_t*>(type.get_instance_by_id(first_index));
+
+        if (prototype != NULL) {
+          for (u32_t j = 0; j < count; j ++) memory::copy(base + j * type.instance_size, prototype, type.instance_size);
+        } else {
+          memory::clear(base, count * type.instance_size);
+        }
+
+        for (u32_t j = 0; j < count; j ++) type.get_version(first_index + j) = version;
+      }
+    }
+
+    prototype_index = 0;
+
+    for (ComponentType::ID type_id = 0; type_id < component_type_count; type_id ++) {
+      if (!mask.match_index(type_id)) continue;
+
+      ComponentType& type = component_types[type_id];
+      bool has_prototype = prototype_data != NULL && prototype_data[prototype_index] != NULL;
+
+      ++ prototype_index;
+
+      if (type.has_hooks(ComponentEvent::Add)) dispatch_component_event_range(first_index, count, type_id, ComponentEvent::Add);
+      if (has_prototype && type.has_hooks(ComponentEvent::Set)) dispatch_component_event_range(first_index, count, type_id, ComponentEvent::Set);
+    }
+
+    return first_index;
+  }
+
+
+  void ECS::destroy_entity_components (u32_t index) {
+    // Destroyers may reach back into the ECS, so the Entity's mask and location are looked up again for every Component
+    for (size_t i = entities[index].enabled_components.next_set_bit(0); i < component_type_count; i = entities[index].enabled_components.next_set_bit(i + 1)) {
+      Entity& entity = entities[index];
+      ComponentType& type = component_types[i];
+
+      entity.enabled_components.unset(i);
+
+      if (type.destroyer != NULL) type.destroyer(get_instance_by_id(index, type.id));
+
+      if (type.storage == ComponentStorage::Sparse) type.release_sparse_slot(index);
+    }
+  }
+
+  void ECS::remove_entity (u32_t index) {
+    Entity& entity = entities[index];
+
+    // Retire the ID, bumping the generation invalidates any outstanding handles before the slot is reused
+    EntitySlot& slot = get_entity_slot(entity.id);
+
+    ++ slot.generation;
+    slot.index = free_entity_id;
+    free_entity_id = entity.id;
+
+    u32_t moved_entity_index = archetypes[entity.archetype_index].remove_row(entity.archetype_row, component_types, get_write_version());
+
+    if (moved_entity_index != Archetype::no_entity) entities[moved_entity_index].archetype_row = entity.archetype_row;
+
+    u32_t last_index = entity_count - 1;
+
+    if (index != last_index) {
+      Entity* last_entity = entities + last_index;
+
+      last_entity->enabled_components.each_set_bit([&] (size_t i) {
+        // Sparse instances stay where they are, only their owner index changes
+        if (component_types[i].storage == ComponentStorage::Dense) component_types[i].swap_instances(index, last_index);
+        else if (component_types[i].storage == ComponentStorage::Sparse) component_types[i].relocate_sparse_owner(index, last_index);
+      });
+
+      archetypes[last_entity->archetype_index].get_entity_index(last_entity->archetype_row) = index;
+
+      get_entity_slot(last_entity->id).index = index;
+
+      entity = *last_entity;
+    }
+
+    -- entity_count;
+  }
+
+
+  void ECS::destroy_entity (u32_t index) {
+    if (index >= entity_count) return;
+
+    validate_structural_change("destroy an Entity");
+
+    notify_entity_removal(&index, 1);
+
+    destroy_entity_components(index);
+
+    remove_entity(index);
+  }
+
+  void ECS::destroy_entity (EntityHandle& handle) {
+    destroy_entity(handle.verified().index);
+  }
+
+  static s32_t compare_indices_descending (void const* l, void const* r) {
+    u32_t a = *static_cast<u32_t const*>(l);
+    u32_t b = *static_cast<u32_t const*>(r);
+
+    return a > b? -1 : (a < b? 1 : 0);
+  }
+
+  void ECS::destroy_entities (EntityHandle const* handles, u32_t count) {
+    validate_structural_change("destroy Entities");
+
+    Array<EntityHandle> live_handles;
+
+    live_handles.reallocate(count);
+
+    for (u32_t i = 0; i < count; i ++) {
+      EntityHandle handle = handles[i];
+
+      if (handle.ecs == this && handle.update()) live_handles.append(handle);
+    }
+
+    Array<u32_t> indices;
+
+    indices.reallocate(live_handles.count);
+
+    for (auto [ i, handle ] : live_handles) indices.append(handle.index);
+
+    notify_entity_removal(indices.elements, indices.count);
+
+    // Destroyers may reach back into the ECS, so every handle is resolved again after all of them have run
+    for (auto [ i, handle ] : live_handles) {
+      if (handle.update()) destroy_entity_components(handle.index);
+    }
+
+    indices.clear();
+
+    for (auto [ i, handle ] : live_handles) {
+      if (handle.update()) indices.append(handle.index);
+    }
+
+    // Removing from the highest index down means the entity swapped into each hole is never one still waiting to be removed
+    qsort(indices.elements, indices.count, sizeof(u32_t), compare_indices_descending);
+
+    for (u32_t i = 0; i < indices.count; i ++) {
+      if (i > 0 && indices[i] == indices[i - 1]) continue;
+
+      remove_entity(indices[i]);
+    }
+
+    indices.destroy();
+    live_handles.destroy();
+  }
+
+
+  ComponentType& ECS::get_component_type_by_name (char const* name) const {
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      if (str_cmp_caseless(component_types[i].name, name) == 0) return const_cast<ComponentType&>(component_types[i]);
+    }
+    
+    String types;
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) types.fmt_append("'%s', \n", component_types[i].name);
+    m_error("Could not find ComponentType matching name %s. Registered component type names are:\n%s", name, types.value);
+  }
+
+
+  void* ECS::create_component_by_id (u32_t index, ComponentType::ID type_id) {
+    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+
+    Entity& entity = get_entity(index);
+    ComponentType& type = component_types[type_id];
+
+    m_assert(
+      !entity.enabled_components.match_index(type_id),
+      "Cannot create Component of type %s on Entity with ID %" PRIu64 " because a Component of this type already exists",
+      type.name, static_cast<u64_t>(entity.id)
+    );
+
+    void* ptr = enable_component(index, type_id);
+
+    if (ptr != NULL) memory::clear(ptr, type.instance_size);
+    else write_instance_by_id(index, type_id, NULL);
+
+    notify_component_hooks(index, type_id, ComponentEvent::Add);
+
+    return ptr;
+  }
+
+  void* ECS::create_component_by_id (EntityHandle& handle, ComponentType::ID type_id) {
+    return create_component_by_id(handle.verified().index, type_id);
+  }
+
+  void* ECS::add_component_by_id (u32_t index, ComponentType::ID type_id, void const* data) {
+    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+
+    Entity& entity = get_entity(index);
+    ComponentType& type = component_types[type_id];
+
+    m_assert(
+      !entity.enabled_components.match_index(type_id),
+      "Cannot add Component of type %s on Entity with ID %" PRIu64 " because a Component of this type already exists",
+      type.name, static_cast<u64_t>(entity.id)
+    );
+
+    void* ptr = enable_component(index, type_id);
+
+    if (ptr != NULL) memory::copy(ptr, data, type.instance_size);
+    else write_instance_by_id(index, type_id, data);
+
+    notify_component_hooks(index, type_id, ComponentEvent::Add);
+    notify_component_hooks(index, type_id, ComponentEvent::Set);
+
+    return ptr;
+  }
+
+  void* ECS::add_component_by_id (EntityHandle& handle, ComponentType::ID type_id, void const* data) {
+    return add_component_by_id(handle.verified().index, type_id, data);
+  }
+
+
+  void* ECS::get_component_by_id (u32_t index, ComponentType::ID type_id) const {
+    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+
+    Entity& entity = get_entity(index);
+    ComponentType const& type = component_types[type_id];
+
+    m_assert(
+      entity.enabled_components.match_index(type_id),
+      "Cannot get Component of type %s on Entity with ID %" PRIu64 " because a Component of this type does not exist for the given Entity",
+      type.name, static_cast<u64_t>(entity.id)
+    );
+
+    mark_changed(index, type_id, get_write_version());
+
+    return get_instance_by_id(index, type_id);
+  }
+
+  void* ECS::get_component_by_id (EntityHandle& handle, ComponentType::ID type_id) const {
+    return get_component_by_id(handle.verified().index, type_id);
+  }
+
+  void ECS::read_component_by_id (u32_t index, ComponentType::ID type_id, void* out) const {
+    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+
+    Entity& entity = get_entity(index);
+
+    m_assert(
+      entity.enabled_components.match_index(type_id),
+      "Cannot read Component of type %s on Entity with ID %" PRIu64 " because a Component of this type does not exist for the given Entity",
+      component_types[type_id].name, static_cast<u64_t>(entity.id)
+    );
+
+    read_instance_by_id(index, type_id, out);
+  }
+
+  void ECS::read_component_by_id (EntityHandle& handle, ComponentType::ID type_id, void* out) const {
+    read_component_by_id(handle.verified().index, type_id, out);
+  }
+
+  void ECS::write_component_by_id (u32_t index, ComponentType::ID type_id, void const* data) {
+    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+
+    if (!get_entity(index).enabled_components.match_index(type_id)) {
+      add_component_by_id(index, type_id, data);
+    } else {
+      mark_changed(index, type_id, get_write_version());
+
+      write_instance_by_id(index, type_id, data);
+
+      notify_component_hooks(index, type_id, ComponentEvent::Set);
+    }
+  }
+
+  void ECS::write_component_by_id (EntityHandle& handle, ComponentType::ID type_id, void const* data) {
+    write_component_by_id(handle.verified().index, type_id, data);
+  }
+
+  void ECS::destroy_component_by_id (u32_t index, ComponentType::ID type_id) {
+    Entity& ent = get_entity(index);
+
+    if (ent.enabled_components.match_index(type_id)) {
+      validate_structural_change("destroy a Component");
+
+      ComponentType& type = component_types[type_id];
+
+      notify_component_hooks(index, type_id, ComponentEvent::Remove);
+
+      ent.enabled_components.unset(type_id);
+
+      if (type.destroyer != NULL) type.destroyer(get_instance_by_id(index, type_id));
+
+      if (type.storage == ComponentStorage::Sparse) type.release_sparse_slot(index);
+
+      sync_archetype(index, type_id);
+    }
+  }
+
+  void ECS::destroy_component_by_id (EntityHandle& handle, ComponentType::ID type_id) {
+    destroy_component_by_id(handle.verified().index, type_id);
+  }
+
+
+  ComponentHook::ID ECS::add_component_hook (ComponentType::ID type_id, u8_t event, ComponentHook::Callback callback) {
+    m_assert(type_id < component_type_count, "Cannot get out of range ComponentType with id %" PRIu64, static_cast<u64_t>(type_id));
+    m_assert(ComponentEvent::validate(event), "Cannot add hook with invalid ComponentEvent %" PRIu8, event);
+
+    ComponentType& type = component_types[type_id];
+    ComponentHook::ID id = hook_id_counter;
+
+    ++ hook_id_counter;
+
+    type.hooks.append(new ComponentHook { id, event, callback, false });
+    type.hooked_events |= 1 << event;
+
+    return id;
+  }
+
+  bool ECS::remove_component_hook (ComponentHook::ID id) {
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      ComponentType& type = component_types[i];
+
+      for (u32_t j = 0; j < type.hooks.count; j ++) {
+        if (type.hooks[j]->id != id || type.hooks[j]->removed) continue;
+
+        // A running hook may be removing itself, so its callback cannot be destroyed until every invocation has returned
+        if (hook_invoke_depth > 0) {
+          type.hooks[j]->removed = true;
+          hook_removal_pending = true;
+        } else {
+          delete type.hooks[j];
+          type.hooks.remove(j);
+        }
+
+        type.hooked_events = 0;
+
+        for (auto [ k, hook ] : type.hooks) {
+          if (!hook->removed) type.hooked_events |= 1 << hook->event;
+        }
+
+        return true;
+      }
+    }
+
+    return false;
+  }
+
+  void ECS::begin_hook_batch () {
+    ++ hook_batch_depth;
+  }
+
+  void ECS::end_hook_batch () {
+    m_assert(hook_batch_depth > 0, "Cannot end hook batch, no batch is open");
+
+    -- hook_batch_depth;
+
+    if (hook_batch_depth == 0) deliver_hook_events();
+  }
+
+
+  void ECS::dispatch_component_event (u32_t index, ComponentType::ID type_id, u8_t event) {
+    validate_hook_dispatch(type_id);
+
+    // Removals cannot be queued, the Component is gone by the time the batch ends
+    if (hook_batch_depth > 0 && event != ComponentEvent::Remove) {
+      Entity::ID id = entities[index].id;
+
+      hook_events.append({ id, get_entity_slot(id).generation, type_id, event });
+    } else {
+      invoke_component_hooks(type_id, event, &index, 1);
+    }
+  }
+
+  void ECS::dispatch_component_event_range (u32_t first_index, u32_t count, ComponentType::ID type_id, u8_t event) {
+    validate_hook_dispatch(type_id);
+
+    if (hook_batch_depth > 0 && event != ComponentEvent::Remove) {
+      hook_events.reallocate(hook_events.count + count);
+
+      for (u32_t i = first_index; i < first_index + count; i ++) {
+        Entity::ID id = entities[i].id;
+
+        hook_events.append({ id, get_entity_slot(id).generation, type_id, event });
+      }
+    } else {
+      Array<u32_t> indices;
+
+      indices.reallocate(count);
+
+      for (u32_t i = first_index; i < first_index + count; i ++) indices.append(i);
+
+      invoke_component_hooks(type_id, event, indices.elements, indices.count);
+
+      indices.destroy();
+    }
+  }
+
+  void ECS::notify_entity_removal (u32_t const* indices, u32_t count) {
+    if (count == 1) {
+      ComponentMask const& mask = entities[indices[0]].enabled_components;
+
+      for (size_t i = mask.next_set_bit(0); i < component_type_count; i = mask.next_set_bit(i + 1)) {
+        if (component_types[i].has_hooks(ComponentEvent::Remove)) invoke_component_hooks(i, ComponentEvent::Remove, indices, 1);
+      }
+
+      return;
+    }
+
+    // Every hooked ComponentType gets a single call with all of the Entities which have it
+    Array<u32_t> owners;
+
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      if (!component_types[i].has_hooks(ComponentEvent::Remove)) continue;
+
+      owners.clear();
+
+      for (u32_t j = 0; j < count; j ++) {
+        if (entities[indices[j]].enabled_components.match_index(i)) owners.append(indices[j]);
+      }
+
+      if (owners.count != 0) invoke_component_hooks(i, ComponentEvent::Remove, owners.elements, owners.count);
+    }
+
+    owners.destroy();
+  }
+
+  void ECS::invoke_component_hooks (ComponentType::ID type_id, u8_t event, u32_t const* indices, u32_t count) {
+    ComponentType& type = component_types[type_id];
+
+    ++ hook_invoke_depth;
+
+    for (u32_t i = 0; i < type.hooks.count; i ++) {
+      ComponentHook* hook = type.hooks[i];
+
+      if (hook->event == event && !hook->removed) hook->callback(this, indices, count);
+    }
+
+    -- hook_invoke_depth;
+
+    if (hook_invoke_depth == 0 && hook_removal_pending) compact_component_hooks();
+  }
+
+  void ECS::compact_component_hooks () {
+    hook_removal_pending = false;
+
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      ComponentType& type = component_types[i];
+
+      for (u32_t j = 0; j < type.hooks.count; ) {
+        if (type.hooks[j]->removed) {
+          delete type.hooks[j];
+          type.hooks.remove(j);
+        } else {
+          ++ j;
+        }
+      }
+    }
+  }
+
+  static s32_t compare_hook_events (void const* l, void const* r) {
+    HookEvent const& a = *static_cast<HookEvent const*>(l);
+    HookEvent const& b = *static_cast<HookEvent const*>(r);
+
+    if (a.type_id != b.type_id) return a.type_id < b.type_id? -1 : 1;
+    if (a.event != b.event) return a.event < b.event? -1 : 1;
+    if (a.entity_id != b.entity_id) return a.entity_id < b.entity_id? -1 : 1;
+    if (a.generation != b.generation) return a.generation < b.generation? -1 : 1;
+
+    return 0;
+  }
+
+  void ECS::deliver_hook_events () {
+    Array<HookEvent> events;
+    Array<u32_t> indices;
+
+    // Hooks may cause more events while they run, so keep going until the queue is drained
+    while (hook_events.count != 0) {
+      events.clear();
+      events.append_multiple(hook_events.elements, hook_events.count);
+      hook_events.clear();
+
+      qsort(events.elements, events.count, sizeof(HookEvent), compare_hook_events);
+
+      u32_t group_base = 0;
+
+      for (u32_t i = 1; i <= events.count; i ++) {
+        HookEvent const& group = events[group_base];
+
+        if (i < events.count && events[i].type_id == group.type_id && events[i].event == group.event) continue;
+
+        // Entities are resolved per group, as hooks for an earlier group may have moved them
+        indices.clear();
+
+        for (u32_t j = group_base; j < i; j ++) {
+          HookEvent const& event = events[j];
+
+          if (j > group_base && event.entity_id == events[j - 1].entity_id && event.generation == events[j - 1].generation) continue;
+
+          EntityHandle handle = { this, 0, event.entity_id, event.generation };
+
+          if (handle.update() && entities[handle.index].enabled_components.match_index(event.type_id)) indices.append(handle.index);
+        }
+
+        if (indices.count != 0) invoke_component_hooks(group.type_id, group.event, indices.elements, indices.count);
+
+        group_base = i;
+      }
+    }
+
+    events.destroy();
+    indices.destroy();
+  }
+
+
+  s32_t ECS::get_system_index_by_id (System::ID id) const {
+    for (System::ID i = 0; i < system_count; i ++) {
+      if (systems[i].id == id) return i;
+    }
+
+    return -1;
+  }
+
+  s32_t ECS::get_system_index_by_name (char const* name) const {
+    for (System::ID i = 0; i < system_count; i ++) {
+      if (str_cmp_caseless(systems[i].name, name) == 0) return i;
+    }
+
+    return -1;
+  }
+
+  System& ECS::get_system_by_id (System::ID id) const {
+    for (System::ID i = 0; i < system_count; i ++) {
+      if (systems[i].id == id) return const_cast<System&>(systems[i]);
+    }
+
+    m_error("Could not find System with id %" PRIu64, static_cast<u64_t>(id));
+  }
+
+  System& ECS::get_system_by_name (char const* name) const {
+    for (System::ID i = 0; i < system_count; i ++) {
+      if (str_cmp_caseless(systems[i].name, name) == 0) return const_cast<System&>(systems[i]);
+    }
+
+    m_error("Could not find System with name %s", name);
+  }
+
+
+  System::ID ECS::create_system (char const* name, System::CustomCallback callback) {
+    validate_system_count();
+    
+    return init_system(system_count, name, callback);
+  }
+
+  System::ID ECS::create_system_before (System::ID before_target, char const* name, System::CustomCallback callback) {
+    validate_system_count();
+
+    s32_t index = get_system_index_by_id(before_target);
+    
+    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s before it", static_cast<u64_t>(before_target), name);
+
+    shift_systems(index);
+
+    return init_system(index, name, callback);;
+  }
+
+  System::ID ECS::create_system_before (char const* before_name, char const* name, System::CustomCallback callback) {
+    validate_system_count();
+
+    s32_t index = get_system_index_by_name(before_name);
+    
+    m_assert(index != -1, "Cannot find System with name %s in order to add new System %s before it", before_name, name);
+
+    shift_systems(index);
+
+    return init_system(index, name, callback);;
+  }
+
+  System::ID ECS::create_system_after (System::ID after_target, char const* name, System::CustomCallback callback) {
+    validate_system_count();
+    
+    s32_t index = get_system_index_by_id(after_target);
+    
+    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s after it", static_cast<u64_t>(after_target), name);
+
+    ++ index;
+
+    shift_systems(index);
+
+    return init_system(index, name, callback);;
+  }
+
+  System::ID ECS::create_system_after (char const* after_name, char const* name, System::CustomCallback callback) {
+    validate_system_count();
+    
+    s32_t index = get_system_index_by_name(after_name);
+    
+    m_assert(index != -1, "Cannot find System with name %s in order to add new System %s after it", after_name, name);
+
+    ++ index;
+
+    shift_systems(index);
+
+    return init_system(index, name, callback);;
+  }
+
+
+  System::ID ECS::create_system (char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
+    return create_chunk_system(name, parallel, required_components, System::wrap_iterator_callback(callback));
+  }
+
+  System::ID ECS::create_system_before (System::ID before_target, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
+    return create_chunk_system_before(before_target, name, parallel, required_components, System::wrap_iterator_callback(callback));
+  }
+
+  System::ID ECS::create_system_before (char const* before_name, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
+    return create_chunk_system_before(before_name, name, parallel, required_components, System::wrap_iterator_callback(callback));
+  }
+
+  System::ID ECS::create_system_after (System::ID after_target, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
+    return create_chunk_system_after(after_target, name, parallel, required_components, System::wrap_iterator_callback(callback));
+  }
+
+  System::ID ECS::create_system_after (char const* after_name, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
+    return create_chunk_system_after(after_name, name, parallel, required_components, System::wrap_iterator_callback(callback));
+  }
+
+
+  System::ID ECS::create_chunk_system (char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback) {
+    validate_system_count();
+
+    return init_system(system_count, name, parallel, required_components, callback);
+  }
+
+  System::ID ECS::create_chunk_system_before (System::ID before_target, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback) {
+    validate_system_count();
+
+    s32_t index = get_system_index_by_id(before_target);
+    
+    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s before it", static_cast<u64_t>(before_target), name);
+
+    shift_systems(index);
+
+    return init_system(index, name, parallel, required_components, callback);
+  }
+
+  System::ID ECS::create_chunk_system_before (char const* before_name, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback) {
+    validate_system_count();
+
+    s32_t index = get_system_index_by_name(before_name);
+    
+    m_assert(index != -1, "Cannot find System with name %s in order to add new System %s before it", before_name, name);
+
+    shift_systems(index);
+
+    return init_system(index, name, parallel, required_components, callback);
+  }
+
+  System::ID ECS::create_chunk_system_after (System::ID after_target, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback) {
+    validate_system_count();
+
+    s32_t index = get_system_index_by_id(after_target);
+    
+    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s after it", static_cast<u64_t>(after_target), name);
+
+    ++ index;
+
+    shift_systems(index);
+
+    return init_system(index, name, parallel, required_components, callback);
+  }
+
+  System::ID ECS::create_chunk_system_after (char const* after_name, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback) {
+    validate_system_count();
+
+    s32_t index = get_system_index_by_name(after_name);
     
     m_assert(index != -1, "Cannot find System with name %s in order to add new System %s after it", after_name, name);
 
-    ++ index;
+    ++ index;
+
+    shift_systems(index);
+
+    return init_system(index, name, parallel, required_components, callback);
+  }
+
+
+  void ECS::enable_profiling () {
+    if (system_profiles != NULL) return;
+
+    // System IDs start at 1, so there is one more profile than there can be Systems
+    system_profiles = memory::allocate<SystemProfile>(System::max_systems + 1);
+
+    m_assert(system_profiles != NULL, "Out of memory or other null pointer error while allocating ECS SystemProfiles");
+
+    memory::clear(system_profiles, System::max_systems + 1);
+  }
+
+  void ECS::disable_profiling () {
+    if (system_profiles == NULL) return;
+
+    for (size_t i = 0; i <= System::max_systems; i ++) system_profiles[i].destroy();
+
+    memory::deallocate(system_profiles);
+
+    system_profiles = NULL;
+  }
+
+  SystemProfile& ECS::get_system_profile (System::ID id) const {
+    m_assert(system_profiles != NULL, "Cannot get SystemProfile for System with id %" PRIu64 ", profiling is not enabled", static_cast<u64_t>(id));
+
+    return system_profiles[get_system_by_id(id).id];
+  }
+
+  SystemProfile& ECS::get_system_profile (char const* name) const {
+    m_assert(system_profiles != NULL, "Cannot get SystemProfile for System with name %s, profiling is not enabled", name);
+
+    return system_profiles[get_system_by_name(name).id];
+  }
+
+  void ECS::show_profiler (char const* title, bool* open) {
+    using namespace ImGui;
+
+    if (!Begin(title, open)) {
+      End();
+      return;
+    }
+
+    if (system_profiles == NULL) {
+      Text("Profiling is disabled");
+
+      if (Button("Enable")) enable_profiling();
+
+      End();
+      return;
+    }
+
+    if (Button("Disable")) {
+      disable_profiling();
+
+      End();
+      return;
+    }
+
+    SameLine();
+
+    if (Button("Clear")) {
+      for (System::ID i = 0; i < system_count; i ++) system_profiles[systems[i].id].clear();
+    }
+
+    Columns(8, "systems");
+    Separator();
+    Text("System"); NextColumn();
+    Text("Last ms"); NextColumn();
+    Text("Avg ms"); NextColumn();
+    Text("P95 ms"); NextColumn();
+    Text("Visited"); NextColumn();
+    Text("Matched"); NextColumn();
+    Text("Workers ms"); NextColumn();
+    Text("ns/Entity (grain)"); NextColumn();
+    Separator();
+
+    f64_t ticks_per_ns = static_cast<f64_t>(SDL_GetPerformanceFrequency()) / 1000000000.0;
+
+    f64_t total_ms = 0;
+
+    for (System::ID i = 0; i < system_count; i ++) {
+      System const& sys = systems[i];
+      SystemProfile const& profile = system_profiles[sys.id];
+      SystemProfile::Sample const& latest = profile.get_latest();
+
+      if (sys.enabled) Text("%s", sys.name);
+      else TextDisabled("%s", sys.name);
+      NextColumn();
+
+      Text("%.3f", SystemProfile::ticks_to_ms(latest.ticks)); NextColumn();
+      Text("%.3f", profile.get_average_ms()); NextColumn();
+      Text("%.3f", profile.get_percentile_ms(95)); NextColumn();
+      Text("%.0f", profile.get_average_visited()); NextColumn();
+      Text("%.0f", profile.get_average_matched()); NextColumn();
+
+      if (profile.worker_ticks.count > 0) {
+        u64_t min_ticks = std::numeric_limits<u64_t>::max();
+        u64_t max_ticks = 0;
+
+        for (auto [ j, ticks ] : profile.worker_ticks) {
+          min_ticks = num::min(min_ticks, ticks);
+          max_ticks = num::max(max_ticks, ticks);
+        }
+
+        Text("%zu: %.3f - %.3f", profile.worker_ticks.count, SystemProfile::ticks_to_ms(min_ticks), SystemProfile::ticks_to_ms(max_ticks));
+
+        if (IsItemHovered()) {
+          BeginTooltip();
+
+          for (auto [ j, ticks ] : profile.worker_ticks) Text("%zu: %.3f ms", j, SystemProfile::ticks_to_ms(ticks));
+
+          EndTooltip();
+        }
+      } else {
+        TextDisabled("-");
+      }
+      NextColumn();
+
+      if (!sys.custom && sys.entity_cost >= 0) Text("%.1f (%" PRIu32 ")", sys.entity_cost / ticks_per_ns, sys.get_grain_size(this));
+      else TextDisabled("-");
+      NextColumn();
+
+      total_ms += profile.get_average_ms();
+    }
+
+    Columns(1);
+    Separator();
+    Text("Total average: %.3f ms", total_ms);
+    Checkbox("Parallel tuning", &parallel_tuning);
+    SameLine();
+    Text("Dispatch overhead: %.1f us", parallel_overhead / ticks_per_ns / 1000.0);
+
+    End();
+  }
+
+
+  void ECS::set_system_grain_size (System::ID id, u32_t grain_size) {
+    get_system_by_id(id).grain_size = grain_size;
+  }
+
+  void ECS::set_system_grain_size (char const* name, u32_t grain_size) {
+    get_system_by_name(name).grain_size = grain_size;
+  }
+
+
+  void ECS::set_system_changed_filter (System::ID id, ComponentMask changed_components) {
+    System& system = get_system_by_id(id);
+
+    m_assert(!system.custom, "Cannot set a changed filter on custom System %s, only iterator Systems have a Query", system.name);
+
+    system.query.changed_components = changed_components;
+  }
+
+
+  void ECS::set_system_access (System::ID id, ComponentMask reads, ComponentMask writes) {
+    System& system = get_system_by_id(id);
+
+    system.access_declared = true;
+    system.reads = reads;
+    system.writes = writes;
+  }
+
+  void ECS::set_system_access (char const* name, ComponentMask reads, ComponentMask writes) {
+    set_system_access(get_system_by_name(name).id, reads, writes);
+  }
+
+
+  namespace Snapshot {
+    static constexpr u8_t magic [4] = { 'M', 'E', 'C', 'S' };
+    static constexpr u32_t format_version = 1;
+    static constexpr size_t section_alignment = 16;
+    static constexpr size_t instance_alignment = 8;
+
+    struct Header {
+      u8_t magic [4];
+      u32_t format_version;
+      u32_t mask_size;
+      u32_t type_count;
+      u32_t entity_count;
+      u32_t slot_count;
+      Entity::ID free_entity_id;
+      u32_t reserved;
+      u64_t types_offset;
+      u64_t slots_offset;
+      u64_t ids_offset;
+      u64_t masks_offset;
+    };
+
+    struct TypeRecord {
+      u64_t name_offset;
+      u64_t data_offset;
+      u64_t data_size;
+      u32_t name_length;
+      u32_t instance_size;
+      u32_t instance_count;
+      u32_t serialized;
+    };
+
+    static u64_t reserve (Array<u8_t>& out, size_t size, size_t alignment = section_alignment) {
+      size_t offset = (out.count + alignment - 1) & ~(alignment - 1);
+
+      out.reallocate(offset + size);
+      memory::clear(out.elements + out.count, offset + size - out.count);
+      out.count = offset + size;
+
+      return offset;
+    }
+
+    static bool in_bounds (size_t size, u64_t offset, u64_t length) {
+      return offset <= size && length <= size - offset;
+    }
+  }
+
+
+  void ECS::write_snapshot (Array<u8_t>& out) const {
+    using namespace Snapshot;
+
+    out.clear();
+
+    u64_t header_offset = reserve(out, sizeof(Header));
+    u64_t types_offset = reserve(out, component_type_count * sizeof(TypeRecord));
+
+    TypeRecord records [ComponentType::max_component_types];
+    ComponentMask saved_mask;
+
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      ComponentType const& type = component_types[i];
+
+      if (type.serializer != NULL || type.destroyer == NULL) saved_mask.set(i);
 
-    shift_systems(index);
+      u32_t name_length = static_cast<u32_t>(strlen(type.name));
 
-    return init_system(index, name, callback);;
+      records[i] = { reserve(out, name_length, 1), 0, 0, name_length, static_cast<u32_t>(type.instance_size), 0, type.serializer != NULL };
+
+      memory::copy(out.elements + records[i].name_offset, type.name, name_length);
+    }
+
+    u64_t slots_offset = reserve(out, entity_slots.count * sizeof(EntitySlot));
+    memory::copy(out.elements + slots_offset, entity_slots.elements, entity_slots.count * sizeof(EntitySlot));
+
+    u64_t ids_offset = reserve(out, entity_count * sizeof(Entity::ID));
+    u64_t masks_offset = reserve(out, entity_count * sizeof(ComponentMask));
+
+    for (u32_t i = 0; i < entity_count; i ++) {
+      ComponentMask mask = entities[i].enabled_components & saved_mask;
+
+      memory::copy(out.elements + ids_offset + i * sizeof(Entity::ID), &entities[i].id, sizeof(Entity::ID));
+      memory::copy(out.elements + masks_offset + i * sizeof(ComponentMask), &mask, sizeof(ComponentMask));
+    }
+
+    // Each ComponentType's instances are stored contiguously in Entity order, so loading is a straight copy
+    for (ComponentType::ID i = 0; i < component_type_count; i ++) {
+      if (!saved_mask.match_index(i)) continue;
+
+      ComponentType const& type = component_types[i];
+      TypeRecord& record = records[i];
+
+      record.data_offset = reserve(out, 0);
+
+      for (u32_t j = 0; j < entity_count; j ++) {
+        if (!entities[j].enabled_components.match_index(i)) continue;
+
+        if (type.serializer != NULL) {
+          u64_t size_offset = reserve(out, sizeof(u32_t), instance_alignment);
+          u64_t instance_offset = out.count;
+
+          type.serializer(get_instance_by_id(j, i), out);
+
+          u32_t instance_size = static_cast<u32_t>(out.count - instance_offset);
+
+          memory::copy(out.elements + size_offset, &instance_size, sizeof(u32_t));
+        } else {
+          u64_t instance_offset = reserve(out, type.instance_size, instance_alignment);
+
+          read_instance_by_id(j, i, out.elements + instance_offset);
+        }
+
+        ++ record.instance_count;
+      }
+
+      record.data_size = out.count - record.data_offset;
+    }
+
+    Header header = {
+      { magic[0], magic[1], magic[2], magic[3] },
+      format_version,
+      sizeof(ComponentMask),
+      component_type_count,
+      entity_count,
+      static_cast<u32_t>(entity_slots.count),
+      free_entity_id,
+      0,
+      types_offset,
+      slots_offset,
+      ids_offset,
+      masks_offset
+    };
+
+    memory::copy(out.elements + header_offset, &header, sizeof(Header));
+    memory::copy(out.elements + types_offset, records, component_type_count * sizeof(TypeRecord));
   }
 
+  bool ECS::read_snapshot (void const* data, size_t size) {
+    using namespace Snapshot;
 
-  System::ID ECS::create_system (char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
-    validate_system_count();
+    m_assert(entity_count == 0, "Cannot read snapshot into an ECS which already has %" PRIu32 " Entities", entity_count);
 
-    return init_system(system_count, name, parallel, required_components, callback);
+    u8_t const* bytes = static_cast<u8_t const*>(data);
+
+    if (bytes == NULL || size < sizeof(Header)) return false;
+
+    Header const& header = *reinterpret_cast<Header const*>(bytes);
+
+    if (memcmp(header.magic, magic, sizeof(magic)) != 0
+    || header.format_version != format_version
+    || header.mask_size != sizeof(ComponentMask)
+    || header.type_count > ComponentType::max_component_types
+    || !in_bounds(size, header.types_offset, header.type_count * sizeof(TypeRecord))
+    || !in_bounds(size, header.slots_offset, header.slot_count * sizeof(EntitySlot))
+    || !in_bounds(size, header.ids_offset, header.entity_count * sizeof(Entity::ID))
+    || !in_bounds(size, header.masks_offset, header.entity_count * sizeof(ComponentMask))) return false;
+
+    TypeRecord const* records = reinterpret_cast<TypeRecord const*>(bytes + header.types_offset);
+    Entity::ID const* ids = reinterpret_cast<Entity::ID const*>(bytes + header.ids_offset);
+    ComponentMask const* saved_masks = reinterpret_cast<ComponentMask const*>(bytes + header.masks_offset);
+
+    // Map the snapshot's ComponentTypes to the ones registered in this ECS, by name and layout
+    s32_t type_map [ComponentType::max_component_types];
+
+    for (u32_t i = 0; i < header.type_count; i ++) {
+      TypeRecord const& record = records[i];
+
+      type_map[i] = -1;
+
+      if (!in_bounds(size, record.name_offset, record.name_length) || !in_bounds(size, record.data_offset, record.data_size)) return false;
+
+      char const* name = reinterpret_cast<char const*>(bytes + record.name_offset);
+
+      for (ComponentType::ID j = 0; j < component_type_count; j ++) {
+        ComponentType const& type = component_types[j];
+
+        if (strlen(type.name) != record.name_length || strncmp(type.name, name, record.name_length) != 0) continue;
+
+        bool compatible = record.serialized
+          ? type.deserializer != NULL
+          : type.serializer == NULL && type.instance_size == record.instance_size;
+
+        if (compatible) type_map[i] = j;
+
+        break;
+      }
+    }
+
+    // Everything is validated before any state changes, so a corrupt snapshot leaves the ECS untouched
+    EntitySlot const* slots = reinterpret_cast<EntitySlot const*>(bytes + header.slots_offset);
+
+    for (u32_t i = 0; i < header.entity_count; i ++) {
+      if (ids[i] == 0 || ids[i] > header.slot_count || slots[ids[i] - 1].index != i) return false;
+    }
+
+    // The free list threads through the unused slots' indices and must end in 0 without
+    // touching a live id or revisiting a slot, or allocate_entity_id would hand out duplicates
+    {
+      u8_t* slot_states = memory::allocate<u8_t>(header.slot_count + 1, true);
+
+      for (u32_t i = 0; i < header.entity_count; i ++) slot_states[ids[i]] = 1;
+
+      bool free_list_valid = true;
+      Entity::ID free_id = header.free_entity_id;
+
+      while (free_id != 0) {
+        if (free_id > header.slot_count || slot_states[free_id] != 0) {
+          free_list_valid = false;
+          break;
+        }
+
+        slot_states[free_id] = 2;
+        free_id = slots[free_id - 1].index;
+      }
+
+      memory::deallocate(slot_states);
+
+      if (!free_list_valid) return false;
+    }
+
+    for (u32_t i = 0; i < header.type_count; i ++) {
+      if (type_map[i] == -1) continue;
+
+      TypeRecord const& record = records[i];
+      ComponentType const& type = component_types[type_map[i]];
+
+      u64_t offset = record.data_offset;
+      u64_t data_ext = record.data_offset + record.data_size;
+
+      for (u32_t j = 0; j < header.entity_count; j ++) {
+        if (!saved_masks[j].match_index(i)) continue;
+
+        offset = (offset + instance_alignment - 1) & ~(instance_alignment - 1);
+
+        u64_t instance_size = type.instance_size;
+
+        if (record.serialized) {
+          if (offset + sizeof(u32_t) > data_ext) return false;
+
+          u32_t serialized_size;
+          memory::copy(&serialized_size, bytes + offset);
+          offset += sizeof(u32_t);
+
+          instance_size = serialized_size;
+        }
+
+        if (offset + instance_size > data_ext) return false;
+
+        offset += instance_size;
+      }
+    }
+
+    grow_allocation(header.entity_count);
+
+    entity_slots.clear();
+    entity_slots.append_multiple(slots, header.slot_count);
+    free_entity_id = header.free_entity_id;
+
+    u64_t version = get_write_version();
+
+    ComponentMask last_saved_mask;
+    ComponentMask mask;
+    u32_t archetype_index = 0;
+
+    for (u32_t i = 0; i < header.entity_count; i ++) {
+      // Entities sharing a mask are usually saved together, so the remapped mask and Archetype are reused while it repeats
+      if (i == 0 || saved_masks[i] != last_saved_mask) {
+        last_saved_mask = saved_masks[i];
+        mask = { };
+
+        for (u32_t j = 0; j < header.type_count; j ++) {
+          if (type_map[j] != -1 && last_saved_mask.match_index(j)) mask.set(type_map[j]);
+        }
+
+        archetype_index = get_archetype(mask);
+      }
+
+      entities[i] = { ids[i], mask, archetype_index, archetypes[archetype_index].append_row(i, version) };
+    }
+
+    entity_count = header.entity_count;
+
+    begin_hook_batch();
+
+    for (u32_t i = 0; i < header.type_count; i ++) {
+      if (type_map[i] == -1) continue;
+
+      TypeRecord const& record = records[i];
+      ComponentType& type = component_types[type_map[i]];
+
+      u64_t offset = record.data_offset;
+
+      for (u32_t j = 0; j < entity_count; j ++) {
+        if (!saved_masks[j].match_index(i)) continue;
+
+        if (type.storage == ComponentStorage::Sparse) type.acquire_sparse_slot(j);
+
+        offset = (offset + instance_alignment - 1) & ~(instance_alignment - 1);
+
+        if (record.serialized) {
+          u32_t instance_size;
+
+          memory::copy(&instance_size, bytes + offset);
+          offset += sizeof(u32_t);
+
+          type.deserializer(get_instance_by_id(j, type.id), this, bytes + offset, instance_size);
+          offset += instance_size;
+        } else {
+          write_instance_by_id(j, type.id, bytes + offset);
+          offset += type.instance_size;
+        }
+
+        if (!ComponentStorage::chunked(type.storage)) type.get_version(j) = version;
+
+        notify_component_hooks(j, type.id, ComponentEvent::Add);
+      }
+    }
+
+    end_hook_batch();
+
+    return true;
   }
 
-  System::ID ECS::create_system_before (System::ID before_target, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
-    validate_system_count();
+  bool ECS::save_snapshot (char const* path) const {
+    Array<u8_t> out;
 
-    s32_t index = get_system_index_by_id(before_target);
-    
-    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s before it", static_cast<u64_t>(before_target), name);
+    write_snapshot(out);
 
-    shift_systems(index);
+    bool saved = save_file(path, out.elements, out.count);
 
-    return init_system(index, name, parallel, required_components, callback);
+    out.destroy();
+
+    return saved;
   }
 
-  System::ID ECS::create_system_before (char const* before_name, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
-    validate_system_count();
+  bool ECS::load_snapshot (char const* path) {
+    MappedFile file { path };
 
-    s32_t index = get_system_index_by_name(before_name);
-    
-    m_assert(index != -1, "Cannot find System with name %s in order to add new System %s before it", before_name, name);
+    bool loaded = file.data != NULL && read_snapshot(file.data, file.size);
 
-    shift_systems(index);
+    file.destroy();
 
-    return init_system(index, name, parallel, required_components, callback);
+    return loaded;
   }
 
-  System::ID ECS::create_system_after (System::ID after_target, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
-    validate_system_count();
 
-    s32_t index = get_system_index_by_id(after_target);
-    
-    m_assert(index != -1, "Cannot find System with id %" PRIu64 " in order to add new System %s after it", static_cast<u64_t>(after_target), name);
+  u64_t ECS::get_write_version () const {
+    if (write_version.serial == serial) return write_version.version;
 
-    ++ index;
+    // Writes made outside of Systems must be seen by every System, including the one that ran most recently
+    return change_version.load(std::memory_order_relaxed) + 1;
+  }
 
-    shift_systems(index);
 
-    return init_system(index, name, parallel, required_components, callback);
+  CommandBuffer& ECS::get_command_buffer () {
+    if (command_buffer_cache.serial == serial) return *command_buffer_cache.buffer;
+
+    thrd_t current = thrd_current();
+    CommandBuffer* buffer = NULL;
+
+    mtx_lock_safe(&command_buffer_mtx);
+
+    for (auto [ i, existing_buffer ] : command_buffers) {
+      if (thrd_equal(existing_buffer->owner, current)) {
+        buffer = existing_buffer;
+        break;
+      }
+    }
+
+    if (buffer == NULL) {
+      buffer = new CommandBuffer { this, current };
+      command_buffers.append(buffer);
+    }
+
+    mtx_unlock_safe(&command_buffer_mtx);
+
+    command_buffer_cache.serial = serial;
+    command_buffer_cache.buffer = buffer;
+
+    return *buffer;
   }
 
-  System::ID ECS::create_system_after (char const* after_name, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
-    validate_system_count();
+  void ECS::flush_commands () {
+    // Destroyers and other callbacks may record more commands during playback, so keep going until every buffer is drained
+    while (true) {
+      u32_t create_count = 0;
 
-    s32_t index = get_system_index_by_name(after_name);
-    
-    m_assert(index != -1, "Cannot find System with name %s in order to add new System %s after it", after_name, name);
+      command_playback.clear();
 
-    ++ index;
+      for (auto [ i, buffer ] : command_buffers) {
+        for (u32_t j = buffer->playback_base; j < buffer->commands.count; j ++) {
+          if (buffer->commands[j].type == CommandType::CreateEntity) ++ create_count;
+          else command_playback.append(buffer->commands[j]);
+        }
+      }
 
-    shift_systems(index);
+      if (create_count == 0 && command_playback.count == 0) break;
 
-    return init_system(index, name, parallel, required_components, callback);
+      if (create_count != 0) {
+        u32_t created_index = create_entities(create_count, { });
+
+        for (auto [ i, buffer ] : command_buffers) {
+          for (u32_t j = buffer->playback_base; j < buffer->commands.count; j ++) {
+            if (buffer->commands[j].type == CommandType::CreateEntity) {
+              buffer->created_entities.append(get_handle(created_index));
+              ++ created_index;
+            }
+          }
+        }
+      }
+
+      for (auto [ i, buffer ] : command_buffers) buffer->playback_base = buffer->commands.count;
+
+      // Entities may have moved since their commands were recorded, so targets are resolved to their current index before sorting,
+      // and commands on Entities that no longer exist are dropped
+      u32_t live_count = 0;
+
+      for (auto [ i, command ] : command_playback) {
+        if (command.target.pending_index != CommandBuffer::no_pending) command.target.handle = command.buffer->created_entities[command.target.pending_index];
+
+        if (!command.target.handle.update()) continue;
+
+        command_playback[live_count] = command;
+        ++ live_count;
+      }
+
+      command_playback.count = live_count;
+
+      qsort(command_playback.elements, command_playback.count, sizeof(CommandBuffer::Command), compare_commands);
+
+      Array<EntityHandle> destroyed_entities;
+
+      // Events are delivered at the end of each round, so commands recorded by hooks are played back by the next one
+      begin_hook_batch();
+
+      for (auto [ i, command ] : command_playback) {
+        EntityHandle& handle = command.target.handle;
+
+        if (!handle.update()) continue;
+
+        // Entities are destroyed together after playback, so later commands on one already destroyed are dropped here
+        if (destroyed_entities.count != 0 && destroyed_entities[destroyed_entities.count - 1] == handle) continue;
+
+        switch (command.type) {
+          case CommandType::AddComponent: {
+            ComponentType& type = component_types[command.type_id];
+
+            bool added = false;
+
+            if (entities[handle.index].enabled_components.match_index(command.type_id)) {
+              if (type.destroyer != NULL) {
+                type.destroyer(get_instance_by_id(handle.index, command.type_id));
+
+                // The destroyer may have changed the Entity
+                if (!handle.update() || !entities[handle.index].enabled_components.match_index(command.type_id)) continue;
+              }
+            } else {
+              enable_component(handle.index, command.type_id);
+              added = true;
+            }
+
+            write_instance_by_id(handle.index, command.type_id, command.buffer->data.elements + command.data_offset);
+
+            if (added) notify_component_hooks(handle.index, command.type_id, ComponentEvent::Add);
+            notify_component_hooks(handle.index, command.type_id, ComponentEvent::Set);
+          } break;
+
+          case CommandType::DestroyComponent: {
+            destroy_component_by_id(handle.index, command.type_id);
+          } break;
+
+          case CommandType::DestroyEntity: {
+            destroyed_entities.append(handle);
+          } break;
+
+          default: m_error("Cannot play back command with invalid CommandType %" PRIu8, command.type);
+        }
+      }
+
+      destroy_entities(destroyed_entities);
+
+      destroyed_entities.destroy();
+
+      end_hook_batch();
+    }
+
+    for (auto [ i, buffer ] : command_buffers) buffer->clear();
+
+    command_playback.clear();
   }
 
 
   void ECS::update () {
-    if (entity_count >= entity_thread_threshold) enable_thread_pool();
+    if (parallel_systems || (!parallel_tuning && entity_count >= entity_thread_threshold)) enable_thread_pool();
     
-    for (System::ID i = 0; i < system_count; i ++) {
-      systems[i].execute(this);
+    System::ID i = 0;
+
+    while (i < system_count) {
+      if (parallel_systems && systems[i].enabled && systems[i].access_declared) {
+        i = execute_system_group(i);
+      } else {
+        systems[i].execute(this);
+        ++ i;
+      }
+
+      flush_commands();
+    }
+  }
+
+  System::ID ECS::execute_system_group (System::ID first) {
+    if (system_schedule == NULL) system_schedule = memory::allocate<SystemScheduleNode>(System::max_systems);
+
+    system_schedule_dependents.clear();
+
+    // Collect the run of Systems with declared access, up to the next exclusive System
+    System::ID end = first;
+    u32_t node_count = 0;
+
+    for (; end < system_count; end ++) {
+      System& system = systems[end];
+
+      if (!system.enabled) continue;
+      if (!system.access_declared) break;
+
+      SystemScheduleNode& node = system_schedule[node_count];
+
+      node.ecs = this;
+      node.sys = &system;
+      node.dependency_count.store(1, std::memory_order_relaxed); // held until the group is released below
+
+      ++ node_count;
+    }
+
+    if (node_count == 1) {
+      system_schedule[0].sys->execute(this);
+      return end;
+    }
+
+    // Versions are taken in System order up front, so writes by a later System are always newer than an earlier System's run
+    for (u32_t i = 0; i < node_count; i ++) system_schedule[i].sys->advance_version(this);
+
+    // Each System depends on every earlier System in the group whose access conflicts with its own,
+    // so the group produces the same results as running it in order
+    for (u32_t i = 0; i < node_count; i ++) {
+      SystemScheduleNode& node = system_schedule[i];
+
+      node.dependent_base = system_schedule_dependents.count;
+
+      for (u32_t j = i + 1; j < node_count; j ++) {
+        SystemScheduleNode& other = system_schedule[j];
+
+        if (node.sys->conflicts_with(*other.sys)) {
+          system_schedule_dependents.append(j);
+          other.dependency_count.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+
+      node.dependent_count = system_schedule_dependents.count - node.dependent_base;
+    }
+
+    system_schedule_remaining.store(node_count, std::memory_order_release);
+
+    for (u32_t i = 0; i < node_count; i ++) {
+      if (system_schedule[i].dependency_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        thread_pool->queue(reinterpret_cast<Job::Callback>(SystemScheduleNode::execution_instance), system_schedule + i, JobPriority::High);
+      }
+    }
+
+    thread_pool->await_counter(system_schedule_remaining);
+
+    return end;
+  }
+
+
+
+  u32_t ECS::get_archetype (ComponentMask const& mask) {
+    for (u32_t i = 0; i < archetypes.count; i ++) {
+      if (archetypes[i].mask == mask) return i;
+    }
+
+    archetypes.append(Archetype { mask, component_types, component_type_count });
+
+    return archetypes.count - 1;
+  }
+
+  u32_t ECS::get_archetype_edge (u32_t archetype_index, ComponentType::ID type_id) {
+    u32_t edge = archetypes[archetype_index].edges[type_id];
+
+    if (edge == Archetype::no_edge) {
+      ComponentMask mask = archetypes[archetype_index].mask;
+
+      mask.toggle(type_id);
+
+      edge = get_archetype(mask);
+
+      archetypes[archetype_index].edges[type_id] = edge;
+      archetypes[edge].edges[type_id] = archetype_index;
+    }
+
+    return edge;
+  }
+
+  void ECS::move_entity (u32_t index, u32_t archetype_index) {
+    Entity& entity = entities[index];
+
+    if (entity.archetype_index == archetype_index) return;
+
+    Archetype& src = archetypes[entity.archetype_index];
+    Archetype& dst = archetypes[archetype_index];
+
+    u32_t src_row = entity.archetype_row;
+    u64_t version = get_write_version();
+    u32_t dst_row = dst.append_row(index, version);
+
+    for (u32_t i = 0; i < dst.column_count; i ++) {
+      ComponentType::ID type_id = dst.column_type_ids[i];
+
+      if (src.mask.match_index(type_id)) dst.copy_instance(component_types[type_id], dst_row, src, src_row);
     }
+
+    u32_t moved_entity_index = src.remove_row(src_row, component_types, version);
+
+    if (moved_entity_index != Archetype::no_entity) entities[moved_entity_index].archetype_row = src_row;
+
+    entity.archetype_index = archetype_index;
+    entity.archetype_row = dst_row;
+  }
+
+  void ECS::sync_archetype (u32_t index, ComponentType::ID type_id) {
+    Entity& entity = entities[index];
+
+    ComponentMask expected_mask = archetypes[entity.archetype_index].mask;
+
+    if (expected_mask == entity.enabled_components) return;
+
+    expected_mask.toggle(type_id);
+
+    // Single Component changes follow the cached Archetype edges, anything else (e.g. changes made re-entrantly by a destroyer) falls back to a search
+    u32_t archetype_index = expected_mask == entity.enabled_components
+      ? get_archetype_edge(entity.archetype_index, type_id)
+      : get_archetype(entity.enabled_components);
+
+    move_entity(index, archetype_index);
+  }
+
+  void* ECS::enable_component (u32_t index, ComponentType::ID type_id) {
+    validate_structural_change("add a Component");
+
+    entities[index].enabled_components.set(type_id);
+
+    if (component_types[type_id].storage == ComponentStorage::Sparse) component_types[type_id].acquire_sparse_slot(index);
+
+    sync_archetype(index, type_id);
+
+    mark_changed(index, type_id, get_write_version());
+
+    // Streamed instances have no address, callers write them through write_instance_by_id instead
+    if (component_types[type_id].storage == ComponentStorage::Streamed) return NULL;
+
+    return get_instance_by_id(index, type_id);
   }
 
 
@@ -606,7 +2575,7 @@ namespace mod {
     return id;
   }
 
-  System::ID ECS::init_system (System::ID index, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback) {
+  System::ID ECS::init_system (System::ID index, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback) {
     System::ID id = system_id_counter;
 
     new (systems + index) System { name, id, parallel, required_components, callback };
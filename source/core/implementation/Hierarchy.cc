@@ -7,6 +7,20 @@ namespace mod {
   }
 
 
+  void Child::serialize (Array<u8_t>& out) const {
+    out.append_multiple(reinterpret_cast<u8_t const*>(this), sizeof(Child));
+  }
+
+  void Child::deserialize (ECS* ecs, void const* data, size_t size) {
+    m_assert(size == sizeof(Child), "Invalid Child snapshot size %zu", size);
+
+    memory::copy(this, static_cast<Child const*>(data));
+
+    own_entity.ecs = ecs;
+    parent_handle.ecs = ecs;
+  }
+
+
   Parent& Child::get_parent_references () {
     return parent_handle.get_component<Parent>();
   }
@@ -15,7 +29,7 @@ namespace mod {
     Matrix4 parent_mat;
 
     if (parent_handle->enabled_components.match_index(parent_handle.ecs->get_component_type_by_instance_type<Transform3D>().id)) {
-      parent_mat = parent_handle.get_component<Transform3D>().compose();
+      parent_mat = parent_handle.ecs->read_component<Transform3D>(parent_handle).compose();
     } else {
       parent_mat = Constants::Matrix4::identity;
     }
@@ -25,7 +39,7 @@ namespace mod {
     }
 
     if (slot_index > -1 && parent_handle->enabled_components.match_index(parent_handle.ecs->get_component_type_by_instance_type<SkeletonState>().id)) {
-      SkeletonState& ss = parent_handle.get_component<SkeletonState>();
+      SkeletonState const& ss = parent_handle.get_component<SkeletonState const>();
       parent_mat = (ss.pose[slot_index] * ss.skeleton->bones[slot_index].bind_matrix) * parent_mat;
     }
 
@@ -35,11 +49,36 @@ namespace mod {
 
 
   void Parent::destroy () {
-    for (auto [ i, ch ] : child_handles) {
+    // Destroying the Child components can relocate this Parent in Archetype storage, so work from a local copy
+    Array<EntityHandle> handles = child_handles;
+    child_handles = { };
+
+    for (auto [ i, ch ] : handles) {
       ch.get_component<Child>().parent_handle.id = 0;
       ch.destroy_component<Child>();
     }
-    child_handles.destroy();
+    handles.destroy();
+  }
+
+
+  void Parent::serialize (Array<u8_t>& out) const {
+    out.append_multiple(reinterpret_cast<u8_t const*>(&own_entity), sizeof(EntityHandle));
+    out.append_multiple(reinterpret_cast<u8_t const*>(child_handles.elements), child_handles.count * sizeof(EntityHandle));
+  }
+
+  void Parent::deserialize (ECS* ecs, void const* data, size_t size) {
+    m_assert(size >= sizeof(EntityHandle) && size % sizeof(EntityHandle) == 0, "Invalid Parent snapshot size %zu", size);
+
+    EntityHandle const* handles = static_cast<EntityHandle const*>(data);
+    size_t child_count = size / sizeof(EntityHandle) - 1;
+
+    own_entity = handles[0];
+    own_entity.ecs = ecs;
+
+    child_handles = { };
+    child_handles.append_multiple(handles + 1, child_count);
+
+    for (auto [ i, ch ] : child_handles) ch.ecs = ecs;
   }
 
 
@@ -63,11 +102,114 @@ namespace mod {
   void Parent::remove_child (EntityHandle c) {
     for (auto [ i, ch ] : child_handles) {
       if (ch == c) {
+        child_handles.remove(i);
         c.get_component<Child>().parent_handle.id = 0;
         c.destroy_component<Child>();
-        child_handles.remove(i);
         return;
       }
     }
   }
+
+
+
+  void update_world_transforms (ECS* ecs) {
+    ComponentType::ID transform_id = ecs->get_component_type_by_instance_type<Transform3D>().id;
+    ComponentType::ID child_id = ecs->get_component_type_by_instance_type<Child>().id;
+    ComponentType::ID parent_id = ecs->get_component_type_by_instance_type<Parent>().id;
+    ComponentType::ID skeleton_state_id = ecs->get_component_type_by_instance_type<SkeletonState>().id;
+    ComponentType::ID world_id = ecs->get_component_type_by_instance_type<WorldTransform>().id;
+
+    ComponentMask hierarchy_mask = { transform_id, child_id, parent_id };
+
+    u64_t version = ecs->get_write_version();
+
+    Array<u32_t> level;
+    Array<u32_t> next_level;
+
+    // Adding a Component never moves an Entity to a different index, so the roots can be gathered in the same pass
+    for (u32_t i = 0; i < ecs->entity_count; i ++) {
+      ComponentMask const& mask = ecs->entities[i].enabled_components;
+
+      if (!mask.match_any(hierarchy_mask)) continue;
+
+      if (!mask.match_index(world_id)) ecs->add_component(i, WorldTransform { Constants::Matrix4::identity, 0 });
+
+      if (!ecs->entities[i].enabled_components.match_index(child_id)) level.append(i);
+    }
+
+    while (level.count != 0) {
+      next_level.clear();
+
+      for (auto [ i, index ] : level) {
+        ComponentMask const& mask = ecs->entities[index].enabled_components;
+        WorldTransform const& world = *static_cast<WorldTransform const*>(ecs->get_instance_by_id(index, world_id));
+
+        bool dirty = world.version == 0
+                  || (mask.match_index(transform_id) && ecs->get_component_version(index, transform_id) > world.version);
+
+        Matrix4 const* parent_matrix = NULL;
+        Matrix4 const* slot_matrix = NULL;
+        Matrix4 const* bind_matrix = NULL;
+
+        if (mask.match_index(child_id)) {
+          Child const& child = *static_cast<Child const*>(ecs->get_instance_by_id(index, child_id));
+          EntityHandle parent_handle = child.parent_handle;
+
+          dirty = dirty || ecs->get_component_version(index, child_id) > world.version;
+
+          if (parent_handle.update()) {
+            ComponentMask const& parent_mask = ecs->entities[parent_handle.index].enabled_components;
+
+            // The parent was processed on the previous level, so its WorldTransform is already current
+            WorldTransform const& parent_world = *static_cast<WorldTransform const*>(ecs->get_instance_by_id(parent_handle.index, world_id));
+
+            parent_matrix = &parent_world.matrix;
+            dirty = dirty || parent_world.version > world.version;
+
+            if (child.slot_index > -1 && parent_mask.match_index(skeleton_state_id)) {
+              SkeletonState const& state = *static_cast<SkeletonState const*>(ecs->get_instance_by_id(parent_handle.index, skeleton_state_id));
+
+              slot_matrix = state.pose.elements + child.slot_index;
+              bind_matrix = &state.skeleton->bones[child.slot_index].bind_matrix;
+              dirty = dirty || ecs->get_component_version(parent_handle.index, skeleton_state_id) > world.version;
+            }
+          }
+        }
+
+        if (dirty) {
+          Matrix4 matrix = Constants::Matrix4::identity;
+
+          if (parent_matrix != NULL) matrix = *parent_matrix;
+          if (slot_matrix != NULL) matrix = (*slot_matrix * *bind_matrix) * matrix;
+
+          if (mask.match_index(transform_id)) matrix = matrix * ecs->read_component<Transform3D>(index).compose();
+
+          WorldTransform& out = *static_cast<WorldTransform*>(ecs->get_instance_by_id(index, world_id));
+
+          out.matrix = matrix;
+          out.version = version;
+
+          ecs->mark_changed(index, world_id, version);
+        }
+
+        if (mask.match_index(parent_id)) {
+          Parent const& parent = *static_cast<Parent const*>(ecs->get_instance_by_id(index, parent_id));
+
+          for (auto [ j, child_handle ] : parent.child_handles) {
+            EntityHandle handle = child_handle;
+
+            if (handle.update() && ecs->entities[handle.index].enabled_components.match_index(world_id)) next_level.append(handle.index);
+          }
+        }
+      }
+
+      // Swap the level buffers so neither is reallocated per level
+      Array<u32_t> processed = level;
+      level = next_level;
+      next_level = processed;
+    }
+
+    level.destroy();
+    next_level.destroy();
+  }
 }
\ No newline at end of file
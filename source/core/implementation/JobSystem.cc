@@ -0,0 +1,101 @@
+#include "../include/JobSystem.hh"
+
+
+
+namespace mod {
+  JobSystem_t JobSystem = { };
+
+  // Settings passed to an init that does not start the JobSystem would be silently ignored
+  static void validate_default_settings (u32_t thread_count, bool pin_threads, u32_t reserved_count) {
+    m_assert(
+      thread_count == 0 && !pin_threads && reserved_count == 0,
+      "Cannot initialize JobSystem with thread count %" PRIu32 ", pinning %s and %" PRIu32 " reserved workers, it is already running; "
+      "call init before anything uses the JobSystem, or destroy it first",
+      thread_count, pin_threads? "on" : "off", reserved_count
+    );
+  }
+
+  JobSystem_t& JobSystem_t::init (u32_t thread_count, bool pin_threads, u32_t reserved_count) {
+    if (is_initialized()) {
+      validate_default_settings(thread_count, pin_threads, reserved_count);
+
+      return *this;
+    }
+
+    u32_t requested_count = thread_count;
+
+    if (thread_count == 0) thread_count = static_cast<u32_t>(num::max(SDL_GetCPUCount() - 1, 1));
+
+    ThreadPool* new_pool = new ThreadPool { thread_count };
+    ThreadPool* existing = NULL;
+
+    // Lazy initialization may race between threads, in which case the first pool wins
+    if (!pool.compare_exchange_strong(existing, new_pool, std::memory_order_acq_rel)) {
+      new_pool->destroy();
+      delete new_pool;
+
+      validate_default_settings(requested_count, pin_threads, reserved_count);
+
+      return *this;
+    }
+
+    new_pool->reserve_workers(num::min(reserved_count, thread_count - 1));
+
+    pinned = pin_threads && new_pool->pin_threads(1);
+
+    return *this;
+  }
+
+  void JobSystem_t::destroy () {
+    ThreadPool* existing = pool.exchange(NULL, std::memory_order_acq_rel);
+
+    if (existing != NULL) {
+      existing->await_all();
+      existing->destroy();
+      delete existing;
+    }
+
+    pinned = false;
+
+    main_thread_jobs.destroy();
+    main_thread_running.destroy();
+  }
+
+
+  // The main thread queue is guarded by a spinlock rather than a mutex, as the JobSystem is statically initialized
+  static void lock_main_thread (JobSystem_t* job_system) {
+    while (job_system->main_thread_locked.exchange(true, std::memory_order_acquire)) thrd_yield();
+  }
+
+  static void unlock_main_thread (JobSystem_t* job_system) {
+    job_system->main_thread_locked.store(false, std::memory_order_release);
+  }
+
+
+  void JobSystem_t::queue_main_thread (Job::Callback callback, void* argument) {
+    lock_main_thread(this);
+
+    main_thread_jobs.append({ callback, argument });
+
+    unlock_main_thread(this);
+  }
+
+  size_t JobSystem_t::run_main_thread_jobs () {
+    lock_main_thread(this);
+
+    Array<Job> jobs = main_thread_jobs;
+
+    main_thread_jobs = main_thread_running;
+    main_thread_running = jobs;
+
+    unlock_main_thread(this);
+
+    for (auto [ i, job ] : main_thread_running) job.callback(job.argument);
+
+    size_t count = main_thread_running.count;
+
+    main_thread_running.clear();
+
+    return count;
+  }
+}
\ No newline at end of file
@@ -0,0 +1,77 @@
+#include "../include/MappedFile.hh"
+
+
+#ifdef _WIN32
+  #include "Windows.h"
+
+  namespace mod {
+    MappedFile::MappedFile (char const* path)
+    : origin(str_clone(path))
+    {
+      HANDLE file = CreateFileA(origin, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+      if (file == INVALID_HANDLE_VALUE) return;
+
+      platform_file = file;
+
+      LARGE_INTEGER file_size;
+
+      if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) return;
+
+      HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+      if (mapping == NULL) return;
+
+      platform_mapping = mapping;
+
+      data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+
+      if (data != NULL) size = static_cast<size_t>(file_size.QuadPart);
+    }
+
+    void MappedFile::destroy () {
+      if (data != NULL) UnmapViewOfFile(data);
+      if (platform_mapping != NULL) CloseHandle(platform_mapping);
+      if (platform_file != NULL) CloseHandle(platform_file);
+      if (origin != NULL) memory::deallocate(origin);
+
+      *this = { };
+    }
+  }
+#else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+
+  namespace mod {
+    MappedFile::MappedFile (char const* path)
+    : origin(str_clone(path))
+    {
+      s32_t fd = open(origin, O_RDONLY);
+
+      if (fd == -1) return;
+
+      platform_file = reinterpret_cast<void*>(static_cast<intptr_t>(fd) + 1);
+
+      struct stat file_stats;
+
+      if (fstat(fd, &file_stats) != 0 || file_stats.st_size == 0) return;
+
+      void* mapping = mmap(NULL, static_cast<size_t>(file_stats.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+      if (mapping == MAP_FAILED) return;
+
+      data = mapping;
+      size = static_cast<size_t>(file_stats.st_size);
+    }
+
+    void MappedFile::destroy () {
+      if (data != NULL) munmap(const_cast<void*>(data), size);
+      if (platform_file != NULL) close(static_cast<s32_t>(reinterpret_cast<intptr_t>(platform_file) - 1));
+      if (origin != NULL) memory::deallocate(origin);
+
+      *this = { };
+    }
+  }
+#endif
\ No newline at end of file
@@ -6,7 +6,9 @@
 
 #include "String.cc"
 #include "SharedLib.cc"
+#include "MappedFile.cc"
 #include "ThreadPool.cc"
+#include "JobSystem.cc"
 #include "JSON.cc"
 #include "XML.cc"
 #include "ECS.cc"
@@ -1,42 +1,315 @@
 #include "../include/ThreadPool.hh"
+#include "../include/String.hh"
+#include "../include/JSON.hh"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+  #include "Windows.h"
+#elif defined(__linux__)
+  #include <pthread.h>
+  #include <sched.h>
+#endif
 
 
 namespace mod {
-  s32_t ThreadPool::thread (ThreadPool* pool) {
+  /* Hint to the processor that the calling thread is in a spin loop */
+  static inline void spin_pause () {
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+      _mm_pause();
+    #else
+      thrd_yield();
+    #endif
+  }
+
+  /* Lock a mutex of a ThreadPool, adding any time spent waiting for it to the given counters */
+  static void lock_counted (mtx_t* mtx, ThreadPoolCounters& counters) {
+    // Uncontended locks are not timed, so the common case does not pay for reading the performance counter
+    if (mtx_trylock(mtx) == thrd_success) return;
+
+    u64_t start = SDL_GetPerformanceCounter();
+
+    mtx_lock_safe(mtx);
+
+    counters.lock_wait_ticks.fetch_add(SDL_GetPerformanceCounter() - start, std::memory_order_relaxed);
+  }
+
+
+  bool JobDeque::push (Job const& job) {
+    s64_t b = bottom.load(std::memory_order_relaxed);
+    s64_t t = top.load(std::memory_order_acquire);
+
+    if (b - t >= static_cast<s64_t>(capacity)) return false;
+
+    Slot& slot = slots[b & (capacity - 1)];
+
+    slot.callback.store(job.callback, std::memory_order_relaxed);
+    slot.argument.store(job.argument, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_release);
+
+    bottom.store(b + 1, std::memory_order_relaxed);
+
+    return true;
+  }
+
+  bool JobDeque::pop (Job& job) {
+    s64_t b = bottom.load(std::memory_order_relaxed) - 1;
+
+    bottom.store(b, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    s64_t t = top.load(std::memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, std::memory_order_relaxed);
+      return false;
+    }
+
+    Slot& slot = slots[b & (capacity - 1)];
+
+    job.callback = slot.callback.load(std::memory_order_relaxed);
+    job.argument = slot.argument.load(std::memory_order_relaxed);
+
+    if (t == b) {
+      // The last Job may be contended by a thief, so it is claimed through top like a steal
+      bool claimed = top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+
+      bottom.store(b + 1, std::memory_order_relaxed);
+
+      return claimed;
+    }
+
+    return true;
+  }
+
+  bool JobDeque::steal (Job& job) {
+    s64_t t = top.load(std::memory_order_acquire);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    s64_t b = bottom.load(std::memory_order_acquire);
+
+    if (t >= b) return false;
+
+    Slot& slot = slots[t & (capacity - 1)];
+
+    job.callback = slot.callback.load(std::memory_order_relaxed);
+    job.argument = slot.argument.load(std::memory_order_relaxed);
+
+    return top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+  }
+
+
+
+  // The worker running on this thread, if it belongs to a ThreadPool
+  static thread_local ThreadPoolWorker* current_worker = NULL;
+
+
+  s32_t ThreadPool::thread (ThreadPoolWorker* worker) {
+    ThreadPool* pool = worker->pool;
+
+    current_worker = worker;
+
+    u32_t spin_count = spin_limit;
+
+    // When the worker last ran out of Jobs, or 0 while it has them
+    u64_t idle_start = 0;
+
     while (true) {
-      mtx_lock_safe(&pool->queue_mtx);
+      u8_t lowest_priority = pool->get_lowest_priority(*worker);
 
-      if (pool->jobs.count > 0) {
-        size_t job_index = pool->jobs.count - 1;
+      Job job;
+      u8_t priority;
 
-        Job job = pool->jobs[job_index];
-        
-        pool->jobs.remove(job_index);
+      if (pool->take_job(*worker, lowest_priority, job, priority)) {
+        if (idle_start != 0) {
+          worker->counters.idle_ticks.fetch_add(SDL_GetPerformanceCounter() - idle_start, std::memory_order_relaxed);
+          idle_start = 0;
+        }
 
-        mtx_unlock_safe(&pool->queue_mtx);
-        
-        job.callback(job.argument);
-      } else {
-        bool shutdown = pool->shutdown;
+        pool->run_job(*worker, job, priority);
+
+        continue;
+      }
+
+      if (idle_start == 0) idle_start = SDL_GetPerformanceCounter();
+
+      // Poll for work before parking, as Jobs tend to be queued in bursts and waking a parked thread is slow
+      u32_t polls = 0;
+
+      while (polls < spin_count && pool->get_available_count(lowest_priority) == 0) {
+        spin_pause();
+        ++ polls;
+      }
+
+      if (polls < spin_count) {
+        spin_count = num::min(spin_count * 2, spin_limit);
+        continue;
+      }
+
+      spin_count = num::max(spin_count / 2, spin_limit / 64);
+
+      lock_counted(&pool->queue_mtx, worker->counters);
+
+      // Pairs with queue, so either a new Job is seen available here or this thread is seen parked there
+      pool->parked_count.fetch_add(1, std::memory_order_seq_cst);
+
+      while (pool->get_available_count(pool->get_lowest_priority(*worker)) == 0 && !pool->shutdown) {
+        cnd_wait_safe(&pool->work_cnd, &pool->queue_mtx);
+      }
+
+      pool->parked_count.fetch_sub(1, std::memory_order_relaxed);
+
+      // Reserved workers may exit while Background Jobs remain, as at least one unreserved worker is left to run them
+      bool exit = pool->shutdown && pool->get_available_count(pool->get_lowest_priority(*worker)) == 0;
+
+      mtx_unlock_safe(&pool->queue_mtx);
+
+      if (exit) {
+        worker->counters.idle_ticks.fetch_add(SDL_GetPerformanceCounter() - idle_start, std::memory_order_relaxed);
+
+        return 0;
+      }
+    }
+  }
+
+  bool ThreadPool::take_job (ThreadPoolWorker& worker, u8_t lowest_priority, Job& job, u8_t& priority) {
+    for (priority = JobPriority::High; priority <= lowest_priority; priority ++) {
+      // Counted before a Job is published and uncounted after it is taken, so an empty lane can be skipped without touching its deques
+      if (available_counts[priority].load(std::memory_order_relaxed) == 0) continue;
+
+      bool found = worker.deques[priority].pop(job);
+
+      if (!found && injected_counts[priority].load(std::memory_order_relaxed) > 0) {
+        lock_counted(&queue_mtx, worker.counters);
+
+        Array<Job>& injected = injected_jobs[priority];
+        size_t& head = injected_heads[priority];
+
+        if (head < injected.count) {
+          job = injected[head ++];
+
+          if (head == injected.count) {
+            injected.clear();
+            head = 0;
+          }
+
+          injected_counts[priority].store(static_cast<u32_t>(injected.count - head), std::memory_order_relaxed);
+
+          found = true;
+        }
+
+        mtx_unlock_safe(&queue_mtx);
+      }
+
+      for (u32_t i = 1; !found && i < worker_count; i ++) {
+        ThreadPoolWorker& victim = workers[(worker.index + worker.steal_cursor + i) % worker_count];
 
-        mtx_unlock_safe(&pool->queue_mtx);
+        if (victim.deques[priority].steal(job)) {
+          worker.steal_cursor += i;
+          worker.counters.steal_count.fetch_add(1, std::memory_order_relaxed);
+          found = true;
+        }
+      }
+
+      if (found) {
+        available_counts[priority].fetch_sub(1, std::memory_order_relaxed);
 
-        if (shutdown) return 0;
+        return true;
       }
     }
+
+    return false;
+  }
+
+  void ThreadPool::run_job (ThreadPoolWorker& worker, Job const& job, u8_t priority) {
+    // Restored afterwards, as a worker runs other Jobs from within one while it awaits or yields
+    u8_t previous_priority = worker.running_priority;
+
+    worker.running_priority = priority;
+
+    u64_t start = SDL_GetPerformanceCounter();
+
+    job.callback(job.argument);
+
+    u64_t end = SDL_GetPerformanceCounter();
+
+    worker.running_priority = previous_priority;
+
+    // Jobs run from within another are already covered by its time
+    if (previous_priority == JobPriority::Invalid) worker.counters.busy_ticks.fetch_add(end - start, std::memory_order_relaxed);
+
+    worker.counters.job_count.fetch_add(1, std::memory_order_relaxed);
+
+    if (tracing.load(std::memory_order_relaxed)) {
+      // Registering as a writer before checking tracing again pairs with stop_trace, which clears it and then waits for writers to leave
+      trace_writers.fetch_add(1, std::memory_order_seq_cst);
+
+      if (tracing.load(std::memory_order_seq_cst)) {
+        u64_t index = worker.trace_count.load(std::memory_order_relaxed);
+
+        worker.trace_events[index % trace_capacity] = { job.callback, job.argument, start, end, priority };
+
+        worker.trace_count.store(index + 1, std::memory_order_relaxed);
+      }
+
+      trace_writers.fetch_sub(1, std::memory_order_release);
+    }
+
+    complete_job();
   }
 
 
   ThreadPool::ThreadPool (size_t num_threads)
   : threads { }
-  , jobs { }
+  , workers(new ThreadPoolWorker [num_threads])
+  , worker_count(static_cast<u32_t>(num_threads))
+  , reserved_count(0)
+  , injected_jobs { }
+  , injected_heads { }
   , shutdown(false)
+  , parked_count(0)
+  , queued_count(0)
+  , completed_count(0)
+  , node_blocks { }
+  , free_nodes(NULL)
+  , awaiting_count(0)
+  , tracing(false)
+  , trace_capacity(0)
+  , trace_origin(0)
+  , trace_names { }
+  , trace_writers(0)
   {
     mtx_init_safe(&queue_mtx, mtx_plain);
+    mtx_init_safe(&node_mtx, mtx_plain);
+    mtx_init_safe(&await_mtx, mtx_plain);
+    cnd_init_safe(&work_cnd);
+    cnd_init_safe(&await_cnd);
+
+    for (u8_t i = 0; i < JobPriority::total_priority_count; i ++) {
+      injected_counts[i].store(0, std::memory_order_relaxed);
+      available_counts[i].store(0, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < num_threads; i ++) {
+      workers[i].pool = this;
+      workers[i].index = static_cast<u32_t>(i);
+      workers[i].steal_cursor = 0;
+      workers[i].running_priority = JobPriority::Invalid;
+      workers[i].counters.reset();
+      workers[i].trace_events = NULL;
+      workers[i].trace_count.store(0, std::memory_order_relaxed);
+    }
+
+    external_counters.reset();
 
     for (size_t i = 0; i < num_threads; i ++) {
       thrd_t thrd;
-      thrd_create(&thrd, reinterpret_cast<thrd_start_t>(ThreadPool::thread), this);
+      thrd_create(&thrd, reinterpret_cast<thrd_start_t>(ThreadPool::thread), workers + i);
       threads.append(thrd);
     }
   }
@@ -48,51 +321,542 @@ namespace mod {
     
     mtx_unlock_safe(&queue_mtx);
 
+    cnd_broadcast_safe(&work_cnd);
+
     for (auto [ i, thrd ] : threads) {
       thrd_join_safe(thrd, NULL);
     }
 
+    cnd_destroy(&work_cnd);
+    cnd_destroy(&await_cnd);
     mtx_destroy(&queue_mtx);
+    mtx_destroy(&node_mtx);
+    mtx_destroy(&await_mtx);
+
+    for (u32_t i = 0; i < worker_count; i ++) {
+      if (workers[i].trace_events != NULL) memory::deallocate(workers[i].trace_events);
+    }
+
+    delete [] workers;
+
+    for (auto [ i, block ] : node_blocks) {
+      for (size_t j = 0; j < node_block_size; j ++) block[j].dependents.destroy();
+
+      delete [] block;
+    }
+
+    node_blocks.destroy();
 
     threads.destroy();
-    jobs.destroy();
+    trace_names.destroy();
+
+    for (u8_t i = 0; i < JobPriority::total_priority_count; i ++) injected_jobs[i].destroy();
   }
 
 
-  size_t ThreadPool::queue (Job::Callback callback, void* argument) {
-    mtx_lock_safe(&queue_mtx);
+  bool ThreadPool::pin_threads (u32_t first_processor) {
+    u32_t processor_count = static_cast<u32_t>(num::max(SDL_GetCPUCount(), 1));
 
-    size_t index = jobs.count;
+    bool pinned = true;
 
-    jobs.append({ callback, argument });
+    for (auto [ i, thrd ] : threads) {
+      u32_t processor = static_cast<u32_t>((first_processor + i) % processor_count);
+
+      #ifdef _WIN32
+        pinned &= processor < 64 && SetThreadAffinityMask(thrd, static_cast<DWORD_PTR>(1) << processor) != 0;
+      #elif defined(__linux__)
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(processor, &set);
+
+        pinned &= pthread_setaffinity_np(thrd, sizeof(cpu_set_t), &set) == 0;
+      #else
+        pinned = false;
+      #endif
+    }
+
+    return pinned;
+  }
+
+
+  void ThreadPool::reserve_workers (u32_t count) {
+    m_assert(count < worker_count, "Cannot reserve %" PRIu32 " workers of a ThreadPool with %" PRIu32 " workers, at least one must run Background Jobs", count, worker_count);
+
+    lock_counted(&queue_mtx, get_current_counters());
+
+    reserved_count.store(count, std::memory_order_relaxed);
 
     mtx_unlock_safe(&queue_mtx);
 
-    return index;
+    // Workers no longer reserved may have parked with Background Jobs waiting
+    cnd_broadcast_safe(&work_cnd);
   }
 
 
-  void ThreadPool::await (size_t index) {
-    while (true) {
-      mtx_lock_safe(&queue_mtx);
+  void ThreadPool::reset_stats () {
+    for (u32_t i = 0; i < worker_count; i ++) workers[i].counters.reset();
 
-      size_t remaining_jobs = jobs.count;
+    external_counters.reset();
+  }
 
-      mtx_unlock_safe(&queue_mtx);
 
-      if (remaining_jobs <= index) break;
+  void ThreadPool::start_trace (u32_t capacity) {
+    m_assert(capacity > 0, "Cannot start a ThreadPool trace with a capacity of 0");
+
+    stop_trace();
+
+    for (u32_t i = 0; i < worker_count; i ++) {
+      ThreadPoolWorker& worker = workers[i];
+
+      if (capacity != trace_capacity) {
+        if (worker.trace_events != NULL) memory::deallocate(worker.trace_events);
+
+        worker.trace_events = memory::allocate<ThreadPoolTraceEvent>(capacity);
+      }
+
+      worker.trace_count.store(0, std::memory_order_relaxed);
     }
+
+    trace_capacity = capacity;
+    trace_origin = SDL_GetPerformanceCounter();
+
+    // Workers only touch the ring buffers after seeing this
+    tracing.store(true, std::memory_order_seq_cst);
   }
 
-  void ThreadPool::await_all () {
-    while (true) {
-      mtx_lock_safe(&queue_mtx);
+  void ThreadPool::stop_trace () {
+    tracing.store(false, std::memory_order_seq_cst);
+
+    // Recording an event is a handful of stores, so in-flight writers are waited out rather than blocked on
+    while (trace_writers.load(std::memory_order_seq_cst) != 0) thrd_yield();
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+  }
+
+  void ThreadPool::set_trace_name (Job::Callback callback, char const* name) {
+    lock_counted(&queue_mtx, get_current_counters());
+
+    bool found = false;
+
+    for (auto [ i, pair ] : trace_names) {
+      if (pair.a == callback) {
+        pair.b = name;
+        found = true;
+        break;
+      }
+    }
+
+    if (!found) trace_names.append({ callback, name });
+
+    mtx_unlock_safe(&queue_mtx);
+  }
+
+
+  bool ThreadPool::export_trace (char const* path) {
+    // Once stopped, no worker writes to the ring buffers, so the recorded counts and events are stable
+    stop_trace();
+
+    f64_t us_per_tick = 1000000.0 / static_cast<f64_t>(SDL_GetPerformanceFrequency());
+
+    // Names are escaped once up front, as the same few are repeated for most events
+    Array<Job::Callback> named_callbacks;
+    Array<String> names;
+
+    lock_counted(&queue_mtx, get_current_counters());
+
+    for (auto [ i, pair ] : trace_names) {
+      String name { pair.b };
+      String escaped;
+
+      JSON::escape_string_to_source(&name, &escaped);
+
+      named_callbacks.append(pair.a);
+      names.append(escaped);
+
+      name.destroy();
+    }
 
-      size_t remaining_jobs = jobs.count;
+    mtx_unlock_safe(&queue_mtx);
+
+    String json { "{\"traceEvents\":[\n" };
+
+    for (u32_t i = 0; i < worker_count; i ++) {
+      ThreadPoolWorker const& worker = workers[i];
+
+      json.fmt_append(
+        "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%" PRIu32 ",\"args\":{\"name\":\"Worker %" PRIu32 "\"}}",
+        i > 0? ",\n" : "", i, i
+      );
+
+      if (worker.trace_events == NULL) continue;
+
+      u64_t count = worker.trace_count.load(std::memory_order_relaxed);
+      u64_t first = count > trace_capacity? count - trace_capacity : 0;
+
+      for (u64_t j = first; j < count; j ++) {
+        ThreadPoolTraceEvent const& event = worker.trace_events[j % trace_capacity];
+
+        json.append(",\n{\"name\":");
+
+        bool named = false;
+
+        for (auto [ k, callback ] : named_callbacks) {
+          if (callback == event.callback) {
+            json.append(names[k].value, names[k].length);
+            named = true;
+            break;
+          }
+        }
+
+        if (!named) json.fmt_append("\"%p\"", reinterpret_cast<void*>(event.callback));
+
+        json.fmt_append(
+          ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":0,\"tid\":%" PRIu32 ",\"args\":{\"argument\":\"%p\"}}",
+          JobPriority::name(event.priority),
+          static_cast<f64_t>(event.start - trace_origin) * us_per_tick,
+          static_cast<f64_t>(event.end - event.start) * us_per_tick,
+          i,
+          event.argument
+        );
+      }
+    }
+
+    json.append("\n]}\n");
+
+    bool saved = json.to_file(path);
+
+    json.destroy();
+
+    for (auto [ i, name ] : names) name.destroy();
+
+    names.destroy();
+    named_callbacks.destroy();
+
+    return saved;
+  }
+
+
+  void ThreadPool::show_stats (char const* title, bool* open) {
+    using namespace ImGui;
+
+    if (!Begin(title, open)) {
+      End();
+      return;
+    }
+
+    if (Button("Reset")) reset_stats();
+
+    SameLine();
+
+    if (tracing.load(std::memory_order_relaxed)) {
+      if (Button("Stop trace")) stop_trace();
+    } else if (Button("Start trace")) {
+      start_trace();
+    }
+
+    if (trace_capacity > 0) {
+      SameLine();
+
+      if (Button("Export trace")) export_trace("job_trace.json");
+
+      if (IsItemHovered()) SetTooltip("Writes job_trace.json in the working directory, for chrome://tracing or Perfetto");
+    }
+
+    Columns(7, "workers");
+    Separator();
+    Text("Thread"); NextColumn();
+    Text("Busy %%"); NextColumn();
+    Text("Idle %%"); NextColumn();
+    Text("Jobs"); NextColumn();
+    Text("Steals"); NextColumn();
+    Text("Max depth"); NextColumn();
+    Text("Lock wait ms"); NextColumn();
+    Separator();
+
+    f64_t ms_per_tick = 1000.0 / static_cast<f64_t>(SDL_GetPerformanceFrequency());
+
+    for (u32_t i = 0; i <= worker_count; i ++) {
+      ThreadPoolStats stats = i < worker_count? get_worker_stats(i) : get_external_stats();
+
+      if (i < worker_count) Text("Worker %" PRIu32 "%s", i, i < reserved_count.load(std::memory_order_relaxed)? " (reserved)" : "");
+      else Text("External");
+      NextColumn();
+
+      // External threads only queue Jobs, so they have no busy or idle time
+      u64_t total_ticks = stats.busy_ticks + stats.idle_ticks;
+
+      if (total_ticks > 0) {
+        Text("%.1f", 100.0 * static_cast<f64_t>(stats.busy_ticks) / static_cast<f64_t>(total_ticks)); NextColumn();
+        Text("%.1f", 100.0 * static_cast<f64_t>(stats.idle_ticks) / static_cast<f64_t>(total_ticks)); NextColumn();
+      } else {
+        TextDisabled("-"); NextColumn();
+        TextDisabled("-"); NextColumn();
+      }
+
+      Text("%" PRIu64, stats.job_count); NextColumn();
+      Text("%" PRIu64, stats.steal_count); NextColumn();
+      Text("%" PRIu32, stats.max_queue_depth); NextColumn();
+      Text("%.3f", static_cast<f64_t>(stats.lock_wait_ticks) * ms_per_tick); NextColumn();
+    }
+
+    Columns(1);
+    Separator();
+    Text("Unfinished Jobs: %zu", get_unfinished_count());
+
+    End();
+  }
+
+
+  ThreadPoolWorker* ThreadPool::get_current_worker () const {
+    return current_worker != NULL && current_worker->pool == this? current_worker : NULL;
+  }
+
+  u8_t ThreadPool::get_current_priority () const {
+    ThreadPoolWorker* worker = get_current_worker();
+
+    return worker != NULL && worker->running_priority != JobPriority::Invalid? worker->running_priority : JobPriority::Normal;
+  }
+
+
+  bool ThreadPool::should_yield () const {
+    ThreadPoolWorker* worker = get_current_worker();
+
+    if (worker == NULL || worker->running_priority == JobPriority::Invalid || worker->running_priority == JobPriority::High) return false;
+
+    return get_available_count(worker->running_priority - 1) > 0;
+  }
+
+  void ThreadPool::yield () {
+    ThreadPoolWorker* worker = get_current_worker();
+
+    if (worker == NULL || worker->running_priority == JobPriority::Invalid || worker->running_priority == JobPriority::High) return;
+
+    u8_t lowest_priority = worker->running_priority - 1;
+
+    Job job;
+    u8_t priority;
+
+    while (take_job(*worker, lowest_priority, job, priority)) run_job(*worker, job, priority);
+  }
+
+
+  void ThreadPool::queue (Job::Callback callback, void* argument, u8_t priority) {
+    m_assert(JobPriority::validate(priority), "Cannot queue Job with invalid JobPriority %" PRIu8, priority);
+
+    // Counted before the Job is published, so it can never be seen completed before it is seen queued
+    queued_count.fetch_add(1, std::memory_order_release);
+    available_counts[priority].fetch_add(1, std::memory_order_seq_cst);
+
+    ThreadPoolWorker* worker = get_current_worker();
+    ThreadPoolCounters& counters = worker != NULL? worker->counters : external_counters;
+
+    if (worker != NULL && worker->deques[priority].push({ callback, argument })) {
+      counters.record_queue_depth(worker->deques[priority].get_size());
+    } else {
+      lock_counted(&queue_mtx, counters);
+
+      injected_jobs[priority].append({ callback, argument });
+
+      u32_t injected_count = static_cast<u32_t>(injected_jobs[priority].count - injected_heads[priority]);
+
+      injected_counts[priority].store(injected_count, std::memory_order_relaxed);
 
       mtx_unlock_safe(&queue_mtx);
 
-      if (remaining_jobs == 0) break;
+      counters.record_queue_depth(injected_count);
+    }
+
+    if (parked_count.load(std::memory_order_seq_cst) > 0) {
+      lock_counted(&queue_mtx, counters);
+
+      // A single woken worker might be reserved, and park again without taking a Background Job
+      if (priority == JobPriority::Background && reserved_count.load(std::memory_order_relaxed) > 0) {
+        cnd_broadcast_safe(&work_cnd);
+      } else {
+        cnd_signal_safe(&work_cnd);
+      }
+
+      mtx_unlock_safe(&queue_mtx);
+    }
+  }
+
+
+  JobNode* ThreadPool::allocate_node () {
+    lock_counted(&node_mtx, get_current_counters());
+
+    if (free_nodes == NULL) {
+      JobNode* block = new JobNode [node_block_size];
+
+      for (size_t i = 0; i < node_block_size; i ++) {
+        JobNode& node = block[i];
+
+        node.pool = this;
+        node.generation.store(1, std::memory_order_relaxed);
+        node.pending_count.store(0, std::memory_order_relaxed);
+        node.locked.store(false, std::memory_order_relaxed);
+        node.next_free = i + 1 < node_block_size? block + i + 1 : NULL;
+      }
+
+      node_blocks.append(block);
+      free_nodes = block;
     }
+
+    JobNode* node = free_nodes;
+
+    free_nodes = node->next_free;
+
+    mtx_unlock_safe(&node_mtx);
+
+    return node;
+  }
+
+  void ThreadPool::free_node (JobNode* node) {
+    lock_counted(&node_mtx, get_current_counters());
+
+    node->next_free = free_nodes;
+    free_nodes = node;
+
+    mtx_unlock_safe(&node_mtx);
+  }
+
+
+  static void lock_node (JobNode* node) {
+    while (node->locked.exchange(true, std::memory_order_acquire)) spin_pause();
+  }
+
+  static void unlock_node (JobNode* node) {
+    node->locked.store(false, std::memory_order_release);
+  }
+
+
+  bool ThreadPool::add_dependent (JobHandle const& handle, JobNode* dependent) {
+    if (handle.node == NULL) return false;
+
+    m_assert(handle.node->pool == this, "Cannot depend on a Job submitted to a different ThreadPool");
+
+    // Nodes are never freed while the ThreadPool lives, so a stale handle can still be locked and found complete by its generation
+    lock_node(handle.node);
+
+    bool incomplete = handle.node->generation.load(std::memory_order_relaxed) == handle.generation;
+
+    if (incomplete) handle.node->dependents.append(dependent);
+
+    unlock_node(handle.node);
+
+    return incomplete;
+  }
+
+  void ThreadPool::release_node (JobNode* node) {
+    if (node->pending_count.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      queue(reinterpret_cast<Job::Callback>(ThreadPool::execute_node), node, node->priority);
+    }
+  }
+
+  JobHandle ThreadPool::submit (Job::Callback callback, void* argument, JobHandle const* dependencies, size_t dependency_count, u8_t priority) {
+    m_assert(JobPriority::validate(priority), "Cannot submit Job with invalid JobPriority %" PRIu8, priority);
+
+    JobNode* node = allocate_node();
+
+    node->job = { callback, argument };
+    node->priority = priority;
+    node->pending_count.store(1, std::memory_order_relaxed);
+
+    JobHandle handle = { node, node->generation.load(std::memory_order_relaxed) };
+
+    for (size_t i = 0; i < dependency_count; i ++) {
+      // Counted before the node is visible to the dependency, which may complete and release it immediately
+      node->pending_count.fetch_add(1, std::memory_order_relaxed);
+
+      if (!add_dependent(dependencies[i], node)) node->pending_count.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    release_node(node);
+
+    return handle;
+  }
+
+  void ThreadPool::execute_node (JobNode* node) {
+    ThreadPool* pool = node->pool;
+
+    node->job.callback(node->job.argument);
+
+    lock_node(node);
+
+    node->generation.fetch_add(1, std::memory_order_release);
+
+    for (auto [ i, dependent ] : node->dependents) pool->release_node(dependent);
+
+    node->dependents.clear();
+
+    unlock_node(node);
+
+    pool->free_node(node);
+  }
+
+
+  void ThreadPool::complete_job () {
+    completed_count.fetch_add(1, std::memory_order_release);
+
+    // Pairs with the fence in block_until, so either the awaiting thread sees this completion or it is seen as awaiting here
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (awaiting_count.load(std::memory_order_relaxed) > 0) {
+      mtx_lock_safe(&await_mtx);
+      cnd_broadcast_safe(&await_cnd);
+      mtx_unlock_safe(&await_mtx);
+    }
+  }
+
+  template <typename F> void ThreadPool::block_until (F condition) {
+    ThreadPoolWorker* worker = get_current_worker();
+
+    if (worker != NULL) {
+      // Jobs of any priority the worker may take are run, as the awaited work may itself be of a lower priority
+      u8_t lowest_priority = get_lowest_priority(*worker);
+
+      while (!condition()) {
+        Job job;
+        u8_t priority;
+
+        if (take_job(*worker, lowest_priority, job, priority)) {
+          run_job(*worker, job, priority);
+        } else {
+          spin_pause();
+        }
+      }
+
+      return;
+    }
+
+    for (u32_t i = 0; i < spin_limit; i ++) {
+      if (condition()) return;
+
+      spin_pause();
+    }
+
+    mtx_lock_safe(&await_mtx);
+
+    awaiting_count.fetch_add(1, std::memory_order_relaxed);
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    while (!condition()) cnd_wait_safe(&await_cnd, &await_mtx);
+
+    awaiting_count.fetch_sub(1, std::memory_order_relaxed);
+
+    mtx_unlock_safe(&await_mtx);
+  }
+
+
+  void ThreadPool::await (JobHandle const& handle) {
+    block_until([&] () { return is_complete(handle); });
+  }
+
+  void ThreadPool::await_all () {
+    block_until([&] () { return get_unfinished_count() == 0; });
+  }
+
+  void ThreadPool::await_counter (std::atomic<u32_t> const& counter) {
+    block_until([&] () { return counter.load(std::memory_order_acquire) == 0; });
   }
 }
\ No newline at end of file
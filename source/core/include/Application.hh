@@ -8,6 +8,7 @@
 #include "math/Vector2.hh"
 #include "Input.hh"
 #include "AssetManager.hh"
+#include "JobSystem.hh"
 #include "audio/AudioContext.hh"
 
 
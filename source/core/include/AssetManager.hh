@@ -6,6 +6,7 @@
 #include "Array.hh"
 #include "String.hh"
 #include "Exception.hh"
+#include "JobSystem.hh"
 
 #include "AssetHandle.hh"
 #include "graphics/lib.hh"
@@ -161,6 +162,7 @@ namespace mod {
   };
 
   struct WatchedFileList {
+    // Minimum time between scans of the watched files, which run as Jobs on the JobSystem
     #ifndef CUSTOM_ASSET_MANAGER_WATCH_FILE_SLEEP_INTERVAL
       static constexpr struct timespec sleep_interval = { 0, 500000000 };
     #else
@@ -169,8 +171,8 @@ namespace mod {
     
 
     mtx_t mtx;
-    thrd_t thrd;
-    bool shutdown;
+    JobHandle scan_job;
+    u64_t last_scan;
     Array<WatchedFilePath> paths;
     Array<WatchedFile> files;
 
@@ -239,7 +241,7 @@ namespace mod {
 
     ENGINE_API void destroy ();
 
-    ENGINE_API static s32_t watch_files (void* unused_thread_parameter);
+    ENGINE_API static void scan_watched_files (void* unused_job_parameter);
 
     ENGINE_API void update_watched_files (Array<WatchedFileReport>* update_reports_output = NULL);
 
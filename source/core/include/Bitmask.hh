@@ -4,8 +4,68 @@
 #include "cstd.hh"
 #include "util.hh"
 
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+#endif
+
 
 namespace mod {
+  namespace Internal {
+    // The widest vector register available at compile time, used for Bitmasks that span several of them
+    #if defined(__AVX2__)
+      struct BitmaskVector {
+        using type = __m256i;
+
+        static constexpr size_t byte_count = 32;
+
+        static type load (void const* p) { return _mm256_loadu_si256(static_cast<type const*>(p)); }
+        static void store (void* p, type v) { _mm256_storeu_si256(static_cast<type*>(p), v); }
+
+        static type bor (type a, type b) { return _mm256_or_si256(a, b); }
+        static type band (type a, type b) { return _mm256_and_si256(a, b); }
+        static type bxor (type a, type b) { return _mm256_xor_si256(a, b); }
+
+        static bool is_zero (type a) { return _mm256_testz_si256(a, a) != 0; }
+        static bool is_equal (type a, type b) { return _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b)) == -1; }
+      };
+    #elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+      struct BitmaskVector {
+        using type = __m128i;
+
+        static constexpr size_t byte_count = 16;
+
+        static type load (void const* p) { return _mm_loadu_si128(static_cast<type const*>(p)); }
+        static void store (void* p, type v) { _mm_storeu_si128(static_cast<type*>(p), v); }
+
+        static type bor (type a, type b) { return _mm_or_si128(a, b); }
+        static type band (type a, type b) { return _mm_and_si128(a, b); }
+        static type bxor (type a, type b) { return _mm_xor_si128(a, b); }
+
+        static bool is_zero (type a) { return _mm_movemask_epi8(_mm_cmpeq_epi8(a, _mm_setzero_si128())) == 0xFFFF; }
+        static bool is_equal (type a, type b) { return _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) == 0xFFFF; }
+      };
+    #else
+      struct BitmaskVector {
+        using type = u64_t;
+
+        static constexpr size_t byte_count = 0;
+
+        static type load (void const* p) { return *static_cast<type const*>(p); }
+        static void store (void* p, type v) { *static_cast<type*>(p) = v; }
+
+        static type bor (type a, type b) { return a | b; }
+        static type band (type a, type b) { return a & b; }
+        static type bxor (type a, type b) { return a ^ b; }
+
+        static bool is_zero (type a) { return a == 0; }
+        static bool is_equal (type a, type b) { return a == b; }
+      };
+    #endif
+  }
+
+
   template <size_t in_bit_count = 8>
   struct Bitmask {
     static_assert(in_bit_count % 8 == 0, "Bitmask must have a bit count evenly divisible by 8");
@@ -13,13 +73,26 @@ namespace mod {
     static constexpr size_t bit_count = in_bit_count;
     static constexpr size_t byte_count = bit_count / 8;
 
+    // Bits are stored in the widest integer that evenly divides the bit count
+    using word_t = std::conditional_t<bit_count % 64 == 0, u64_t,
+                   std::conditional_t<bit_count % 32 == 0, u32_t,
+                   std::conditional_t<bit_count % 16 == 0, u16_t, u8_t>>>;
+
+    static constexpr size_t word_bits = sizeof(word_t) * 8;
+    static constexpr size_t word_count = bit_count / word_bits;
+
+    // Masks spanning multiple vector registers are processed a register at a time
+    using Vector = Internal::BitmaskVector;
+
+    static constexpr bool vectorized = Vector::byte_count != 0 && byte_count > sizeof(u64_t) && byte_count % Vector::byte_count == 0;
+
 
-    u8_t bytes [byte_count];
+    word_t words [word_count];
 
 
     /* Create a new zero-initialized Bitmask */
     Bitmask ()
-    : bytes { }
+    : words { }
     { }
 
     /* Create a new Bitmask from an initializer list of flag indices */
@@ -40,7 +113,7 @@ namespace mod {
 
     /* Set all flags of a Bitmask to 0 */
     void clear () {
-      memory::clear(bytes, byte_count);
+      memory::clear(words, word_count);
     }
     
 
@@ -96,30 +169,26 @@ namespace mod {
 
     /* Compare two Bitmasks */
     bool operator != (Bitmask const& r) const {
-      for (size_t i = 0; i < byte_count; i ++) {
-        if (bytes[i] != r.bytes[i]) return true;
-      }
-
-      return false;
+      return !match_exact(r);
     }
 
 
     /* Enable a specific bit index of a Bitmask */
     void set (size_t index) {
       m_assert(index < bit_count, "Cannot set out of range Bitmask index %zu, valid range is 0 - %zu", index, bit_count - 1);
-      bytes[index / 8] |= (1_u8 << (index % 8));
+      words[index / word_bits] |= get_bit(index);
     }
 
     /* Disable a specific bit index of a Bitmask */
     void unset (size_t index) {
       m_assert(index < bit_count, "Cannot unset out of range Bitmask index %zu, valid range is 0 - %zu", index, bit_count - 1);
-      bytes[index / 8] &= (~(1_u8 << (index % 8)));
+      words[index / word_bits] &= static_cast<word_t>(~get_bit(index));
     }
 
     /* Toggle a specific bit index of a Bitmask */
     void toggle (size_t index) {
       m_assert(index < bit_count, "Cannot toggle out of range Bitmask index %zu, valid range is 0 - %zu", index, bit_count - 1);
-      bytes[index / 8] ^= (1_u8 << (index % 8));
+      words[index / word_bits] ^= get_bit(index);
     }
 
 
@@ -165,8 +234,14 @@ namespace mod {
     Bitmask bor (Bitmask const& r) const {
       Bitmask o;
 
-      for (size_t i = 0; i < byte_count; i ++) {
-        o.bytes[i] = (bytes[i] | r.bytes[i]);
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          Vector::store(o.get_byte_pointer(i), Vector::bor(Vector::load(get_byte_pointer(i)), Vector::load(r.get_byte_pointer(i))));
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          o.words[i] = static_cast<word_t>(words[i] | r.words[i]);
+        }
       }
 
       return o;
@@ -176,8 +251,14 @@ namespace mod {
     Bitmask band (Bitmask const& r) const {
       Bitmask o;
 
-      for (size_t i = 0; i < byte_count; i ++) {
-        o.bytes[i] = (bytes[i] & r.bytes[i]);
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          Vector::store(o.get_byte_pointer(i), Vector::band(Vector::load(get_byte_pointer(i)), Vector::load(r.get_byte_pointer(i))));
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          o.words[i] = static_cast<word_t>(words[i] & r.words[i]);
+        }
       }
 
       return o;
@@ -187,8 +268,14 @@ namespace mod {
     Bitmask bxor (Bitmask const& r) const {
       Bitmask o;
 
-      for (size_t i = 0; i < byte_count; i ++) {
-        o.bytes[i] = (bytes[i] ^ r.bytes[i]);
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          Vector::store(o.get_byte_pointer(i), Vector::bxor(Vector::load(get_byte_pointer(i)), Vector::load(r.get_byte_pointer(i))));
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          o.words[i] = static_cast<word_t>(words[i] ^ r.words[i]);
+        }
       }
 
       return o;
@@ -198,8 +285,8 @@ namespace mod {
     Bitmask bnot () const {
       Bitmask o;
 
-      for (size_t i = 0; i < byte_count; i ++) {
-        o.bytes[i] = ~(bytes[i]);
+      for (size_t i = 0; i < word_count; i ++) {
+        o.words[i] = static_cast<word_t>(~words[i]);
       }
 
       return o;
@@ -210,24 +297,43 @@ namespace mod {
     bool match_index (size_t index) const {
       m_assert(index < bit_count, "Cannot match out of range Bitmask index %zu, valid range is 0 - %zu", index, bit_count - 1);
 
-      u8_t m = 1 << (index % 8);
-
-      return (bytes[index / 8] & m) == m;
+      return (words[index / word_bits] & get_bit(index)) != 0;
     }
 
     /* Determine if any bits are enabled for a Bitmask */
     bool any_bits () const {
-      for (size_t i = 0; i < byte_count; i ++) {
-        if (bytes[i] != 0) return true;
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          if (!Vector::is_zero(Vector::load(get_byte_pointer(i)))) return true;
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          if (words[i] != 0) return true;
+        }
       }
 
       return false;
     }
 
+    /* Get the number of enabled bits in a Bitmask */
+    size_t count_bits () const {
+      size_t count = 0;
+
+      for (size_t i = 0; i < word_count; i ++) count += num::count_set_bits(words[i]);
+
+      return count;
+    }
+
     /* Determine if a Bitmask matches any bits from another Bitmask */
     bool match_any (Bitmask const& r) const {
-      for (size_t i = 0; i < bit_count; i ++) {
-        if (r.match_index(i) && match_index(i)) return true;
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          if (!Vector::is_zero(Vector::band(Vector::load(get_byte_pointer(i)), Vector::load(r.get_byte_pointer(i))))) return true;
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          if ((words[i] & r.words[i]) != 0) return true;
+        }
       }
 
       return false;
@@ -235,8 +341,16 @@ namespace mod {
 
     /* Determine if another Bitmask is a subset of the caller instance */
     bool match_subset (Bitmask const& r) const {
-      for (size_t i = 0; i < byte_count; i ++) {
-        if ((bytes[i] & r.bytes[i]) != r.bytes[i]) return false;
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          typename Vector::type rv = Vector::load(r.get_byte_pointer(i));
+
+          if (!Vector::is_equal(Vector::band(Vector::load(get_byte_pointer(i)), rv), rv)) return false;
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          if ((words[i] & r.words[i]) != r.words[i]) return false;
+        }
       }
 
       return true;
@@ -244,14 +358,67 @@ namespace mod {
 
     /* Determine if two Bitmasks are exactly the same */
     bool match_exact (Bitmask const& r) const {
-      for (size_t i = 0; i < byte_count; i ++) {
-        if (bytes[i] != r.bytes[i]) return false;
+      if constexpr (vectorized) {
+        for (size_t i = 0; i < byte_count; i += Vector::byte_count) {
+          if (!Vector::is_equal(Vector::load(get_byte_pointer(i)), Vector::load(r.get_byte_pointer(i)))) return false;
+        }
+      } else {
+        for (size_t i = 0; i < word_count; i ++) {
+          if (words[i] != r.words[i]) return false;
+        }
       }
 
       return true;
     }
 
 
+    /* Get the index of the first enabled bit of a Bitmask at or after an index.
+     * Returns bit_count if there are no more enabled bits */
+    size_t next_set_bit (size_t index) const {
+      size_t word_index = index / word_bits;
+
+      if (word_index >= word_count) return bit_count;
+
+      u64_t word = static_cast<u64_t>(words[word_index]) & (std::numeric_limits<u64_t>::max() << (index % word_bits));
+
+      while (word == 0) {
+        if (++ word_index == word_count) return bit_count;
+
+        word = words[word_index];
+      }
+
+      return word_index * word_bits + num::count_trailing_zeros(word);
+    }
+
+    /* Call a callback with the index of each enabled bit of a Bitmask, in ascending order.
+     * Disabled bits are skipped a word at a time, so sparse masks are cheap to walk */
+    template <typename FN> void each_set_bit (FN fn) const {
+      for (size_t i = 0; i < word_count; i ++) {
+        u64_t word = words[i];
+
+        while (word != 0) {
+          fn(i * word_bits + num::count_trailing_zeros(word));
+
+          word &= word - 1;
+        }
+      }
+    }
+
+
+    /* Get the bit of a word corresponding to a Bitmask index */
+    static constexpr word_t get_bit (size_t index) {
+      return static_cast<word_t>(static_cast<word_t>(1) << (index % word_bits));
+    }
+
+    u8_t* get_byte_pointer (size_t offset) {
+      return reinterpret_cast<u8_t*>(words) + offset;
+    }
+
+    u8_t const* get_byte_pointer (size_t offset) const {
+      return reinterpret_cast<u8_t const*>(words) + offset;
+    }
+
+
     /* Print the indices of the enabled bits of a Bitmask */
     void print (FILE* stream = stdout) const {
       fprintf(stream, "Bitmask<%zu> {", byte_count);
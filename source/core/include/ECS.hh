@@ -5,6 +5,7 @@
 #include "util.hh"
 #include "Bitmask.hh"
 #include "ThreadPool.hh"
+#include "JobSystem.hh"
 
 
 namespace mod {
@@ -15,10 +16,122 @@ namespace mod {
   #endif
 
 
+  namespace ComponentStorage {
+    enum: u8_t {
+      Dense,
+      Archetype,
+      Sparse,
+      Streamed,
+
+      total_storage_count,
+
+      Default = total_storage_count,
+
+      Invalid = -1
+    };
+
+    static constexpr char const* names [total_storage_count] = {
+      "Dense",
+      "Archetype",
+      "Sparse",
+      "Streamed"
+    };
+
+    /* Get the name of a ComponentStorage as a str */
+    static constexpr char const* name (u8_t storage) {
+      if (storage < total_storage_count) return names[storage];
+      else return "Invalid";
+    }
+
+    /* Determine if a value is a valid ComponentStorage */
+    static constexpr bool validate (u8_t storage) {
+      return storage < total_storage_count;
+    }
+
+    /* Determine if a ComponentStorage keeps its instances in Archetype chunks */
+    static constexpr bool chunked (u8_t storage) {
+      return storage == Archetype || storage == Streamed;
+    }
+  }
+
+
+  namespace CommandType {
+    enum: u8_t {
+      CreateEntity,
+      AddComponent,
+      DestroyComponent,
+      DestroyEntity,
+
+      total_command_type_count,
+
+      Invalid = -1
+    };
+
+    static constexpr char const* names [total_command_type_count] = {
+      "CreateEntity",
+      "AddComponent",
+      "DestroyComponent",
+      "DestroyEntity"
+    };
+
+    /* Get the name of a CommandType as a str */
+    static constexpr char const* name (u8_t type) {
+      if (type < total_command_type_count) return names[type];
+      else return "Invalid";
+    }
+
+    /* Determine if a value is a valid CommandType */
+    static constexpr bool validate (u8_t type) {
+      return type < total_command_type_count;
+    }
+  }
+
+
+  namespace ComponentEvent {
+    enum: u8_t {
+      Add,
+      Remove,
+      Set,
+
+      total_event_count,
+
+      Invalid = -1
+    };
+
+    static constexpr char const* names [total_event_count] = {
+      "Add",
+      "Remove",
+      "Set"
+    };
+
+    /* Get the name of a ComponentEvent as a str */
+    static constexpr char const* name (u8_t event) {
+      if (event < total_event_count) return names[event];
+      else return "Invalid";
+    }
+
+    /* Determine if a value is a valid ComponentEvent */
+    static constexpr bool validate (u8_t event) {
+      return event < total_event_count;
+    }
+  }
+
+
   struct Entity;
+  struct EntitySlot;
   struct EntityHandle;
+  struct ComponentHook;
   struct ComponentType;
+  struct HookEvent;
+  struct Archetype;
+  template <typename T> struct ComponentStreams;
+  template <typename T> struct ComponentStreamRef;
+  struct Query;
   struct System;
+  struct SystemProfile;
+  class SystemScheduleNode;
+  struct DeferredEntity;
+  struct CommandBuffer;
   class SystemIteratorArg;
   struct ECS;
   
@@ -28,20 +141,45 @@ namespace mod {
 
     ID id;
     ComponentMask enabled_components;
+    u32_t archetype_index;
+    u32_t archetype_row;
 
 
     Entity () { }
 
 
     private: friend ECS;
-      Entity (ID in_id, ComponentMask in_enabled_components)
+      Entity (ID in_id, ComponentMask in_enabled_components, u32_t in_archetype_index, u32_t in_archetype_row)
       : id(in_id)
       , enabled_components(in_enabled_components)
+      , archetype_index(in_archetype_index)
+      , archetype_row(in_archetype_row)
       { }
   };
 
+
+  struct EntitySlot {
+    u32_t index;
+    u32_t generation;
+  };
+
   
 
+  struct ComponentHook {
+    using ID = u32_t;
+
+    /* Receives the indices of a batch of Entities the ComponentEvent happened to */
+    using Callback = std::function<void (ECS*, u32_t const*, u32_t)>;
+
+    ID id;
+    u8_t event;
+    Callback callback;
+
+    // Set when a hook is removed while hooks are running, so it is skipped until it can be deleted
+    bool removed;
+  };
+
+
   struct ComponentType {
     #ifndef CUSTOM_COMPONENT_TYPE_ID
       using ID = u8_t;
@@ -52,15 +190,39 @@ namespace mod {
     static_assert(std::numeric_limits<ID>::max() >= ComponentMask::bit_count, "ComponentType ID type max value must be greater than or equal to the ComponentMask bit_count");
 
     static constexpr size_t max_component_types = ComponentMask::bit_count;
+
+    #ifndef CUSTOM_ECS_SPARSE_PAGE_SIZE
+      static constexpr u32_t sparse_page_size = 1024;
+    #else
+      static constexpr u32_t sparse_page_size = CUSTOM_ECS_SPARSE_PAGE_SIZE;
+    #endif
+
+    static constexpr u32_t sparse_initial_capacity = 16;
     
     using Destroyer = void (*) (void*);
+    using Serializer = void (*) (void const*, Array<u8_t>&);
+    using Deserializer = void (*) (void*, ECS*, void const*, size_t);
 
     ID id;
     char* name;
     void* instances;
+    u64_t* versions;
     size_t instance_size;
     size_t hash_code;
     Destroyer destroyer;
+    Serializer serializer;
+    Deserializer deserializer;
+    u8_t storage;
+
+    // Sparse storage packs instances by slot; owners maps slots to Entity indices,
+    // and pages of slots indexed by Entity are only allocated once an Entity in their range has the Component
+    u32_t sparse_capacity;
+    Array<u32_t> sparse_owners;
+    Array<u32_t*> sparse_pages;
+
+    // Hooks are called when instances of this type are added, removed or set; hooked_events has a bit set for each ComponentEvent with any hooks
+    Array<ComponentHook*> hooks;
+    u8_t hooked_events;
 
 
     ComponentType () { }
@@ -69,31 +231,74 @@ namespace mod {
     template <typename T> T& get_instance (u32_t index) const {
       m_assert(typeid(T).hash_code() == hash_code, "Cannot get ComponentType %s instance as type %s, the type hash codes do not match", name, typeid(T).name());
 
-      return static_cast<T*>(instances)[index];
+      return *static_cast<T*>(get_instance_by_id(index));
+    }
+
+    u32_t get_sparse_slot (u32_t index) const {
+      return sparse_pages.elements[index / sparse_page_size][index % sparse_page_size];
     }
 
     void* get_instance_by_id (u32_t index) const {
+      if (storage == ComponentStorage::Sparse) index = get_sparse_slot(index);
+
       return static_cast<u8_t*>(instances) + (index * instance_size);
     }
 
+    u64_t& get_version (u32_t index) const {
+      if (storage == ComponentStorage::Sparse) index = get_sparse_slot(index);
+
+      return versions[index];
+    }
+
+    /* Get the number of instances held by a Sparse ComponentType */
+    u32_t get_sparse_count () const {
+      return sparse_owners.count;
+    }
+
+    /* Determine if any hooks are registered for a ComponentEvent on this ComponentType */
+    bool has_hooks (u8_t event) const {
+      return (hooked_events & (1 << event)) != 0;
+    }
+
 
     void swap_instances (u32_t dest, u32_t src) {
       memory::copy(get_instance_by_id(dest), get_instance_by_id(src), instance_size);
+      versions[dest] = versions[src];
     }
 
 
     private: friend ECS;
-      ComponentType (u32_t capacity, ID in_id, char const* in_name, size_t in_instance_size, size_t in_hash_code, Destroyer in_destroyer)
+      ComponentType (u32_t capacity, ID in_id, char const* in_name, size_t in_instance_size, size_t in_hash_code, Destroyer in_destroyer, Serializer in_serializer, Deserializer in_deserializer, u8_t in_storage)
       : id(in_id)
       , name(str_clone(in_name))
-      , instances(memory::allocate<void>(capacity * in_instance_size))
+      , instances(NULL)
+      , versions(NULL)
       , instance_size(in_instance_size)
       , hash_code(in_hash_code)
       , destroyer(in_destroyer)
-      { }
+      , serializer(in_serializer)
+      , deserializer(in_deserializer)
+      , storage(in_storage)
+      , sparse_capacity(0)
+      , sparse_owners { }
+      , sparse_pages { }
+      , hooks { }
+      , hooked_events(0)
+      {
+        if (storage == ComponentStorage::Dense) {
+          instances = memory::allocate<void>(capacity * instance_size);
+          versions = memory::allocate<u64_t>(capacity);
+        } else if (storage == ComponentStorage::Sparse) {
+          sparse_capacity = sparse_initial_capacity;
+          instances = memory::allocate<void>(sparse_capacity * instance_size);
+          versions = memory::allocate<u64_t>(sparse_capacity);
+        }
+      }
 
 
       void reallocate (u32_t new_capacity) {
+        if (storage != ComponentStorage::Dense) return;
+
         memory::reallocate(instances, new_capacity * instance_size);
 
         m_assert(
@@ -101,22 +306,310 @@ namespace mod {
           "Out of memory or other null pointer error while attempting to reallocate ComponentType %s instances with capacity %" PRIu32,
           name, new_capacity
         );
+
+        memory::reallocate(versions, new_capacity);
+
+        m_assert(
+          versions != NULL,
+          "Out of memory or other null pointer error while attempting to reallocate ComponentType %s versions with capacity %" PRIu32,
+          name, new_capacity
+        );
       }
 
       void destroy_instance (u32_t index) {
         if (destroyer != NULL) destroyer(get_instance_by_id(index));
       }
 
+      /* Get the slot entry of an Entity index in a Sparse ComponentType, allocating its page if necessary */
+      u32_t& get_sparse_entry (u32_t index) {
+        u32_t page_index = index / sparse_page_size;
+
+        while (sparse_pages.count <= page_index) sparse_pages.append(static_cast<u32_t*>(NULL));
+
+        u32_t*& page = sparse_pages[page_index];
+
+        if (page == NULL) page = memory::allocate<u32_t>(sparse_page_size);
+
+        return page[index % sparse_page_size];
+      }
+
+      /* Give an Entity index a packed instance slot in a Sparse ComponentType */
+      void acquire_sparse_slot (u32_t index) {
+        if (sparse_owners.count == sparse_capacity) {
+          sparse_capacity *= 2;
+
+          memory::reallocate(instances, sparse_capacity * instance_size);
+          memory::reallocate(versions, sparse_capacity);
+
+          m_assert(
+            instances != NULL && versions != NULL,
+            "Out of memory or other null pointer error while attempting to reallocate Sparse ComponentType %s with capacity %" PRIu32,
+            name, sparse_capacity
+          );
+        }
+
+        get_sparse_entry(index) = sparse_owners.count;
+        sparse_owners.append(index);
+      }
+
+      /* Move the ownership of a Sparse instance to a different Entity index, without moving its data */
+      void relocate_sparse_owner (u32_t dest, u32_t src) {
+        u32_t slot = get_sparse_slot(src);
+
+        sparse_owners[slot] = dest;
+        get_sparse_entry(dest) = slot;
+      }
+
+      /* Release the instance slot of an Entity index in a Sparse ComponentType, filling the gap with the last slot */
+      void release_sparse_slot (u32_t index) {
+        u32_t slot = get_sparse_slot(index);
+        u32_t last_slot = sparse_owners.count - 1;
+
+        if (slot != last_slot) {
+          u32_t moved_index = sparse_owners[last_slot];
+
+          memory::copy(static_cast<u8_t*>(instances) + slot * instance_size, static_cast<u8_t*>(instances) + last_slot * instance_size, instance_size);
+          versions[slot] = versions[last_slot];
+
+          sparse_owners[slot] = moved_index;
+          sparse_pages[moved_index / sparse_page_size][moved_index % sparse_page_size] = slot;
+        }
+
+        -- sparse_owners.count;
+      }
+
       void destroy () {
         memory::deallocate(name);
-        memory::deallocate(instances);
+        if (instances != NULL) memory::deallocate(instances);
+        if (versions != NULL) memory::deallocate(versions);
+
+        for (auto [ i, page ] : sparse_pages) if (page != NULL) memory::deallocate(page);
+
+        sparse_pages.destroy();
+        sparse_owners.destroy();
+
+        for (auto [ i, hook ] : hooks) delete hook;
+
+        hooks.destroy();
       }
   };
 
 
+  /* A queued ComponentEvent, Entities are tracked by ID so events for Entities destroyed before delivery can be dropped */
+  struct HookEvent {
+    Entity::ID entity_id;
+    u32_t generation;
+    ComponentType::ID type_id;
+    u8_t event;
+  };
+
+
+
+  struct Archetype {
+    #ifndef CUSTOM_ECS_ARCHETYPE_CHUNK_SIZE
+      static constexpr size_t chunk_size = 16384;
+    #else
+      static constexpr size_t chunk_size = CUSTOM_ECS_ARCHETYPE_CHUNK_SIZE;
+    #endif
+
+    static constexpr size_t column_alignment = 16;
+
+    // Streamed columns store each 4 byte field of a Component in its own array,
+    // aligned and sized so a whole vector register of rows can be loaded at once
+    static constexpr size_t stream_alignment = 32;
+    static constexpr u32_t stream_width = 8;
+
+    static constexpr u32_t no_edge = std::numeric_limits<u32_t>::max();
+    static constexpr u32_t no_entity = std::numeric_limits<u32_t>::max();
+
+    ComponentMask mask;
+    u32_t count;
+
+    u32_t chunk_capacity;
+    size_t chunk_bytes;
+    Array<u8_t*> chunks;
+
+    // Change versions for Archetype stored Components are tracked per chunk, indexed by chunk then ComponentType::ID.
+    // Parallel Systems can split a chunk between workers, which all stamp it, so the versions are atomic
+    Array<std::atomic<u64_t>> chunk_versions;
+
+    ComponentType::ID column_type_ids [ComponentType::max_component_types];
+    u32_t column_count;
+    size_t column_offsets [ComponentType::max_component_types];
+
+    u32_t edges [ComponentType::max_component_types];
+
+
+    Archetype () { }
+
+
+    u32_t get_chunk_count () const {
+      return (count + chunk_capacity - 1) / chunk_capacity;
+    }
+
+    u32_t get_chunk_row_count (u32_t chunk_index) const {
+      return num::min(chunk_capacity, count - chunk_index * chunk_capacity);
+    }
+
+    u32_t* get_entity_indices (u32_t chunk_index) const {
+      return reinterpret_cast<u32_t*>(chunks.elements[chunk_index]);
+    }
+
+    u32_t& get_entity_index (u32_t row) const {
+      return get_entity_indices(row / chunk_capacity)[row % chunk_capacity];
+    }
+
+    std::atomic<u64_t>* get_chunk_versions (u32_t chunk_index) const {
+      return chunk_versions.elements + chunk_index * ComponentType::max_component_types;
+    }
+
+    void* get_column (u32_t chunk_index, ComponentType::ID type_id) const {
+      return chunks.elements[chunk_index] + column_offsets[type_id];
+    }
+
+    /* Get the address of an instance in an Archetype column; not valid for Streamed ComponentTypes */
+    void* get_instance_by_id (ComponentType const& type, u32_t row) const {
+      return static_cast<u8_t*>(get_column(row / chunk_capacity, type.id)) + (row % chunk_capacity) * type.instance_size;
+    }
+
+    /* Get the streams of a Streamed ComponentType within a chunk */
+    template <typename T> ComponentStreams<T> get_streams (ComponentType::ID type_id, u32_t chunk_index) const;
+
+    /* Copy an instance out of an Archetype column, whatever its layout */
+    ENGINE_API void read_instance (ComponentType const& type, u32_t row, void* out) const;
+
+
+    private: friend ECS;
+      ENGINE_API Archetype (ComponentMask const& in_mask, ComponentType const* types, ComponentType::ID type_count);
+
+      ENGINE_API u32_t append_row (u32_t entity_index, u64_t version);
+
+      ENGINE_API u32_t append_rows (u32_t first_entity_index, u32_t row_count, u64_t version);
+
+      ENGINE_API u32_t remove_row (u32_t row, ComponentType const* types, u64_t version);
+
+      // Copies data into an instance, whatever its layout; NULL data clears the instance
+      ENGINE_API void write_instance (ComponentType const& type, u32_t row, void const* data);
+
+      ENGINE_API void copy_instance (ComponentType const& type, u32_t dst_row, Archetype const& src, u32_t src_row);
+
+      ENGINE_API void destroy ();
+  };
+
+
+
+  /* A chunk of Streamed Components, where every 4 byte field of T is stored as a separate array of rows.
+     * Streams can be processed several Entities per instruction, and individual rows are accessed through proxies */
+  template <typename T> struct ComponentStreams {
+    static_assert(sizeof(T) % sizeof(u32_t) == 0, "Streamed Components must be made up of 4 byte fields");
+
+    static constexpr size_t stream_count = sizeof(T) / sizeof(u32_t);
+
+    u8_t* base;
+    u32_t capacity;
+
+
+    /* Get the stream of a field, given the byte offset of the field within T */
+    template <typename F = f32_t> F* get_stream (size_t field_offset) const {
+      static_assert(sizeof(F) == sizeof(u32_t), "Streamed Component fields must be 4 bytes");
+
+      return reinterpret_cast<F*>(base + field_offset * capacity);
+    }
+
+    /* Gather the fields of a row into a Component value */
+    T get (u32_t row) const {
+      T value;
+      u32_t* lanes = reinterpret_cast<u32_t*>(&value);
+
+      for (size_t i = 0; i < stream_count; i ++) lanes[i] = get_stream<u32_t>(i * sizeof(u32_t))[row];
+
+      return value;
+    }
+
+    /* Scatter a Component value into the fields of a row */
+    void set (u32_t row, T const& value) const {
+      u32_t const* lanes = reinterpret_cast<u32_t const*>(&value);
+
+      for (size_t i = 0; i < stream_count; i ++) get_stream<u32_t>(i * sizeof(u32_t))[row] = lanes[i];
+    }
+
+    ComponentStreamRef<T> operator [] (u32_t row) const {
+      return { *this, row };
+    }
+  };
+
+  /* A proxy for a single row of ComponentStreams, which reads and writes as if it were a T */
+  template <typename T> struct ComponentStreamRef {
+    ComponentStreams<T> streams;
+    u32_t row;
+
+
+    operator T () const {
+      return streams.get(row);
+    }
+
+    ComponentStreamRef& operator = (T const& value) {
+      streams.set(row, value);
+      return *this;
+    }
+
+    /* Get a reference to a single field of the row, given the byte offset of the field within T */
+    template <typename F = f32_t> F& get_field (size_t field_offset) const {
+      return streams.template get_stream<F>(field_offset)[row];
+    }
+  };
+
+  template <typename T> ComponentStreams<T> Archetype::get_streams (ComponentType::ID type_id, u32_t chunk_index) const {
+    return { static_cast<u8_t*>(get_column(chunk_index, type_id)), chunk_capacity };
+  }
+
+
+
+  struct Query {
+    ComponentMask required_components;
+    Array<u32_t> archetype_indices;
+    u32_t archetype_cursor;
+
+    // When any bits are set, only Entities where one of these Components changed since the last iteration are visited
+    ComponentMask changed_components;
+    u64_t last_version;
+
+
+    Query () { }
+
+    Query (ComponentMask in_required_components)
+    : required_components(in_required_components)
+    , archetype_cursor(0)
+    , changed_components { }
+    , last_version(0)
+    { }
+
+
+    /* Restrict a Query to Entities where any of the given Components changed since the Query last iterated */
+    template <typename ... Ts> Query& changed (ECS* ecs);
+
+
+    /* Pick up any Archetypes created in the ECS since the last update.
+     * Archetypes are never removed, so this only ever has to look at new ones */
+    ENGINE_API void update (ECS const* ecs);
+
+    /* Get the number of Entities in the Archetypes matched by a Query, as of its last update */
+    ENGINE_API u32_t get_match_count (ECS const* ecs) const;
+
+    /* Call a callback with the index of every Entity matching a Query (and its changed filter, if any).
+     * The Entities must not be structurally modified during iteration, which asserts; use a CommandBuffer instead */
+    template <typename FN> void each (ECS* ecs, FN fn);
+
+    void destroy () {
+      archetype_indices.destroy();
+    }
+  };
+
+
 
   struct System {
     using IteratorCallback = std::function<void (ECS*, u32_t)>;
+    using ChunkCallback = std::function<void (ECS*, Archetype&, u32_t, u32_t, u32_t)>;
     using CustomCallback = std::function<void (ECS*)>;
 
     using ID = u8_t;
@@ -130,12 +623,29 @@ namespace mod {
 
     bool enabled;
 
+    // The change version taken by the current (or latest) execution, and the one before it, which changed filters compare against
+    u64_t run_version;
+    u64_t last_run_version;
+
+    // Minimum number of Entities claimed at once by a worker during parallel execution, 0 uses the tuned or ECS default
+    u32_t grain_size;
+
+    // Running estimate of the iteration time per matched Entity, in performance counter ticks; negative until first measured
+    f64_t entity_cost;
+    // Grain size giving claims of roughly ECS::parallel_grain_ticks at the current entity_cost
+    u32_t tuned_grain_size;
+
+    // Component access declared for scheduling; Systems without a declaration run exclusively
+    bool access_declared;
+    ComponentMask reads;
+    ComponentMask writes;
+
     bool custom;
     union {
       struct {
         bool parallel;
-        ComponentMask required_components;
-        IteratorCallback iterator_callback;
+        Query query;
+        ChunkCallback chunk_callback;
       };
       CustomCallback custom_callback;
     };
@@ -148,13 +658,21 @@ namespace mod {
       name = other.name;
       id = other.id;
       enabled = other.enabled;
+      run_version = other.run_version;
+      last_run_version = other.last_run_version;
+      grain_size = other.grain_size;
+      entity_cost = other.entity_cost;
+      tuned_grain_size = other.tuned_grain_size;
+      access_declared = other.access_declared;
+      reads = other.reads;
+      writes = other.writes;
       custom = other.custom;
       if (custom) {
         custom_callback = other.custom_callback;
       } else {
         parallel = other.parallel;
-        required_components = other.required_components;
-        iterator_callback = other.iterator_callback;
+        query = other.query;
+        chunk_callback = other.chunk_callback;
       }
       other.~System(); // avoid memory leak during shift_systems
       return *this;
@@ -163,7 +681,7 @@ namespace mod {
     ~System () {
       if (id != 0) {
         if (custom) custom_callback.~CustomCallback();
-        else iterator_callback.~IteratorCallback();
+        else chunk_callback.~ChunkCallback();
         id = 0;
       }
     }
@@ -171,36 +689,85 @@ namespace mod {
 
     ENGINE_API void execute (ECS* ecs) const;
 
+    /* Get the grain size used for parallel execution: the explicit grain_size if set,
+     * otherwise the tuned grain size while the ECS has parallel tuning enabled, otherwise the ECS default */
+    ENGINE_API u32_t get_grain_size (ECS const* ecs) const;
 
-    private: friend ECS;
+    /* Determine if two Systems must not run concurrently, based on their declared access */
+    bool conflicts_with (System const& other) const {
+      return !access_declared || !other.access_declared
+          || (writes & (other.reads | other.writes)).any_bits()
+          || (other.writes & reads).any_bits();
+    }
+
+
+    private: friend ECS; friend SystemScheduleNode;
       System (char const* in_name, ID in_id, CustomCallback in_custom_callback)
       : name (str_clone(in_name))
       , id(in_id)
       , enabled(true)
+      , run_version(0)
+      , last_run_version(0)
+      , grain_size(0)
+      , entity_cost(-1)
+      , tuned_grain_size(0)
+      , access_declared(false)
       , custom(true)
       , custom_callback(in_custom_callback)
       { }
 
-      System (char const* in_name, ID in_id, bool in_parallel, ComponentMask in_required_components, IteratorCallback in_iterator_callback)
+      System (char const* in_name, ID in_id, bool in_parallel, ComponentMask in_required_components, ChunkCallback in_chunk_callback)
       : name (str_clone(in_name))
       , id(in_id)
       , enabled(true)
+      , run_version(0)
+      , last_run_version(0)
+      , grain_size(0)
+      , entity_cost(-1)
+      , tuned_grain_size(0)
+      , access_declared(false)
       , custom(false)
       , parallel(in_parallel)
-      , required_components(in_required_components)
-      , iterator_callback(in_iterator_callback)
+      , query(in_required_components)
+      , chunk_callback(in_chunk_callback)
       { }
 
 
+      static ChunkCallback wrap_iterator_callback (IteratorCallback callback) {
+        return [callback] (ECS* ecs, Archetype& archetype, u32_t chunk_index, u32_t row, u32_t row_ext) {
+          u32_t* entity_indices = archetype.get_entity_indices(chunk_index);
+
+          for (; row < row_ext; row ++) callback(ecs, entity_indices[row]);
+        };
+      }
+
+
       void destroy () {
         memory::deallocate(name);
+        if (!custom) query.destroy();
       }
 
-      ENGINE_API static void iterator_execution_instance (SystemIteratorArg* arg);
+      ENGINE_API void advance_version (ECS* ecs);
+
+      ENGINE_API void update_cost (ECS const* ecs, u64_t ticks, u32_t match_count);
+
+      ENGINE_API bool should_execute_parallel (ECS const* ecs, u32_t match_count) const;
+
+      ENGINE_API static u32_t iterator_execution_instance (SystemIteratorArg* arg);
+
+      ENGINE_API static u64_t claim_ranges (SystemIteratorArg* arg);
+
+      ENGINE_API static void parallel_execution_instance (SystemIteratorArg* arg);
 
-      ENGINE_API void execute_parallel (ECS* ecs) const;
+      ENGINE_API u32_t execute_parallel (ECS* ecs, u32_t match_count) const;
 
-      ENGINE_API void execute_sequential (ECS* ecs) const;
+      ENGINE_API u32_t execute_sequential (ECS* ecs, u32_t match_count) const;
+
+      ENGINE_API void execute_scheduled (ECS* ecs) const;
+
+      ENGINE_API SystemProfile* begin_profile (ECS* ecs, u64_t& start) const;
+
+      ENGINE_API void end_profile (SystemProfile* profile, u64_t start, u32_t visited, u32_t matched) const;
   };
 
 
@@ -209,6 +776,7 @@ namespace mod {
     ECS* ecs;
     u32_t index;
     Entity::ID id;
+    u32_t generation;
 
 
     EntityHandle () { }
@@ -269,7 +837,8 @@ namespace mod {
 
     bool equal (EntityHandle const& other) const {
       return ecs == other.ecs
-          && id  == other.id;
+          && id  == other.id
+          && generation == other.generation;
     }
 
     bool operator == (EntityHandle const& other) const {
@@ -279,7 +848,8 @@ namespace mod {
     
     bool not_equal (EntityHandle const& other) const {
       return ecs != other.ecs
-          || id  != other.id;
+          || id  != other.id
+          || generation != other.generation;
     }
 
     bool operator != (EntityHandle const& other) const {
@@ -287,15 +857,81 @@ namespace mod {
     }
 
     private: friend ECS;
-      EntityHandle (ECS* in_ecs, u32_t in_index, Entity::ID in_id)
+      EntityHandle (ECS* in_ecs, u32_t in_index, Entity::ID in_id, u32_t in_generation)
       : ecs(in_ecs)
       , index(in_index)
       , id(in_id)
+      , generation(in_generation)
       { }
   };
 
 
 
+  /* Execution counters of a System, recorded while profiling is enabled on its ECS */
+  struct SystemProfile {
+    #ifndef CUSTOM_ECS_PROFILE_HISTORY_SIZE
+      static constexpr u32_t history_size = 128;
+    #else
+      static constexpr u32_t history_size = CUSTOM_ECS_PROFILE_HISTORY_SIZE;
+    #endif
+
+    struct Sample {
+      // Wall time of the execution, in performance counter ticks
+      u64_t ticks;
+      // Entities handed to the System's callback, after changed filters
+      u32_t visited;
+      // Entities matching the System's required Components
+      u32_t matched;
+    };
+
+
+    // A ring buffer of the latest executions
+    Sample samples [history_size];
+    u32_t sample_count;
+    u32_t next_sample;
+
+    // Time spent iterating by each participant of the latest parallel execution, the calling thread first; empty if it ran sequentially
+    Array<u64_t> worker_ticks;
+
+
+    SystemProfile () { }
+
+
+    /* Convert performance counter ticks to milliseconds */
+    static f64_t ticks_to_ms (u64_t ticks) {
+      return static_cast<f64_t>(ticks) * 1000.0 / static_cast<f64_t>(SDL_GetPerformanceFrequency());
+    }
+
+    /* Get the Sample of the latest execution, which is zeroed if there have been none */
+    Sample const& get_latest () const {
+      return samples[(next_sample + history_size - 1) % history_size];
+    }
+
+    /* Get the mean wall time of the recorded executions, in milliseconds */
+    ENGINE_API f64_t get_average_ms () const;
+
+    /* Get the wall time in milliseconds that the given percentage (0 to 100) of recorded executions did not exceed */
+    ENGINE_API f64_t get_percentile_ms (f64_t percentile) const;
+
+    /* Get the mean number of Entities visited by the recorded executions */
+    ENGINE_API f64_t get_average_visited () const;
+
+    /* Get the mean number of Entities matched by the recorded executions */
+    ENGINE_API f64_t get_average_matched () const;
+
+    /* Discard all recorded executions */
+    ENGINE_API void clear ();
+
+
+    private: friend ECS; friend System;
+      ENGINE_API void record (u64_t ticks, u32_t visited, u32_t matched);
+
+      void destroy () {
+        worker_ticks.destroy();
+      }
+  };
+
+
   class SystemIteratorArg {
     friend ECS;
     friend System;
@@ -317,43 +953,275 @@ namespace mod {
   };
 
 
-  struct ECS {
-    #ifndef CUSTOM_ECS_DEFAULT_ENTITY_CAPACITY
-      static constexpr u32_t default_entity_capacity = 0xffffu;
-    #else
-      static constexpr u32_t default_entity_capacity = CUSTOM_ECS_DEFAULT_ENTITY_CAPACITY;
-    #endif
-
-    #ifndef CUSTOM_ECS_DEFAULT_ENTITY_THREAD_THRESHOLD
-      static constexpr u32_t default_entity_thread_threshold = 10000;
-    #else
-      static constexpr u32_t default_entity_thread_threshold = CUSTOM_ECS_DEFAULT_ENTITY_THREAD_THRESHOLD;
-    #endif
+  class SystemScheduleNode {
+    friend ECS;
 
+    ECS* ecs;
+    System* sys;
+    std::atomic<u32_t> dependency_count;
+    u32_t dependent_base;
+    u32_t dependent_count;
 
-    Entity* entities;
-    u32_t entity_count;
-    u32_t entity_capacity;
-    u32_t entity_id_counter;
+    ENGINE_API static void execution_instance (SystemScheduleNode* node);
+
+    public:
+      SystemScheduleNode () { }
+  };
+
+
+
+  struct DeferredEntity {
+    u32_t index;
+  };
+
+  struct CommandBuffer {
+    struct Target {
+      EntityHandle handle;
+      u32_t pending_index;
+    };
+
+    struct Command {
+      u8_t type;
+      ComponentType::ID type_id;
+      u32_t sequence;
+      u32_t data_offset;
+      CommandBuffer* buffer;
+      Target target;
+    };
+
+
+    static constexpr u32_t no_pending = std::numeric_limits<u32_t>::max();
+    static constexpr size_t data_alignment = 16;
+
+
+    ECS* ecs;
+    thrd_t owner;
+
+    Array<Command> commands;
+    Array<u8_t> data;
+    u32_t pending_count;
+
+    u32_t playback_base;
+    Array<EntityHandle> created_entities;
+
+
+
+    ENGINE_API DeferredEntity create_entity ();
+
+
+    ENGINE_API void destroy_entity (u32_t index);
+
+    ENGINE_API void destroy_entity (EntityHandle const& handle);
+
+
+    ENGINE_API void add_component_by_id (u32_t index, ComponentType::ID type_id, void const* data);
+
+    ENGINE_API void add_component_by_id (EntityHandle const& handle, ComponentType::ID type_id, void const* data);
+
+    ENGINE_API void add_component_by_id (DeferredEntity entity, ComponentType::ID type_id, void const* data);
+
+    template <typename T, typename E> void add_component (E const& entity, T const& data);
+
+    template <typename T, typename E, typename ... A> void create_component (E const& entity, A ... args);
+
+
+    ENGINE_API void destroy_component_by_id (u32_t index, ComponentType::ID type_id);
+
+    ENGINE_API void destroy_component_by_id (EntityHandle const& handle, ComponentType::ID type_id);
+
+    ENGINE_API void destroy_component_by_id (DeferredEntity entity, ComponentType::ID type_id);
+
+    template <typename T, typename E> void destroy_component (E const& entity);
+
+
+    bool empty () const {
+      return playback_base == commands.count;
+    }
+
+
+    private: friend ECS;
+      CommandBuffer (ECS* in_ecs, thrd_t in_owner)
+      : ecs(in_ecs)
+      , owner(in_owner)
+      , commands { }
+      , data { }
+      , pending_count(0)
+      , playback_base(0)
+      , created_entities { }
+      { }
+
+      ENGINE_API Target get_target (u32_t index) const;
+
+      ENGINE_API Target get_target (EntityHandle const& handle) const;
+
+      ENGINE_API Target get_target (DeferredEntity entity) const;
+
+      ENGINE_API void* record (u8_t type, ComponentType::ID type_id, Target const& target, size_t data_size = 0);
+
+      ENGINE_API void clear ();
+
+      ENGINE_API void destroy ();
+  };
+
+
+  namespace Internal {
+    /* Per-type memo of the ComponentType::ID a type was registered with, keyed by ECS serial.
+     * Each entry packs the serial into the high half and the ID into the low half,
+     * so it can be read and written atomically from system worker threads */
+    template <typename T> struct ComponentTypeCache {
+      static constexpr size_t entry_count = 4;
+
+      static inline std::atomic<u64_t> entries [entry_count];
+
+
+      static std::atomic<u64_t>& get_entry (u32_t serial) {
+        return entries[serial % entry_count];
+      }
+
+      static bool lookup (u32_t serial, ComponentType::ID& out_id) {
+        u64_t entry = get_entry(serial).load(std::memory_order_relaxed);
+
+        if (static_cast<u32_t>(entry >> 32) != serial) return false;
+
+        out_id = static_cast<ComponentType::ID>(entry & 0xffffffffu);
+
+        return true;
+      }
+
+      static void store (u32_t serial, ComponentType::ID id) {
+        get_entry(serial).store((static_cast<u64_t>(serial) << 32) | static_cast<u64_t>(id), std::memory_order_relaxed);
+      }
+    };
+  }
+
+
+  struct ECS {
+    #ifndef CUSTOM_ECS_DEFAULT_ENTITY_CAPACITY
+      static constexpr u32_t default_entity_capacity = 0xffffu;
+    #else
+      static constexpr u32_t default_entity_capacity = CUSTOM_ECS_DEFAULT_ENTITY_CAPACITY;
+    #endif
+
+    #ifndef CUSTOM_ECS_DEFAULT_ENTITY_THREAD_THRESHOLD
+      static constexpr u32_t default_entity_thread_threshold = 10000;
+    #else
+      static constexpr u32_t default_entity_thread_threshold = CUSTOM_ECS_DEFAULT_ENTITY_THREAD_THRESHOLD;
+    #endif
+
+    #ifndef CUSTOM_ECS_DEFAULT_SYSTEM_GRAIN_SIZE
+      static constexpr u32_t default_system_grain_size = 64;
+    #else
+      static constexpr u32_t default_system_grain_size = CUSTOM_ECS_DEFAULT_SYSTEM_GRAIN_SIZE;
+    #endif
+
+    // Initial estimate of the time lost to dispatching a System to the thread pool, refined by measurement
+    #ifndef CUSTOM_ECS_DEFAULT_PARALLEL_OVERHEAD_US
+      static constexpr f64_t default_parallel_overhead_us = 50.0;
+    #else
+      static constexpr f64_t default_parallel_overhead_us = CUSTOM_ECS_DEFAULT_PARALLEL_OVERHEAD_US;
+    #endif
+
+    // Time each range claimed by a worker should take, which tuned grain sizes are derived from
+    #ifndef CUSTOM_ECS_PARALLEL_GRAIN_US
+      static constexpr f64_t parallel_grain_us = 20.0;
+    #else
+      static constexpr f64_t parallel_grain_us = CUSTOM_ECS_PARALLEL_GRAIN_US;
+    #endif
+
+    // Weight of each new measurement in the running cost estimates
+    static constexpr f64_t tuning_rate = 0.125;
+
+    #ifndef CUSTOM_ECS_DEFAULT_COMPONENT_STORAGE
+      static constexpr u8_t default_component_storage = ComponentStorage::Dense;
+    #else
+      static constexpr u8_t default_component_storage = CUSTOM_ECS_DEFAULT_COMPONENT_STORAGE;
+    #endif
+
+    // Define as ComponentStorage::Streamed to opt Transform3D into a per field layout, processed with ComponentStreams
+    #ifndef CUSTOM_ECS_TRANSFORM3D_STORAGE
+      static constexpr u8_t transform3d_storage = ComponentStorage::Default;
+    #else
+      static constexpr u8_t transform3d_storage = CUSTOM_ECS_TRANSFORM3D_STORAGE;
+    #endif
+
+
+    u32_t serial;
+
+    Entity* entities;
+    u32_t entity_count;
+    u32_t entity_capacity;
+
+    Array<EntitySlot> entity_slots;
+    Entity::ID free_entity_id;
 
     ComponentType component_types [ComponentType::max_component_types];
     ComponentType::ID component_type_count;
+    u8_t default_storage;
+
+    // Every System execution takes a new version, and mutable Component access stamps the Component with it
+    std::atomic<u64_t> change_version;
+
+    Array<Archetype> archetypes;
 
     System systems [System::max_systems];
     System::ID system_count;
     System::ID system_id_counter;
 
     SystemIteratorArg* system_iterator_args;
+    // The most JobSystem workers a single parallel System is spread across
     u32_t max_threads;
     u32_t max_iterators;
 
+    // Parallel Systems hand out their matched Entities from a shared cursor, in shrinking ranges no smaller than the grain size
+    u32_t system_grain_size;
+    u32_t system_iterator_count;
+    std::atomic<u32_t> system_iterator_cursor;
+    std::atomic<u32_t> system_iterator_pending;
+    std::atomic<u32_t> system_iterator_visited;
+    std::atomic<u64_t> system_iterator_ticks;
+
+    // Only used when parallel_tuning is disabled, in which case every parallel System uses the thread pool once it is enabled
     u32_t entity_thread_threshold;
 
+    // When set, a parallel System is only dispatched to the thread pool when its estimated work, from its measured entity_cost,
+    // saves more time than parallel_overhead; the thread pool is then enabled on demand
+    bool parallel_tuning;
+    // Running estimate of the time lost per parallel dispatch, and the target duration of a claimed range, in performance counter ticks
+    f64_t parallel_overhead;
+    f64_t parallel_grain_ticks;
+
+    // When set, consecutive Systems with declared access are run concurrently where their access does not conflict
+    bool parallel_systems;
+    SystemScheduleNode* system_schedule;
+    Array<System::ID> system_schedule_dependents;
+    std::atomic<u32_t> system_schedule_remaining;
+
+    Array<CommandBuffer*> command_buffers;
+    Array<CommandBuffer::Command> command_playback;
+    mtx_t command_buffer_mtx;
+
+    // Iterations of Entities in progress, by Systems, each and Query::each.
+    // Structural changes would move the rows being iterated, so they assert while this is not zero
+    std::atomic<u32_t> iteration_depth;
+
+    // Indexed by System::ID, so it holds max_systems + 1 entries; NULL while profiling is disabled
+    SystemProfile* system_profiles;
+
+    // While a hook batch is open, Add and Set events are queued and delivered grouped by ComponentType when it closes
+    ComponentHook::ID hook_id_counter;
+    u32_t hook_batch_depth;
+    Array<HookEvent> hook_events;
+
+    // Hooks removed while any are running are only marked, and deleted once the outermost invocation returns
+    u32_t hook_invoke_depth;
+    bool hook_removal_pending;
+
+    // The ThreadPool of the engine JobSystem, which is shared with every other ECS, once enabled
     ThreadPool* thread_pool;
 
 
 
-    ENGINE_API ECS (u32_t in_entity_capacity = default_entity_capacity, u32_t in_entity_thread_threshold = default_entity_thread_threshold, uint8_t in_max_threads = 8, uint8_t thread_iterator_ratio = 1);
+    ENGINE_API ECS (u32_t in_entity_capacity = default_entity_capacity, u32_t in_entity_thread_threshold = default_entity_thread_threshold, uint8_t in_max_threads = 8, uint8_t thread_iterator_ratio = 1, u8_t in_default_storage = default_component_storage);
     
 
 
@@ -370,9 +1238,21 @@ namespace mod {
 
     ENGINE_API EntityHandle create_entity ();
 
+    /* Create a number of Entities at once, all with the Components in a mask.
+     * The Entities are placed contiguously, starting at the returned index.
+     * prototype_data, if given, holds one instance pointer per Component in the mask (in ComponentType::ID order),
+     * which is copied bytewise into every new Entity; a NULL array or element zero initializes the Component instead.
+     * As the copies share any resources the prototype owns, prototypes may only be given for plain data ComponentTypes without a destroyer.
+     * out_handles, if given, receives a handle for each new Entity */
+    ENGINE_API u32_t create_entities (u32_t count, ComponentMask const& mask, void const* const* prototype_data = NULL, EntityHandle* out_handles = NULL);
+
     EntityHandle get_handle (u32_t index) const {
       m_assert(index < entity_count, "Out of range ECS access for Entity at index %" PRIu32 ", (count is %" PRIu32 ")", index, entity_count);
-      return { const_cast<ECS*>(this), index, entities[index].id };
+      return { const_cast<ECS*>(this), index, entities[index].id, get_entity_slot(entities[index].id).generation };
+    }
+
+    EntitySlot& get_entity_slot (Entity::ID id) const {
+      return entity_slots[id - 1];
     }
 
 
@@ -390,8 +1270,17 @@ namespace mod {
 
     ENGINE_API void destroy_entity (EntityHandle& handle);
 
+    /* Destroy a number of Entities at once.
+     * All Component destroyers run first, then storage is compacted in a single pass.
+     * Invalid and duplicate handles are ignored */
+    ENGINE_API void destroy_entities (EntityHandle const* handles, u32_t count);
 
-    template <typename T> ComponentType::ID create_component_type (char const* name = NULL, ComponentType::Destroyer destroyer = NULL) {
+    void destroy_entities (Array<EntityHandle> const& handles) {
+      destroy_entities(handles.elements, handles.count);
+    }
+
+
+    template <typename T> ComponentType::ID create_component_type (char const* name = NULL, ComponentType::Destroyer destroyer = NULL, u8_t storage = ComponentStorage::Default) {
       ComponentType::ID type_id = component_type_count;
       
       type_info const& t_info = typeid(T);
@@ -418,7 +1307,27 @@ namespace mod {
         if (destroyer == NULL) destroyer = std_destroyer;
       }
 
-      component_types[type_id] = ComponentType(entity_capacity, type_id, name, sizeof(T), hash_code, destroyer);
+      ComponentType::Serializer serializer = NULL;
+      ComponentType::Deserializer deserializer = NULL;
+
+      if constexpr (Internal::has_serialize<T>::value && Internal::has_deserialize<T>::value) {
+        serializer = [] (void const* instance, Array<u8_t>& out) { reinterpret_cast<T const*>(instance)->serialize(out); };
+        deserializer = [] (void* instance, ECS* ecs, void const* data, size_t size) { reinterpret_cast<T*>(instance)->deserialize(ecs, data, size); };
+      }
+
+      if (storage == ComponentStorage::Default) storage = default_storage;
+
+      m_assert(ComponentStorage::validate(storage), "Cannot create ComponentType wrapping type %s with invalid ComponentStorage %" PRIu8, name, storage);
+
+      m_assert(
+        storage != ComponentStorage::Streamed || (std::is_trivially_copyable_v<T> && sizeof(T) % sizeof(u32_t) == 0 && destroyer == NULL && serializer == NULL),
+        "Cannot create Streamed ComponentType wrapping type %s, Streamed Components must be trivially copyable, made up of 4 byte fields, and have no destroyer or serialize hooks",
+        name
+      );
+
+      component_types[type_id] = ComponentType(entity_capacity, type_id, name, sizeof(T), hash_code, destroyer, serializer, deserializer, storage);
+
+      Internal::ComponentTypeCache<T>::store(serial, type_id);
 
       ++ component_type_count;
 
@@ -429,10 +1338,18 @@ namespace mod {
     ENGINE_API ComponentType& get_component_type_by_name (char const* name) const;
     
     template <typename T> ComponentType& get_component_type_by_instance_type () const {
+      ComponentType::ID cached_id;
+
+      if (Internal::ComponentTypeCache<T>::lookup(serial, cached_id)) return const_cast<ComponentType&>(component_types[cached_id]);
+
       size_t hash_code = typeid(T).hash_code();
 
       for (ComponentType::ID i = 0; i < component_type_count; i ++) {
-        if (component_types[i].hash_code == hash_code) return const_cast<ComponentType&>(component_types[i]);
+        if (component_types[i].hash_code == hash_code) {
+          Internal::ComponentTypeCache<T>::store(serial, i);
+
+          return const_cast<ComponentType&>(component_types[i]);
+        }
       }
 
       String types;
@@ -441,6 +1358,131 @@ namespace mod {
     }
 
 
+    template <typename ... Ts> ComponentMask get_component_mask () const {
+      ComponentMask mask;
+
+      (mask.set(get_component_type_by_instance_type<std::remove_const_t<Ts>>().id), ...);
+
+      return mask;
+    }
+
+
+    /* Get the version a Component write made now would be stamped with.
+     * Inside a System this is the System's run version, elsewhere it is newer than any System run so far */
+    ENGINE_API u64_t get_write_version () const;
+
+    /* Stamp a Component of an Entity with a change version */
+    void mark_changed (u32_t index, ComponentType::ID type_id, u64_t version) const {
+      ComponentType const& type = component_types[type_id];
+
+      if (ComponentStorage::chunked(type.storage)) {
+        Entity const& entity = entities[index];
+        Archetype const& archetype = archetypes.elements[entity.archetype_index];
+
+        // Every writer of a chunk during one System execution stores the same version
+        archetype.get_chunk_versions(entity.archetype_row / archetype.chunk_capacity)[type_id].store(version, std::memory_order_relaxed);
+      } else {
+        type.get_version(index) = version;
+      }
+    }
+
+    /* Get the change version of a Component of an Entity; chunked Components share the version of their chunk */
+    u64_t get_component_version (u32_t index, ComponentType::ID type_id) const {
+      ComponentType const& type = component_types[type_id];
+
+      if (ComponentStorage::chunked(type.storage)) {
+        Entity const& entity = entities[index];
+        Archetype const& archetype = archetypes.elements[entity.archetype_index];
+
+        return archetype.get_chunk_versions(entity.archetype_row / archetype.chunk_capacity)[type_id].load(std::memory_order_relaxed);
+      } else {
+        return type.get_version(index);
+      }
+    }
+
+    /* Call a callback with each run of rows [row, row_ext) within an Archetype chunk segment,
+     * where any of the given Components changed after a version */
+    template <typename FN> void each_changed_run (ComponentMask const& changed_components, u64_t since_version, Archetype const& archetype, u32_t chunk_index, u32_t row, u32_t row_ext, FN fn) const {
+      std::atomic<u64_t> const* chunk_versions = archetype.get_chunk_versions(chunk_index);
+      ComponentType const* entity_versioned_types [ComponentType::max_component_types];
+      u32_t entity_versioned_count = 0;
+
+      ComponentMask tested_components = changed_components & archetype.mask;
+
+      for (size_t i = tested_components.next_set_bit(0); i < ComponentType::max_component_types; i = tested_components.next_set_bit(i + 1)) {
+        ComponentType const& type = component_types[i];
+
+        if (ComponentStorage::chunked(type.storage)) {
+          if (chunk_versions[i].load(std::memory_order_relaxed) > since_version) return fn(row, row_ext);
+        } else {
+          entity_versioned_types[entity_versioned_count] = &type;
+          ++ entity_versioned_count;
+        }
+      }
+
+      u32_t const* entity_indices = archetype.get_entity_indices(chunk_index);
+      u32_t run_base = row;
+
+      for (; row < row_ext; row ++) {
+        u32_t entity_index = entity_indices[row];
+        bool changed = false;
+
+        for (u32_t j = 0; j < entity_versioned_count && !changed; j ++) changed = entity_versioned_types[j]->get_version(entity_index) > since_version;
+
+        if (!changed) {
+          if (run_base < row) fn(run_base, row);
+          run_base = row + 1;
+        }
+      }
+
+      if (run_base < row_ext) fn(run_base, row_ext);
+    }
+
+
+    void* get_instance_by_id (u32_t index, ComponentType::ID type_id) const {
+      ComponentType const& type = component_types[type_id];
+
+      m_assert(
+        type.storage != ComponentStorage::Streamed,
+        "Cannot get the address of a Component of Streamed ComponentType %s, use read_component/write_component or its ComponentStreams",
+        type.name
+      );
+
+      if (type.storage == ComponentStorage::Archetype) {
+        Entity const& entity = entities[index];
+        return archetypes.elements[entity.archetype_index].get_instance_by_id(type, entity.archetype_row);
+      } else {
+        return type.get_instance_by_id(index);
+      }
+    }
+
+    /* Copy a Component instance of an Entity out of storage, whatever its layout */
+    void read_instance_by_id (u32_t index, ComponentType::ID type_id, void* out) const {
+      ComponentType const& type = component_types[type_id];
+
+      if (ComponentStorage::chunked(type.storage)) {
+        Entity const& entity = entities[index];
+        archetypes.elements[entity.archetype_index].read_instance(type, entity.archetype_row, out);
+      } else {
+        memory::copy(out, type.get_instance_by_id(index), type.instance_size);
+      }
+    }
+
+    /* Copy data into a Component instance of an Entity, whatever its layout; NULL data clears the instance */
+    void write_instance_by_id (u32_t index, ComponentType::ID type_id, void const* data) {
+      ComponentType const& type = component_types[type_id];
+
+      if (ComponentStorage::chunked(type.storage)) {
+        Entity const& entity = entities[index];
+        archetypes.elements[entity.archetype_index].write_instance(type, entity.archetype_row, data);
+      } else if (data != NULL) {
+        memory::copy(type.get_instance_by_id(index), data, type.instance_size);
+      } else {
+        memory::clear(type.get_instance_by_id(index), type.instance_size);
+      }
+    }
+
+
     ENGINE_API void* create_component_by_id (u32_t index, ComponentType::ID type_id);
 
     ENGINE_API void* create_component_by_id (EntityHandle& handle, ComponentType::ID type_id);
@@ -463,32 +1505,19 @@ namespace mod {
         type.name, entity.id
       );
 
-      entity.enabled_components.set(type_id);
+      m_assert(type.storage != ComponentStorage::Streamed, "Cannot create Component of Streamed ComponentType %s by reference, use write_component", type.name);
 
-      auto new_instance = (T*) type.get_instance_by_id(index);
+      auto new_instance = static_cast<T*>(enable_component(index, type.id));
 
       new (new_instance) T { args... };
 
+      notify_component_hooks(index, type.id, ComponentEvent::Add);
+
       return *new_instance;
     }
 
     template <typename T, typename ... A> T& create_component (EntityHandle& handle, A ... args) {
-      Entity& entity = *handle;
-      ComponentType& type = get_component_type_by_instance_type<T>();
-
-      m_assert(
-        !entity.enabled_components.match_index(type.id),
-        "Cannot create Component of type %s on Entity with ID %" PRIu32 " because a Component of this type already exists",
-        type.name, entity.id
-      );
-
-      entity.enabled_components.set(type.id);
-
-      auto new_instance = (T*) type.get_instance_by_id(handle.index);
-
-      new (new_instance) T { args... };
-
-      return *new_instance;
+      return create_component<T>(handle.verified().index, args...);
     }
 
 
@@ -514,32 +1543,20 @@ namespace mod {
         type.name, (u64_t) entity.id
       );
 
-      entity.enabled_components.set(type_id);
+      m_assert(type.storage != ComponentStorage::Streamed, "Cannot add Component of Streamed ComponentType %s by reference, use write_component", type.name);
 
-      auto new_instance = (T*) type.get_instance_by_id(index);
+      auto new_instance = static_cast<T*>(enable_component(index, type.id));
 
       new (new_instance) T { data };
 
+      notify_component_hooks(index, type.id, ComponentEvent::Add);
+      notify_component_hooks(index, type.id, ComponentEvent::Set);
+
       return *new_instance;
     }
 
     template <typename T> T& add_component (EntityHandle& handle, T const& data) {
-      Entity& entity = *handle;
-      ComponentType& type = get_component_type_by_instance_type<T>();
-
-      m_assert(
-        !entity.enabled_components.match_index(type.id),
-        "Cannot add Component of type %s on Entity with ID %" PRIu32 " because a Component of this type already exists",
-        type.name, entity.id
-      );
-
-      entity.enabled_components.set(type.id);
-
-      auto new_instance = static_cast<T*>(type.get_instance_by_id(handle.index));
-
-      new (new_instance) T { data };
-
-      return *new_instance;
+      return add_component<T>(handle.verified().index, data);
     }
 
 
@@ -555,9 +1572,10 @@ namespace mod {
       return get_component_by_id(handle, get_component_type_by_name(name).id);
     }
 
+    // Getting a non-const Component marks it as changed, use get_component<T const> for read only access
     template <typename T> T& get_component (u32_t index) const {
       Entity& entity = get_entity(index);
-      ComponentType& type = get_component_type_by_instance_type<T>();
+      ComponentType& type = get_component_type_by_instance_type<std::remove_const_t<T>>();
 
       m_assert(
         entity.enabled_components.match_index(type.id),
@@ -565,20 +1583,44 @@ namespace mod {
         type.name, entity.id
       );
 
-      return type.get_instance<T>(index);
+      if constexpr (!std::is_const_v<T>) mark_changed(index, type.id, get_write_version());
+
+      return *static_cast<T*>(get_instance_by_id(index, type.id));
     }
 
     template <typename T> T& get_component (EntityHandle& handle) const {
-      Entity& entity = *handle;
-      ComponentType& type = get_component_type_by_instance_type<T>();
+      return get_component<T>(handle.verified().index);
+    }
 
-      m_assert(
-        entity.enabled_components.match_index(type.id),
-        "Cannot get Component of type %s on Entity with ID %" PRIu32 " because a Component of this type does not exist for the given Entity",
-        type.name, entity.id
-      );
 
-      return type.get_instance<T>(handle.index);
+    /* Copy the value of a Component of an Entity into a buffer.
+     * Works for every ComponentStorage, including Streamed ones which cannot be accessed by reference */
+    ENGINE_API void read_component_by_id (u32_t index, ComponentType::ID type_id, void* out) const;
+
+    ENGINE_API void read_component_by_id (EntityHandle& handle, ComponentType::ID type_id, void* out) const;
+
+    /* Set the value of a Component of an Entity, adding the Component if the Entity does not have one.
+     * Works for every ComponentStorage, including Streamed ones which cannot be accessed by reference */
+    ENGINE_API void write_component_by_id (u32_t index, ComponentType::ID type_id, void const* data);
+
+    ENGINE_API void write_component_by_id (EntityHandle& handle, ComponentType::ID type_id, void const* data);
+
+    template <typename T> T read_component (u32_t index) const {
+      T value;
+      read_component_by_id(index, get_component_type_by_instance_type<T>().id, &value);
+      return value;
+    }
+
+    template <typename T> T read_component (EntityHandle& handle) const {
+      return read_component<T>(handle.verified().index);
+    }
+
+    template <typename T> void write_component (u32_t index, T const& data) {
+      write_component_by_id(index, get_component_type_by_instance_type<T>().id, &data);
+    }
+
+    template <typename T> void write_component (EntityHandle& handle, T const& data) {
+      write_component<T>(handle.verified().index, data);
     }
 
 
@@ -603,6 +1645,45 @@ namespace mod {
     }
 
 
+    /* Register a callback for a ComponentEvent on a ComponentType, and get an ID that can be used to remove it.
+     * Add hooks are called after a Component is created with its initial value in place,
+     * Set hooks after add_component or write_component assign a value (Add hooks run first for a new Component),
+     * and Remove hooks before a Component is destroyed, alone or with its Entity, so the Component can still be read.
+     * Hooks receive a batch of Entity indices: every Entity in a create_entities or destroy_entities call is delivered at once,
+     * and Add and Set events are queued while a hook batch is open, which flush_commands and read_snapshot do internally.
+     * Indices are only valid until the ECS changes structurally, so hooks should record structural changes in a CommandBuffer.
+     * Hooks always run on the thread that made the change, never on System workers: a hooked ComponentType cannot be written
+     * with add_component or write_component while a System or each is iterating, and asserts if it is; use a CommandBuffer.
+     * Set hooks are not called for mutable access through get_component or Systems; use changed filters to find those */
+    ENGINE_API ComponentHook::ID add_component_hook (ComponentType::ID type_id, u8_t event, ComponentHook::Callback callback);
+
+    template <typename T> ComponentHook::ID add_component_hook (u8_t event, ComponentHook::Callback callback) {
+      return add_component_hook(get_component_type_by_instance_type<T>().id, event, callback);
+    }
+
+    template <typename T> ComponentHook::ID on_add (ComponentHook::Callback callback) {
+      return add_component_hook<T>(ComponentEvent::Add, callback);
+    }
+
+    template <typename T> ComponentHook::ID on_remove (ComponentHook::Callback callback) {
+      return add_component_hook<T>(ComponentEvent::Remove, callback);
+    }
+
+    template <typename T> ComponentHook::ID on_set (ComponentHook::Callback callback) {
+      return add_component_hook<T>(ComponentEvent::Set, callback);
+    }
+
+    /* Unregister a hook, returns false if no hook has the given ID.
+     * Hooks may remove themselves or others while running; removed hooks are not called again */
+    ENGINE_API bool remove_component_hook (ComponentHook::ID id);
+
+    /* Start queueing Add and Set events; batches nest, and the queue is delivered when the outermost batch ends.
+     * Events for the same Entity and ComponentType are merged, and those for Entities or Components destroyed before delivery are dropped */
+    ENGINE_API void begin_hook_batch ();
+
+    ENGINE_API void end_hook_batch ();
+
+
     ENGINE_API s32_t get_system_index_by_id (System::ID id) const;
 
     ENGINE_API s32_t get_system_index_by_name (char const* name) const;
@@ -612,6 +1693,55 @@ namespace mod {
     ENGINE_API System& get_system_by_name (char const* name) const;
 
 
+    /* Start recording wall time and Entity counts for every System execution; this has a small cost per execution */
+    ENGINE_API void enable_profiling ();
+
+    /* Stop recording System executions and discard the recorded profiles */
+    ENGINE_API void disable_profiling ();
+
+    bool profiling_enabled () const {
+      return system_profiles != NULL;
+    }
+
+    ENGINE_API SystemProfile& get_system_profile (System::ID id) const;
+
+    ENGINE_API SystemProfile& get_system_profile (char const* name) const;
+
+    /* Draw an ImGui window listing the profile of every System, in execution order */
+    ENGINE_API void show_profiler (char const* title = "ECS Profiler", bool* open = NULL);
+
+
+    ENGINE_API void set_system_grain_size (System::ID id, u32_t grain_size);
+
+    ENGINE_API void set_system_grain_size (char const* name, u32_t grain_size);
+
+
+    /* Restrict an iterator System to Entities where any of the given Components changed since it last ran */
+    ENGINE_API void set_system_changed_filter (System::ID id, ComponentMask changed_components);
+
+    template <typename ... Ts> void set_system_changed_filter (System::ID id) {
+      set_system_changed_filter(id, get_component_mask<Ts...>());
+    }
+
+
+    /* Declare every Component a System reads and writes, allowing ECS::parallel_systems to run it alongside others it does not conflict with.
+     * Systems without a declaration run exclusively */
+    ENGINE_API void set_system_access (System::ID id, ComponentMask reads, ComponentMask writes);
+
+    ENGINE_API void set_system_access (char const* name, ComponentMask reads, ComponentMask writes);
+
+    template <typename ... Ts> void set_system_access (System::ID id) {
+      ComponentMask reads;
+      ComponentMask writes;
+      get_component_access<Ts...>(reads, writes);
+      set_system_access(id, reads, writes);
+    }
+
+    template <typename ... Ts> void set_system_access (char const* name) {
+      set_system_access<Ts...>(get_system_by_name(name).id);
+    }
+
+
     ENGINE_API System::ID create_system (char const* name, System::CustomCallback callback);
 
     ENGINE_API System::ID create_system_before (System::ID before_target, char const* name, System::CustomCallback callback);
@@ -634,13 +1764,299 @@ namespace mod {
     ENGINE_API System::ID create_system_after (char const* after_name, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback);
 
 
+    // Typed Systems run exclusively like any other until their access is declared, as the callback may touch Components
+    // beyond its parameters; call set_system_access<Ts...>(id) to opt in when it only uses those it is given
+    template <typename ... Ts, typename FN> System::ID create_system (char const* name, bool parallel, FN fn) {
+      System::ID id = create_chunk_system(name, parallel, get_component_mask<Ts...>(), make_chunk_callback<Ts...>(fn));
+      return id;
+    }
+
+    template <typename ... Ts, typename FN> System::ID create_system_before (System::ID before_target, char const* name, bool parallel, FN fn) {
+      System::ID id = create_chunk_system_before(before_target, name, parallel, get_component_mask<Ts...>(), make_chunk_callback<Ts...>(fn));
+      return id;
+    }
+
+    template <typename ... Ts, typename FN> System::ID create_system_before (char const* before_name, char const* name, bool parallel, FN fn) {
+      System::ID id = create_chunk_system_before(before_name, name, parallel, get_component_mask<Ts...>(), make_chunk_callback<Ts...>(fn));
+      return id;
+    }
+
+    template <typename ... Ts, typename FN> System::ID create_system_after (System::ID after_target, char const* name, bool parallel, FN fn) {
+      System::ID id = create_chunk_system_after(after_target, name, parallel, get_component_mask<Ts...>(), make_chunk_callback<Ts...>(fn));
+      return id;
+    }
+
+    template <typename ... Ts, typename FN> System::ID create_system_after (char const* after_name, char const* name, bool parallel, FN fn) {
+      System::ID id = create_chunk_system_after(after_name, name, parallel, get_component_mask<Ts...>(), make_chunk_callback<Ts...>(fn));
+      return id;
+    }
+
+
+    template <typename ... Ts, typename FN> void each (FN fn) {
+      static_assert(sizeof...(Ts) > 0, "ECS::each requires at least one Component type");
+
+      ComponentType::ID type_ids [] = { get_component_type_by_instance_type<std::remove_const_t<Ts>>().id ... };
+      ComponentMask mask = get_component_mask<Ts...>();
+
+      validate_referenced_types(type_ids, sizeof...(Ts));
+
+      begin_iteration();
+
+      for (u32_t i = 0; i < archetypes.count; i ++) {
+        Archetype& archetype = archetypes[i];
+
+        if (archetype.count == 0 || !archetype.mask.match_subset(mask)) continue;
+
+        u32_t chunk_count = archetype.get_chunk_count();
+
+        for (u32_t chunk_index = 0; chunk_index < chunk_count; chunk_index ++) {
+          iterate_chunk<Ts...>(type_ids, archetype, chunk_index, 0, archetype.get_chunk_row_count(chunk_index), fn, std::index_sequence_for<Ts...> { });
+        }
+      }
+
+      end_iteration();
+    }
+
+
+    /* Call a callback for each chunk of Entities with a Streamed Component T and any other required Components.
+     * The callback receives the chunk's ComponentStreams<T>, its Entity indices, and the range of rows [row, row_ext) to process */
+    template <typename T, typename FN> void each_streams (ComponentMask required_components, FN fn) {
+      ComponentType::ID type_id = get_streamed_type_id<T>();
+
+      required_components.set(type_id);
+
+      System::ChunkCallback callback = make_streams_callback<T>(type_id, fn);
+
+      begin_iteration();
+
+      for (u32_t i = 0; i < archetypes.count; i ++) {
+        Archetype& archetype = archetypes[i];
+
+        if (archetype.count == 0 || !archetype.mask.match_subset(required_components)) continue;
+
+        u32_t chunk_count = archetype.get_chunk_count();
+
+        for (u32_t chunk_index = 0; chunk_index < chunk_count; chunk_index ++) {
+          callback(this, archetype, chunk_index, 0, archetype.get_chunk_row_count(chunk_index));
+        }
+      }
+
+      end_iteration();
+    }
+
+    /* Create a System that processes a Streamed Component T a chunk at a time, as in each_streams.
+     * Like other Systems it runs exclusively until its access is declared with set_system_access */
+    template <typename T, typename FN> System::ID create_streams_system (char const* name, bool parallel, ComponentMask required_components, FN fn) {
+      ComponentType::ID type_id = get_streamed_type_id<T>();
+
+      required_components.set(type_id);
+
+      return create_chunk_system(name, parallel, required_components, make_streams_callback<T>(type_id, fn));
+    }
+
+
+    /* Write all Entities and their Components to a binary snapshot.
+     * Components are written as raw instance data, unless their type has serialize/deserialize members.
+     * Components with a destroyer but no serialize/deserialize members own data that cannot be written, and are left out */
+    ENGINE_API void write_snapshot (Array<u8_t>& out) const;
+
+    /* Recreate the Entities and Components from a binary snapshot, in an ECS that has no Entities.
+     * ComponentTypes are matched by name, and must be registered before loading; unmatched Components are skipped.
+     * Entity IDs and generations are preserved, so EntityHandles saved inside Components stay valid.
+     * Returns false, leaving the ECS unchanged, if the data is not a valid snapshot or is truncated */
+    ENGINE_API bool read_snapshot (void const* data, size_t size);
+
+    /* Write a binary snapshot of all Entities and their Components to a file.
+     * Returns true if the file was successfully saved */
+    ENGINE_API bool save_snapshot (char const* path) const;
+
+    /* Load a binary snapshot file by mapping it into memory and reading it in place.
+     * Returns false if the file could not be mapped or is not a valid snapshot */
+    ENGINE_API bool load_snapshot (char const* path);
+
+
+    /* Get the CommandBuffer owned by the calling thread, creating it if necessary.
+     * Structural changes recorded in a CommandBuffer are applied at the next sync point (see flush_commands) */
+    ENGINE_API CommandBuffer& get_command_buffer ();
+
+    /* Apply all structural changes recorded in CommandBuffers.
+     * Entities are created first, then the remaining commands are sorted by Entity so storage is touched in order,
+     * keeping the order they were recorded in for each Entity within a CommandBuffer.
+     * Destroyed Entities are destroyed in one batch at the end, and commands after the destruction of their Entity are dropped,
+     * as are commands targeting Entities that no longer exist. Adding a Component that already exists replaces it.
+     * This is called by update after each System (or group of scheduled Systems), and must not be called while Systems are running */
+    ENGINE_API void flush_commands ();
+
+
     ENGINE_API void update ();
 
 
+    /* Mark the start of an iteration over the Entities of an ECS, during which structural changes are not allowed */
+    void begin_iteration () {
+      iteration_depth.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /* Mark the end of an iteration over the Entities of an ECS */
+    void end_iteration () {
+      iteration_depth.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+
     private:
+      /* Streamed Components have no instances to reference, so typed iteration cannot be used with them */
+      void validate_referenced_types (ComponentType::ID const* type_ids, size_t count) const {
+        for (size_t i = 0; i < count; i ++) {
+          m_assert(
+            component_types[type_ids[i]].storage != ComponentStorage::Streamed,
+            "Cannot iterate Streamed ComponentType %s by reference, use each_streams or create_streams_system",
+            component_types[type_ids[i]].name
+          );
+        }
+      }
+
+      void validate_structural_change (char const* action) const {
+        m_assert(
+          iteration_depth.load(std::memory_order_relaxed) == 0,
+          "Cannot %s while Entities are being iterated by a System or each, as rows would be skipped or visited twice; "
+          "record the change in a CommandBuffer (see get_command_buffer) to apply it at the next sync point",
+          action
+        );
+      }
+
+      // Hook callbacks and the hook batch queue are not thread safe, so hooked writes are kept off System workers
+      void validate_hook_dispatch (ComponentType::ID type_id) const {
+        m_assert(
+          iteration_depth.load(std::memory_order_relaxed) == 0,
+          "Cannot write hooked ComponentType %s while Entities are being iterated by a System or each, as its hooks would run on the iterating threads; "
+          "record the change in a CommandBuffer (see get_command_buffer) to apply it at the next sync point",
+          component_types[type_id].name
+        );
+      }
+
+      ENGINE_API u32_t get_archetype (ComponentMask const& mask);
+
+      ENGINE_API u32_t get_archetype_edge (u32_t archetype_index, ComponentType::ID type_id);
+
+      ENGINE_API void move_entity (u32_t index, u32_t archetype_index);
+
+      ENGINE_API void sync_archetype (u32_t index, ComponentType::ID type_id);
+
+      ENGINE_API void* enable_component (u32_t index, ComponentType::ID type_id);
+
+      ENGINE_API Entity::ID allocate_entity_id (u32_t index);
+
+      ENGINE_API void destroy_entity_components (u32_t index);
+
+      ENGINE_API void remove_entity (u32_t index);
+
+
+      void notify_component_hooks (u32_t index, ComponentType::ID type_id, u8_t event) {
+        if (component_types[type_id].has_hooks(event)) dispatch_component_event(index, type_id, event);
+      }
+
+      ENGINE_API void dispatch_component_event (u32_t index, ComponentType::ID type_id, u8_t event);
+
+      ENGINE_API void dispatch_component_event_range (u32_t first_index, u32_t count, ComponentType::ID type_id, u8_t event);
+
+      ENGINE_API void notify_entity_removal (u32_t const* indices, u32_t count);
+
+      ENGINE_API void invoke_component_hooks (ComponentType::ID type_id, u8_t event, u32_t const* indices, u32_t count);
+
+      ENGINE_API void deliver_hook_events ();
+
+      ENGINE_API void compact_component_hooks ();
+
+
       ENGINE_API System::ID init_system (System::ID index, char const* name, System::CustomCallback callback);
 
-      ENGINE_API System::ID init_system (System::ID index, char const* name, bool parallel, ComponentMask required_components, System::IteratorCallback callback);
+      ENGINE_API System::ID init_system (System::ID index, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback);
+
+
+      ENGINE_API System::ID create_chunk_system (char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback);
+
+      ENGINE_API System::ID create_chunk_system_before (System::ID before_target, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback);
+
+      ENGINE_API System::ID create_chunk_system_before (char const* before_name, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback);
+
+      ENGINE_API System::ID create_chunk_system_after (System::ID after_target, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback);
+
+      ENGINE_API System::ID create_chunk_system_after (char const* after_name, char const* name, bool parallel, ComponentMask required_components, System::ChunkCallback callback);
+
+
+      ENGINE_API System::ID execute_system_group (System::ID first);
+
+
+      template <typename ... Ts> void get_component_access (ComponentMask& reads, ComponentMask& writes) {
+        ((std::is_const_v<Ts>? reads : writes).set(get_component_type_by_instance_type<std::remove_const_t<Ts>>().id), ...);
+      }
+
+
+      void* get_column_base (Archetype const& archetype, u32_t chunk_index, ComponentType::ID type_id) const {
+        ComponentType const& type = component_types[type_id];
+
+        if (type.storage == ComponentStorage::Archetype) return archetype.get_column(chunk_index, type_id);
+        else return type.instances;
+      }
+
+      template <typename T> static T& get_iterated_instance (u8_t* column, ComponentType const& type, u32_t entity_index, u32_t row) {
+        return type.storage == ComponentStorage::Archetype? reinterpret_cast<T*>(column)[row]
+             : type.storage == ComponentStorage::Dense? reinterpret_cast<T*>(column)[entity_index]
+             : *static_cast<T*>(type.get_instance_by_id(entity_index));
+      }
+
+      template <typename ... Ts, typename FN, size_t ... Is> void iterate_chunk (ComponentType::ID const* type_ids, Archetype& archetype, u32_t chunk_index, u32_t row, u32_t row_ext, FN& fn, std::index_sequence<Is...>) {
+        // Dense columns are indexed by Entity, Archetype columns by row within the chunk, and Sparse instances are looked up per Entity
+        u8_t* columns [] = { static_cast<u8_t*>(get_column_base(archetype, chunk_index, type_ids[Is])) ... };
+        ComponentType const* types [] = { component_types + type_ids[Is] ... };
+
+        // Mutable Components are stamped with the write version, per chunk for Archetype columns and per Entity otherwise
+        u64_t version = get_write_version();
+        std::atomic<u64_t>* chunk_versions = archetype.get_chunk_versions(chunk_index);
+        ComponentType const* entity_versioned_types [] = { std::is_const_v<Ts> || types[Is]->storage == ComponentStorage::Archetype? NULL : types[Is] ... };
+
+        ((std::is_const_v<Ts> || types[Is]->storage != ComponentStorage::Archetype? void() : void(chunk_versions[type_ids[Is]].store(version, std::memory_order_relaxed))), ...);
+
+        u32_t* entity_indices = archetype.get_entity_indices(chunk_index);
+
+        for (; row < row_ext; row ++) {
+          u32_t entity_index = entity_indices[row];
+
+          for (ComponentType const* type : entity_versioned_types) if (type != NULL) type->get_version(entity_index) = version;
+
+          fn(entity_index, get_iterated_instance<Ts>(columns[Is], *types[Is], entity_index, row) ...);
+        }
+      }
+
+      template <typename ... Ts, typename FN> System::ChunkCallback make_chunk_callback (FN fn) {
+        static_assert(sizeof...(Ts) > 0, "Typed Systems require at least one Component type");
+
+        struct {
+          ComponentType::ID values [sizeof...(Ts)];
+        } type_ids = { { get_component_type_by_instance_type<std::remove_const_t<Ts>>().id ... } };
+
+        validate_referenced_types(type_ids.values, sizeof...(Ts));
+
+        return [fn, type_ids] (ECS* ecs, Archetype& archetype, u32_t chunk_index, u32_t row, u32_t row_ext) mutable {
+          ecs->iterate_chunk<Ts...>(type_ids.values, archetype, chunk_index, row, row_ext, fn, std::index_sequence_for<Ts...> { });
+        };
+      }
+
+      template <typename T> ComponentType::ID get_streamed_type_id () const {
+        ComponentType const& type = get_component_type_by_instance_type<T>();
+
+        m_assert(type.storage == ComponentStorage::Streamed, "Cannot get ComponentStreams for ComponentType %s, it uses %s storage", type.name, ComponentStorage::name(type.storage));
+
+        return type.id;
+      }
+
+      template <typename T, typename FN> System::ChunkCallback make_streams_callback (ComponentType::ID type_id, FN fn) {
+        return [fn, type_id] (ECS* ecs, Archetype& archetype, u32_t chunk_index, u32_t row, u32_t row_ext) mutable {
+          // Streams handed out for writing count as a change to the whole chunk
+          archetype.get_chunk_versions(chunk_index)[type_id].store(ecs->get_write_version(), std::memory_order_relaxed);
+
+          fn(archetype.get_streams<T>(type_id, chunk_index), static_cast<u32_t const*>(archetype.get_entity_indices(chunk_index)), row, row_ext);
+        };
+      }
 
       void validate_system_count () const {
         m_assert(
@@ -656,6 +2072,57 @@ namespace mod {
         }
       }
   };
+
+
+  template <typename ... Ts> Query& Query::changed (ECS* ecs) {
+    changed_components |= ecs->get_component_mask<Ts...>();
+    return *this;
+  }
+
+  template <typename FN> void Query::each (ECS* ecs, FN fn) {
+    update(ecs);
+
+    u64_t since_version = last_version;
+    bool filtered = changed_components.any_bits();
+
+    last_version = ecs->change_version.fetch_add(1, std::memory_order_relaxed) + 1;
+
+    ecs->begin_iteration();
+
+    for (auto [ i, archetype_index ] : archetype_indices) {
+      Archetype& archetype = ecs->archetypes[archetype_index];
+
+      u32_t chunk_count = archetype.get_chunk_count();
+
+      for (u32_t chunk_index = 0; chunk_index < chunk_count; chunk_index ++) {
+        u32_t* entity_indices = archetype.get_entity_indices(chunk_index);
+        u32_t row_count = archetype.get_chunk_row_count(chunk_index);
+
+        if (filtered) {
+          ecs->each_changed_run(changed_components, since_version, archetype, chunk_index, 0, row_count, [&] (u32_t row, u32_t row_ext) {
+            for (; row < row_ext; row ++) fn(entity_indices[row]);
+          });
+        } else {
+          for (u32_t row = 0; row < row_count; row ++) fn(entity_indices[row]);
+        }
+      }
+    }
+
+    ecs->end_iteration();
+  }
+
+
+  template <typename T, typename E> void CommandBuffer::add_component (E const& entity, T const& data) {
+    add_component_by_id(entity, ecs->get_component_type_by_instance_type<T>().id, &data);
+  }
+
+  template <typename T, typename E, typename ... A> void CommandBuffer::create_component (E const& entity, A ... args) {
+    new (record(CommandType::AddComponent, ecs->get_component_type_by_instance_type<T>().id, get_target(entity), sizeof(T))) T { args... };
+  }
+
+  template <typename T, typename E> void CommandBuffer::destroy_component (E const& entity) {
+    destroy_component_by_id(entity, ecs->get_component_type_by_instance_type<T>().id);
+  }
 }
 
 #endif
\ No newline at end of file
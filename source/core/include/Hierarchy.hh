@@ -9,6 +9,22 @@
 namespace mod {
   struct Parent;
 
+
+  /* Named streams of a chunk of Streamed Transform3D Components */
+  struct Transform3DStreams {
+    f32_t* position [3];
+    f32_t* rotation [4];
+    f32_t* scale [3];
+
+
+    Transform3DStreams (ComponentStreams<Transform3D> const& streams) {
+      for (size_t i = 0; i < 3; i ++) position[i] = streams.get_stream(offsetof(Transform3D, position) + i * sizeof(f32_t));
+      for (size_t i = 0; i < 4; i ++) rotation[i] = streams.get_stream(offsetof(Transform3D, rotation) + i * sizeof(f32_t));
+      for (size_t i = 0; i < 3; i ++) scale[i] = streams.get_stream(offsetof(Transform3D, scale) + i * sizeof(f32_t));
+    }
+  };
+
+
   struct Child {
     EntityHandle own_entity;
     EntityHandle parent_handle;
@@ -19,9 +35,15 @@ namespace mod {
 
     ENGINE_API void destroy ();
 
+    ENGINE_API void serialize (Array<u8_t>& out) const;
+
+    ENGINE_API void deserialize (ECS* ecs, void const* data, size_t size);
+
 
     ENGINE_API Parent& get_parent_references ();
 
+    /* Walk up the parent chain to compute the matrix this Child's own transform is relative to.
+     * This is recomputed on every call, prefer the WorldTransform maintained by update_world_transforms */
     ENGINE_API Matrix4 compute_hierarchical_matrix ();
 
 
@@ -46,11 +68,33 @@ namespace mod {
 
     ENGINE_API void destroy ();
 
+    ENGINE_API void serialize (Array<u8_t>& out) const;
+
+    ENGINE_API void deserialize (ECS* ecs, void const* data, size_t size);
+
 
     ENGINE_API void add_child (EntityHandle c, s32_t slot_index = -1);
 
     ENGINE_API void remove_child (EntityHandle c);
   };
+
+
+  /* The world space matrix of an Entity, including the transforms of its parents and any skeleton slot it is attached to */
+  struct WorldTransform {
+    Matrix4 matrix;
+
+    // The change version matrix was computed at, 0 if it never has been
+    u64_t version;
+  };
+
+
+  /* Recompute the WorldTransforms of every Entity with a Transform3D, Child or Parent, adding WorldTransforms where they are missing.
+   * Hierarchies are walked breadth first from their roots, so each matrix is composed once from its parent's cached one,
+   * and an Entity is only recomputed when its Transform3D or Child, its parent's WorldTransform,
+   * or the SkeletonState its slot is attached to changed since its WorldTransform was last computed.
+   * This is meant to be a custom System, created after Systems which move Entities and before the ones that read WorldTransforms:
+   * `ecs.create_system("World Transform", update_world_transforms);` */
+  ENGINE_API void update_world_transforms (ECS* ecs);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include "cstd.hh"
+#include "ThreadPool.hh"
+
+
+
+namespace mod {
+  /* The engine wide ThreadPool, which every ECS and engine subsystem submits work to so they do not oversubscribe the processor */
+  struct JobSystem_t {
+    std::atomic<ThreadPool*> pool;
+    bool pinned;
+
+    // Jobs which must run on the main thread, such as GPU uploads, run by the Application at the start of each frame.
+    // Queued Jobs are swapped into main_thread_running to be run, so Jobs may queue more for the next frame
+    Array<Job> main_thread_jobs;
+    Array<Job> main_thread_running;
+    std::atomic<bool> main_thread_locked;
+
+
+    /* Start the JobSystem with the given number of worker threads, or one per logical processor besides the calling thread if 0.
+     * If pin_threads is set, each worker is restricted to its own logical processor, leaving the first to the calling thread.
+     * Up to reserved_count workers are kept free for frame work by never running Background Jobs, leaving at least one that does.
+     * Calling this while the JobSystem is already running does nothing, and asserts unless the default settings are given */
+    ENGINE_API JobSystem_t& init (u32_t thread_count = 0, bool pin_threads = false, u32_t reserved_count = 0);
+
+    /* Wait for all outstanding Jobs and stop the worker threads of the JobSystem.
+     * Jobs queued for the main thread which have not run are discarded */
+    ENGINE_API void destroy ();
+
+
+    /* Queue a Job to run on the main thread the next time run_main_thread_jobs is called. May be called from any thread */
+    ENGINE_API void queue_main_thread (Job::Callback callback, void* argument);
+
+    /* Run all Jobs queued for the main thread, and get the number run */
+    ENGINE_API size_t run_main_thread_jobs ();
+
+
+    bool is_initialized () const {
+      return pool.load(std::memory_order_acquire) != NULL;
+    }
+
+    /* Get the shared ThreadPool, starting the JobSystem with default settings if it has not been */
+    ThreadPool& get_pool () {
+      ThreadPool* existing = pool.load(std::memory_order_acquire);
+
+      if (existing != NULL) return *existing;
+
+      init();
+
+      return *pool.load(std::memory_order_acquire);
+    }
+  };
+
+  ENGINE_API extern JobSystem_t JobSystem;
+}
+
+#endif
\ No newline at end of file
@@ -0,0 +1,30 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include "cstd.hh"
+#include "Exception.hh"
+
+namespace mod {
+  struct MappedFile {
+    char* origin = NULL;
+
+    void const* data = NULL;
+    size_t size = 0;
+
+    void* platform_file = NULL;
+    void* platform_mapping = NULL;
+
+    /* Create a zero-initialized MappedFile with no mapped data */
+    MappedFile () = default;
+
+
+    /* Create a MappedFile by mapping a file into memory for reading.
+     * If the file could not be opened or mapped, data will be NULL */
+    ENGINE_API MappedFile (char const* path);
+
+    /* Unmap a MappedFile's data and close its file */
+    ENGINE_API void destroy ();
+  };
+}
+
+#endif
\ No newline at end of file
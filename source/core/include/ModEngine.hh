@@ -11,7 +11,10 @@
 #include "Array.hh"
 #include "Bitmask.hh"
 #include "SharedLib.hh"
+#include "MappedFile.hh"
 #include "ThreadPool.hh"
+#include "JobSystem.hh"
+#include "Task.hh"
 #include "JSON.hh"
 #include "XML.hh"
 #include "ECS.hh"
@@ -0,0 +1,345 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "cstd.hh"
+#include "util.hh"
+#include "JobSystem.hh"
+
+#include <coroutine>
+#include <exception>
+
+
+
+namespace mod {
+  /* The Job callback used to resume a coroutine, given its address */
+  static void resume_coroutine (void* address) {
+    std::coroutine_handle<>::from_address(address).resume();
+  }
+
+
+  template <typename T> struct Task;
+
+  /* State shared by the promises of all Tasks, regardless of their result type */
+  struct TaskPromiseBase {
+    // The coroutine which awaited the Task, resumed on the same thread once it returns
+    std::coroutine_handle<> continuation = { };
+
+    // 1 until the Task returns, so threads can block on it with ThreadPool::await_counter
+    std::atomic<u32_t> pending_count = 1;
+
+    // Set by whichever of the Task returning and the Task being detached happens first, the other destroys the coroutine frame
+    std::atomic<bool> released = false;
+
+    bool started = false;
+
+    std::exception_ptr exception;
+
+
+    struct FinalAwaiter {
+      bool await_ready () noexcept { return false; }
+
+      template <typename P> std::coroutine_handle<> await_suspend (std::coroutine_handle<P> handle) noexcept {
+        TaskPromiseBase& promise = handle.promise();
+
+        if (promise.continuation) return promise.continuation;
+
+        if (promise.released.exchange(true, std::memory_order_acq_rel)) {
+          handle.destroy();
+        } else {
+          // The frame may be destroyed by a blocked thread as soon as this is seen, so nothing may touch it afterwards
+          promise.pending_count.store(0, std::memory_order_release);
+        }
+
+        return std::noop_coroutine();
+      }
+
+      void await_resume () noexcept { }
+    };
+
+
+    /* Tasks do not run until they are started or awaited */
+    std::suspend_always initial_suspend () noexcept { return { }; }
+
+    FinalAwaiter final_suspend () noexcept { return { }; }
+
+    void unhandled_exception () noexcept {
+      exception = std::current_exception();
+    }
+
+
+    /* Coroutine frames are allocated through the engine allocator so they show up in memory tracking */
+    static void* operator new (size_t size) {
+      return memory::allocate<u8_t>(size);
+    }
+
+    static void operator delete (void* frame) {
+      u8_t* bytes = static_cast<u8_t*>(frame);
+      memory::deallocate(bytes);
+    }
+  };
+
+  template <typename T> struct TaskPromise : TaskPromiseBase {
+    union { T value; };
+    bool has_value = false;
+
+    TaskPromise () { }
+
+    ~TaskPromise () {
+      if (has_value) value.~T();
+    }
+
+    Task<T> get_return_object () noexcept;
+
+    template <typename U> void return_value (U&& result) {
+      new (&value) T { std::forward<U>(result) };
+      has_value = true;
+    }
+
+    T take_result () {
+      return std::move(value);
+    }
+  };
+
+  template <> struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object () noexcept;
+
+    void return_void () noexcept { }
+
+    void take_result () { }
+  };
+
+
+  /* A coroutine running asynchronously on the workers of a ThreadPool, which returns a T.
+   * A Task is suspended when it is created, and runs on the calling thread once it is started or awaited,
+   * until it awaits schedule(), a JobHandle or main_thread() to continue elsewhere.
+   * Like other engine types a Task is not destroyed automatically; it must be awaited, detached, or destroyed */
+  template <typename T = void> struct Task {
+    using promise_type = TaskPromise<T>;
+
+    std::coroutine_handle<promise_type> handle;
+
+
+    /* Create a new empty Task */
+    Task () : handle() { }
+
+    /* Create a new Task owning the given coroutine */
+    Task (std::coroutine_handle<promise_type> in_handle) : handle(in_handle) { }
+
+    /* Destroy the coroutine frame of a Task, which must not be running */
+    void destroy () {
+      if (handle) handle.destroy();
+
+      handle = { };
+    }
+
+
+    /* Determine if a Task refers to a coroutine */
+    bool is_valid () const {
+      return static_cast<bool>(handle);
+    }
+
+    /* Determine if a started Task has returned */
+    bool is_complete () const {
+      return handle.promise().pending_count.load(std::memory_order_acquire) == 0;
+    }
+
+
+    /* Run a Task on the calling thread until it first suspends */
+    void start () {
+      m_assert(is_valid(), "Cannot start an empty Task");
+      m_assert(!handle.promise().started, "Cannot start a Task more than once");
+
+      handle.promise().started = true;
+      handle.resume();
+    }
+
+    /* Start a Task if it has not been, and give up ownership of it, so its coroutine frame is destroyed when it returns.
+     * The result of the Task is discarded, including any exception thrown */
+    void detach () {
+      m_assert(is_valid(), "Cannot detach an empty Task");
+
+      if (!handle.promise().started) start();
+
+      if (handle.promise().released.exchange(true, std::memory_order_acq_rel)) handle.destroy();
+
+      handle = { };
+    }
+
+    /* Start a Task if it has not been, block the calling thread until it returns, and destroy it, getting its result.
+     * An exception thrown by the Task is rethrown here.
+     * Workers of the ThreadPool run other Jobs while they wait; the main thread must not wait on a Task awaiting main_thread() */
+    T await (ThreadPool& pool = JobSystem.get_pool()) {
+      m_assert(is_valid(), "Cannot await an empty Task");
+
+      if (!handle.promise().started) start();
+
+      pool.await_counter(handle.promise().pending_count);
+
+      return take_result();
+    }
+
+
+    struct Awaiter {
+      Task* task;
+
+      bool await_ready () noexcept { return false; }
+
+      std::coroutine_handle<> await_suspend (std::coroutine_handle<> awaiting) noexcept {
+        promise_type& promise = task->handle.promise();
+
+        promise.continuation = awaiting;
+        promise.started = true;
+
+        return task->handle;
+      }
+
+      T await_resume () {
+        return task->take_result();
+      }
+    };
+
+    /* Awaiting a Task from another coroutine runs it, resumes the awaiting coroutine once it returns, and destroys it.
+     * The Task must not have been started */
+    Awaiter operator co_await () {
+      m_assert(is_valid(), "Cannot await an empty Task");
+      m_assert(!handle.promise().started, "Cannot await a Task which has already been started");
+
+      return { this };
+    }
+
+
+  private:
+    /* Get the result of a returned Task and destroy it, rethrowing any exception it threw */
+    T take_result () {
+      std::exception_ptr exception = handle.promise().exception;
+
+      if (exception) {
+        destroy();
+        std::rethrow_exception(exception);
+      }
+
+      if constexpr (std::is_void_v<T>) {
+        destroy();
+      } else {
+        T result = handle.promise().take_result();
+
+        destroy();
+
+        return result;
+      }
+    }
+  };
+
+
+  template <typename T> Task<T> TaskPromise<T>::get_return_object () noexcept {
+    return { std::coroutine_handle<TaskPromise<T>>::from_promise(*this) };
+  }
+
+  inline Task<void> TaskPromise<void>::get_return_object () noexcept {
+    return { std::coroutine_handle<TaskPromise<void>>::from_promise(*this) };
+  }
+
+
+
+  /* Awaitable which resumes a coroutine as a Job of a ThreadPool */
+  struct ScheduleAwaiter {
+    ThreadPool* pool;
+    u8_t priority;
+
+    bool await_ready () noexcept { return false; }
+
+    void await_suspend (std::coroutine_handle<> awaiting) {
+      pool->queue(resume_coroutine, awaiting.address(), priority);
+    }
+
+    void await_resume () noexcept { }
+  };
+
+  /* Continue a coroutine as a Job of the given priority on the given ThreadPool */
+  static ScheduleAwaiter schedule (ThreadPool& pool, u8_t priority = JobPriority::Normal) {
+    return { &pool, priority };
+  }
+
+  /* Continue a coroutine as a Job of the given priority on the JobSystem */
+  static ScheduleAwaiter schedule (u8_t priority = JobPriority::Normal) {
+    return { &JobSystem.get_pool(), priority };
+  }
+
+
+  /* Awaitable which resumes a coroutine as a continuation Job once a submitted Job has completed */
+  struct JobHandleAwaiter {
+    JobHandle handle;
+
+    bool await_ready () noexcept {
+      return handle.node == NULL || handle.node->pool->is_complete(handle);
+    }
+
+    void await_suspend (std::coroutine_handle<> awaiting) {
+      ThreadPool* pool = handle.node->pool;
+
+      pool->submit(resume_coroutine, awaiting.address(), &handle, 1, pool->get_current_priority());
+    }
+
+    void await_resume () noexcept { }
+  };
+
+  /* Awaiting a JobHandle suspends a coroutine until the Job has completed, without blocking the thread */
+  static JobHandleAwaiter operator co_await (JobHandle const& handle) {
+    return { handle };
+  }
+
+
+  /* Awaitable which resumes a coroutine on the main thread */
+  struct MainThreadAwaiter {
+    bool await_ready () noexcept { return false; }
+
+    void await_suspend (std::coroutine_handle<> awaiting) {
+      JobSystem.queue_main_thread(resume_coroutine, awaiting.address());
+    }
+
+    void await_resume () noexcept { }
+  };
+
+  /* Continue a coroutine on the main thread at the start of the next frame, for work such as GPU uploads */
+  static MainThreadAwaiter main_thread () {
+    return { };
+  }
+
+
+  /* Awaitable which loads a file on a Background Job, and continues the awaiting coroutine on the same worker */
+  struct ReadFileAwaiter {
+    ThreadPool* pool;
+    char const* path;
+    pair_t<void*, size_t> result;
+    std::coroutine_handle<> awaiting;
+
+    static void read (void* argument) {
+      ReadFileAwaiter* awaiter = static_cast<ReadFileAwaiter*>(argument);
+
+      awaiter->result = load_file(awaiter->path);
+
+      // The awaiter lives in the coroutine frame, which may be gone once this returns
+      awaiter->awaiting.resume();
+    }
+
+    bool await_ready () noexcept { return false; }
+
+    void await_suspend (std::coroutine_handle<> in_awaiting) {
+      awaiting = in_awaiting;
+
+      pool->queue(read, this, JobPriority::Background);
+    }
+
+    pair_t<void*, size_t> await_resume () noexcept {
+      return result;
+    }
+  };
+
+  /* Read a file without blocking the calling thread, giving the result of load_file (NULL data if it could not be read).
+   * The coroutine continues as a Background Job, so decoding the file afterwards stays off reserved workers */
+  static ReadFileAwaiter read_file (char const* path, ThreadPool& pool = JobSystem.get_pool()) {
+    return { &pool, path, { NULL, 0 }, { } };
+  }
+}
+
+#endif
\ No newline at end of file
@@ -5,6 +5,38 @@
 #include "Array.hh"
 
 namespace mod {
+  namespace JobPriority {
+    enum: u8_t {
+      // Work the current frame waits on, such as parallel ECS Systems
+      High,
+      Normal,
+      // Work nothing is waiting on this frame, such as scanning watched asset files, which never runs on reserved workers
+      Background,
+
+      total_priority_count,
+
+      Invalid = -1
+    };
+
+    static constexpr char const* names [total_priority_count] = {
+      "High",
+      "Normal",
+      "Background"
+    };
+
+    /* Get the name of a JobPriority as a str */
+    static constexpr char const* name (u8_t priority) {
+      if (priority < total_priority_count) return names[priority];
+      else return "Invalid";
+    }
+
+    /* Determine if a value is a valid JobPriority */
+    static constexpr bool validate (u8_t priority) {
+      return priority < total_priority_count;
+    }
+  }
+
+
   struct Job {
     using Callback = void (*) (void*);
 
@@ -12,12 +44,242 @@ namespace mod {
     void* argument;
   };
 
+
+  /* A fixed capacity Chase-Lev deque of Jobs.
+   * Its owning thread pushes and pops at the bottom without locking, while any other thread may steal from the top */
+  struct JobDeque {
+    #ifndef CUSTOM_THREAD_POOL_DEQUE_CAPACITY
+      static constexpr u32_t capacity = 1024;
+    #else
+      static constexpr u32_t capacity = CUSTOM_THREAD_POOL_DEQUE_CAPACITY;
+    #endif
+
+    static_assert((capacity & (capacity - 1)) == 0, "JobDeque capacity must be a power of two");
+
+
+    struct Slot {
+      std::atomic<Job::Callback> callback;
+      std::atomic<void*> argument;
+    };
+
+
+    // Kept on separate cache lines, as thieves write top while the owner writes bottom
+    alignas(64) std::atomic<s64_t> top;
+    alignas(64) std::atomic<s64_t> bottom;
+    alignas(64) Slot slots [capacity];
+
+
+    JobDeque ()
+    : top(0)
+    , bottom(0)
+    { }
+
+
+    /* Push a Job onto the bottom of a JobDeque, from its owning thread only. Returns false if the JobDeque is full */
+    ENGINE_API bool push (Job const& job);
+
+    /* Pop the newest Job from the bottom of a JobDeque, from its owning thread only. Returns false if it is empty */
+    ENGINE_API bool pop (Job& job);
+
+    /* Steal the oldest Job from the top of a JobDeque, from any thread.
+     * Returns false if it is empty or the Job was taken by another thread first */
+    ENGINE_API bool steal (Job& job);
+
+    /* Get the number of Jobs in a JobDeque. This is only a snapshot when called from a thread other than the owner */
+    u32_t get_size () const {
+      s64_t size = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+
+      return size > 0? static_cast<u32_t>(size) : 0;
+    }
+  };
+
+
+  /* A snapshot of the counters recorded by the threads of a ThreadPool. Times are in performance counter ticks */
+  struct ThreadPoolStats {
+    // Time spent running Jobs, including Jobs run while awaiting or yielding from within another Job
+    u64_t busy_ticks;
+
+    // Time spent polling for Jobs or parked
+    u64_t idle_ticks;
+
+    // Time spent waiting to acquire a mutex of the ThreadPool
+    u64_t lock_wait_ticks;
+
+    u64_t job_count;
+    u64_t steal_count;
+
+    // The most Jobs waiting in one of the deques or the injection queue at once
+    u32_t max_queue_depth;
+  };
+
+  /* The counters behind ThreadPoolStats, which threads add to as they run */
+  struct ThreadPoolCounters {
+    std::atomic<u64_t> busy_ticks;
+    std::atomic<u64_t> idle_ticks;
+    std::atomic<u64_t> lock_wait_ticks;
+    std::atomic<u64_t> job_count;
+    std::atomic<u64_t> steal_count;
+    std::atomic<u32_t> max_queue_depth;
+
+
+    /* Get a snapshot of the values of a ThreadPoolCounters */
+    ThreadPoolStats get_stats () const {
+      return {
+        busy_ticks.load(std::memory_order_relaxed),
+        idle_ticks.load(std::memory_order_relaxed),
+        lock_wait_ticks.load(std::memory_order_relaxed),
+        job_count.load(std::memory_order_relaxed),
+        steal_count.load(std::memory_order_relaxed),
+        max_queue_depth.load(std::memory_order_relaxed)
+      };
+    }
+
+    /* Set all the values of a ThreadPoolCounters to zero */
+    void reset () {
+      busy_ticks.store(0, std::memory_order_relaxed);
+      idle_ticks.store(0, std::memory_order_relaxed);
+      lock_wait_ticks.store(0, std::memory_order_relaxed);
+      job_count.store(0, std::memory_order_relaxed);
+      steal_count.store(0, std::memory_order_relaxed);
+      max_queue_depth.store(0, std::memory_order_relaxed);
+    }
+
+    /* Raise the max_queue_depth of a ThreadPoolCounters to the given depth, if it is higher */
+    void record_queue_depth (u32_t depth) {
+      u32_t max_depth = max_queue_depth.load(std::memory_order_relaxed);
+
+      while (depth > max_depth && !max_queue_depth.compare_exchange_weak(max_depth, depth, std::memory_order_relaxed));
+    }
+  };
+
+
+  /* A Job recorded by a ThreadPool trace, with times in performance counter ticks */
+  struct ThreadPoolTraceEvent {
+    Job::Callback callback;
+    void* argument;
+    u64_t start;
+    u64_t end;
+    u8_t priority;
+  };
+
+
+  struct ThreadPool;
+
+
+  /* A Job submitted with dependencies, which is queued once they have all completed */
+  struct JobNode {
+    ThreadPool* pool;
+    Job job;
+    u8_t priority;
+
+    // Incremented when the Job completes, which completes every JobHandle taken before then, so the JobNode can be reused
+    std::atomic<u32_t> generation;
+
+    // Dependencies which have not yet completed, plus one held while the Job is being submitted
+    std::atomic<u32_t> pending_count;
+
+    // Guards dependents against the Job completing while a dependent is being added
+    std::atomic<bool> locked;
+    Array<JobNode*> dependents;
+
+    JobNode* next_free;
+  };
+
+  /* Refers to a Job submitted to a ThreadPool; a zeroed JobHandle is always complete */
+  struct JobHandle {
+    JobNode* node;
+    u32_t generation;
+  };
+
+
+  struct ThreadPoolWorker {
+    ThreadPool* pool;
+    u32_t index;
+
+    // Rotates the first victim tried when stealing, so idle workers spread out across the others
+    u32_t steal_cursor;
+
+    // The JobPriority of the Job being run, or Invalid while idle
+    u8_t running_priority;
+
+    ThreadPoolCounters counters;
+
+    // A ring buffer of the last trace_capacity Jobs run while tracing, where trace_count is the total number recorded
+    ThreadPoolTraceEvent* trace_events;
+    std::atomic<u64_t> trace_count;
+
+    JobDeque deques [JobPriority::total_priority_count];
+  };
+
+
   struct ThreadPool {
+    // Maximum number of polls made by an idle thread before it parks; each thread adapts its own count below this,
+    // spinning longer while polling keeps finding work and less while it does not
+    #ifndef CUSTOM_THREAD_POOL_SPIN_LIMIT
+      static constexpr u32_t spin_limit = 4096;
+    #else
+      static constexpr u32_t spin_limit = CUSTOM_THREAD_POOL_SPIN_LIMIT;
+    #endif
+
+    static constexpr size_t node_block_size = 64;
+
+    #ifndef CUSTOM_THREAD_POOL_DEFAULT_TRACE_CAPACITY
+      static constexpr u32_t default_trace_capacity = 4096;
+    #else
+      static constexpr u32_t default_trace_capacity = CUSTOM_THREAD_POOL_DEFAULT_TRACE_CAPACITY;
+    #endif
+
+
     Array<thrd_t> threads;
-    Array<Job> jobs;
+
+    // Jobs queued by a worker go to the bottom of its own deque for their JobPriority, where other workers steal them from when idle.
+    // Workers always take the highest priority Job available to them
+    ThreadPoolWorker* workers;
+    u32_t worker_count;
+
+    // Workers with an index below this never take Background Jobs, so they are always free for frame work
+    std::atomic<u32_t> reserved_count;
+
+    // Jobs queued by threads outside the ThreadPool, or by a worker whose deque is full, are injected here and taken in order
+    Array<Job> injected_jobs [JobPriority::total_priority_count];
+    size_t injected_heads [JobPriority::total_priority_count];
+    std::atomic<u32_t> injected_counts [JobPriority::total_priority_count];
     mtx_t queue_mtx;
     bool shutdown;
 
+    // Idle threads park on work_cnd under queue_mtx, which is signalled when a Job is queued while any are parked
+    cnd_t work_cnd;
+    std::atomic<u32_t> parked_count;
+
+    // Jobs of each JobPriority queued but not yet taken by a worker, across the injection queue and all deques
+    std::atomic<u32_t> available_counts [JobPriority::total_priority_count];
+
+    // Jobs queued and completed over the lifetime of the ThreadPool; their difference is the number of unfinished Jobs
+    std::atomic<u64_t> queued_count;
+    std::atomic<u64_t> completed_count;
+
+    // JobNodes are allocated in blocks which are kept until the ThreadPool is destroyed, and recycled through a free list
+    Array<JobNode*> node_blocks;
+    JobNode* free_nodes;
+    mtx_t node_mtx;
+
+    // Awaiting threads park on await_cnd, which is broadcast when a Job completes while any are parked
+    mtx_t await_mtx;
+    cnd_t await_cnd;
+    std::atomic<u32_t> awaiting_count;
+
+    // Counters recorded by threads outside the ThreadPool while they queue Jobs, which are shared between all of them
+    ThreadPoolCounters external_counters;
+
+    // Per-worker ring buffers of trace_capacity events each are allocated when a trace is started, and kept until the ThreadPool is destroyed
+    std::atomic<bool> tracing;
+    u32_t trace_capacity;
+    u64_t trace_origin;
+    Array<pair_t<Job::Callback, char const*>> trace_names;
+
+    // Workers recording a trace event; once tracing is cleared and this reaches zero the ring buffers are no longer touched
+    std::atomic<u32_t> trace_writers;
+
 
     /* Create a new uninitialized ThreadPool */
     ThreadPool () { }
@@ -29,20 +291,251 @@ namespace mod {
     ENGINE_API void destroy ();
 
 
-    /* Queue a Job in a ThreadPool and return its index in the Job queue */
-    ENGINE_API size_t queue (Job::Callback callback, void* argument);
+    /* Restrict each worker thread of a ThreadPool to a single logical processor, assigned in order starting from the given one.
+     * Returns false if the platform does not support this or any thread could not be pinned */
+    ENGINE_API bool pin_threads (u32_t first_processor = 0);
+
+    /* Reserve the given number of workers of a ThreadPool for High and Normal priority Jobs; at least one worker must remain unreserved */
+    ENGINE_API void reserve_workers (u32_t count);
+
+
+    /* Get a snapshot of the counters of a worker of a ThreadPool */
+    ThreadPoolStats get_worker_stats (u32_t index) const {
+      m_assert(index < worker_count, "Cannot get stats of ThreadPool worker %" PRIu32 ", there are only %" PRIu32, index, worker_count);
+
+      return workers[index].counters.get_stats();
+    }
+
+    /* Get a snapshot of the counters shared by all threads outside a ThreadPool */
+    ThreadPoolStats get_external_stats () const {
+      return external_counters.get_stats();
+    }
+
+    /* Set the counters of all workers of a ThreadPool, and those of external threads, to zero */
+    ENGINE_API void reset_stats ();
+
+
+    /* Start recording the last capacity Jobs run by each worker of a ThreadPool, discarding any previous trace.
+     * Jobs may be running; those already in flight are recorded when they finish */
+    ENGINE_API void start_trace (u32_t capacity = default_trace_capacity);
+
+    /* Stop recording Jobs in a ThreadPool trace, keeping those already recorded for export */
+    ENGINE_API void stop_trace ();
+
+    /* Set the name used for Jobs with the given callback in exported traces; otherwise they are named by their callback's address */
+    ENGINE_API void set_trace_name (Job::Callback callback, char const* name);
+
+    /* Write the Jobs recorded by a ThreadPool trace to a file in the Chrome trace event format, viewable in chrome://tracing or Perfetto.
+     * The trace is stopped first, so Jobs may be running. Returns false if the file could not be written */
+    ENGINE_API bool export_trace (char const* path);
+
+    /* Display the counters of a ThreadPool and controls for tracing in an ImGui window */
+    ENGINE_API void show_stats (char const* title = "Job System", bool* open = NULL);
+
+
+    /* Queue a Job in a ThreadPool.
+     * From a worker thread of the ThreadPool this does not lock, unless a parked worker must be woken */
+    ENGINE_API void queue (Job::Callback callback, void* argument, u8_t priority = JobPriority::Normal);
+
+    /* Submit a Job to a ThreadPool which is queued once all of the given dependencies have completed, and get a JobHandle to it.
+     * Handles to completed Jobs may be passed, so whole pipelines can be submitted at once,
+     * and a Job submitted with a dependency from within that dependency's callback is its continuation */
+    ENGINE_API JobHandle submit (Job::Callback callback, void* argument, JobHandle const* dependencies = NULL, size_t dependency_count = 0, u8_t priority = JobPriority::Normal);
+
+    /* Submit a Job to a ThreadPool which is queued once all of the given dependencies have completed, and get a JobHandle to it */
+    JobHandle submit (Job::Callback callback, void* argument, std::initializer_list<JobHandle> dependencies, u8_t priority = JobPriority::Normal) {
+      return submit(callback, argument, dependencies.begin(), dependencies.size(), priority);
+    }
+
+    /* Determine if the Job referred to by a JobHandle has completed */
+    bool is_complete (JobHandle const& handle) const {
+      return handle.node == NULL || handle.node->generation.load(std::memory_order_acquire) != handle.generation;
+    }
+
+
+    /* Get the number of Jobs in a ThreadPool that have been queued but have not yet completed */
+    size_t get_unfinished_count () const {
+      return queued_count.load(std::memory_order_acquire) - completed_count.load(std::memory_order_acquire);
+    }
+
+    /* Get the worker of a ThreadPool running on the calling thread, or NULL if it is not one of its threads */
+    ENGINE_API ThreadPoolWorker* get_current_worker () const;
+
+    /* Get the JobPriority of the Job running on the calling thread, or Normal if it is not a worker of the ThreadPool */
+    ENGINE_API u8_t get_current_priority () const;
+
+
+    /* Determine if Jobs of a higher priority than the one running on the calling thread are waiting */
+    ENGINE_API bool should_yield () const;
+
+    /* From within a Job, run any waiting Jobs of a higher priority before returning.
+     * Long running Jobs call this between chunks of work so they do not hold up more urgent ones,
+     * and must not hold any locks the Jobs it runs may need */
+    ENGINE_API void yield ();
     
 
-    /* Wait for a single Job in a ThreadPool to complete, by blocking until the number of remaining Jobs is less than or equal to the given index */
-    ENGINE_API void await (size_t index);
+    /* Wait for the Job referred to by a JobHandle to complete */
+    ENGINE_API void await (JobHandle const& handle);
 
-    /* Wait for all Jobs in a ThreadPool to complete, by blocking until the number of remaining Jobs is equal to zero */
+    /* Wait for all Jobs in a ThreadPool to complete, by blocking until the number of unfinished Jobs is equal to zero */
     ENGINE_API void await_all ();
 
+    /* Wait for a counter decremented by Jobs of a ThreadPool to reach zero.
+     * The counter is rechecked each time a Job completes, so it must be decremented from within a Job */
+    ENGINE_API void await_counter (std::atomic<u32_t> const& counter);
+
+
+    /* Call fn(base, ext) for consecutive ranges covering [begin, end), each at most grain long,
+     * on the workers of a ThreadPool and the calling thread, and wait for all of them to return.
+     * Jobs are queued at the priority of the calling Job, and Background loops yield between ranges */
+    template <typename F> void parallel_for_ranges (size_t begin, size_t end, size_t grain, F const& fn) {
+      if (end <= begin) return;
+
+      grain = num::max(grain, static_cast<size_t>(1));
+
+      size_t range_count = (end - begin + grain - 1) / grain;
+      u32_t job_count = static_cast<u32_t>(num::min(static_cast<size_t>(worker_count), range_count - 1));
+
+      if (job_count == 0) {
+        fn(begin, end);
+        return;
+      }
+
+      u8_t priority = get_current_priority();
+
+      ParallelRange<F> range { this, &fn, begin, end, grain, job_count, priority == JobPriority::Background };
+
+      for (u32_t i = 0; i < job_count; i ++) queue(reinterpret_cast<Job::Callback>(ParallelRange<F>::execution_instance), &range, priority);
+
+      range.claim();
+
+      await_counter(range.pending_count);
+    }
+
+    /* Call fn(i) for each index in [begin, end), in ranges of at most grain indices,
+     * on the workers of a ThreadPool and the calling thread, and wait for all of them to return */
+    template <typename F> void parallel_for (size_t begin, size_t end, size_t grain, F const& fn) {
+      parallel_for_ranges(begin, end, grain, [&fn] (size_t base, size_t ext) {
+        for (size_t i = base; i < ext; i ++) fn(i);
+      });
+    }
+
+    /* Compute fn(base, ext) for consecutive ranges covering [begin, end), each at most grain long, in parallel as parallel_for_ranges,
+     * and combine the results with reduce(accumulator, value), starting from identity.
+     * Results are combined in range order after all ranges complete, so the result does not depend on scheduling */
+    template <typename T, typename F, typename R> T parallel_reduce (size_t begin, size_t end, size_t grain, T const& identity, F const& fn, R const& reduce) {
+      if (end <= begin) return identity;
+
+      grain = num::max(grain, static_cast<size_t>(1));
+
+      size_t range_count = (end - begin + grain - 1) / grain;
+
+      T* partials = memory::allocate<T>(range_count);
+
+      parallel_for_ranges(begin, end, grain, [&] (size_t base, size_t ext) {
+        new (partials + (base - begin) / grain) T { fn(base, ext) };
+      });
+
+      T accumulator = identity;
+
+      for (size_t i = 0; i < range_count; i ++) {
+        accumulator = reduce(accumulator, partials[i]);
+        partials[i].~T();
+      }
+
+      memory::deallocate(partials);
+
+      return accumulator;
+    }
+
 
   private:
+    /* Shared state of a parallel_for_ranges call, living on the stack of the calling thread until every Job it queued has returned */
+    template <typename F> struct ParallelRange {
+      ThreadPool* pool;
+      F const* fn;
+      std::atomic<size_t> cursor;
+      size_t end;
+      size_t grain;
+      std::atomic<u32_t> pending_count;
+      bool yielding;
+
+      ParallelRange (ThreadPool* in_pool, F const* in_fn, size_t in_begin, size_t in_end, size_t in_grain, u32_t in_pending_count, bool in_yielding)
+      : pool(in_pool)
+      , fn(in_fn)
+      , cursor(in_begin)
+      , end(in_end)
+      , grain(in_grain)
+      , pending_count(in_pending_count)
+      , yielding(in_yielding)
+      { }
+
+      void claim () {
+        size_t base;
+
+        while ((base = cursor.fetch_add(grain, std::memory_order_relaxed)) < end) {
+          (*fn)(base, num::min(base + grain, end));
+
+          if (yielding) pool->yield();
+        }
+      }
+
+      static void execution_instance (ParallelRange* range) {
+        range->claim();
+        range->pending_count.fetch_sub(1, std::memory_order_release);
+      }
+    };
+
     /* The function used by each thread of a ThreadPool to iterate and execute Jobs */
-    static ENGINE_API s32_t thread (ThreadPool* pool);
+    static ENGINE_API s32_t thread (ThreadPoolWorker* worker);
+
+    /* Get the lowest JobPriority a worker may take */
+    u8_t get_lowest_priority (ThreadPoolWorker const& worker) const {
+      return worker.index < reserved_count.load(std::memory_order_relaxed)? JobPriority::Normal : JobPriority::Background;
+    }
+
+    /* Get the number of available Jobs of the given JobPriority or higher */
+    u32_t get_available_count (u8_t lowest_priority) const {
+      u32_t count = 0;
+
+      for (u8_t i = 0; i <= lowest_priority; i ++) count += available_counts[i].load(std::memory_order_seq_cst);
+
+      return count;
+    }
+
+    /* Take the highest priority Job for a worker, no lower than the given JobPriority. Within a priority, it takes the newest from its own deque,
+     * otherwise the oldest injected Job, otherwise one stolen from another worker */
+    ENGINE_API bool take_job (ThreadPoolWorker& worker, u8_t lowest_priority, Job& job, u8_t& priority);
+
+    /* Run a Job taken by a worker, and count it as completed */
+    ENGINE_API void run_job (ThreadPoolWorker& worker, Job const& job, u8_t priority);
+
+    /* Get the counters of the calling thread, which are those shared by external threads if it is not a worker */
+    ThreadPoolCounters& get_current_counters () {
+      ThreadPoolWorker* worker = get_current_worker();
+
+      return worker != NULL? worker->counters : external_counters;
+    }
+
+    ENGINE_API JobNode* allocate_node ();
+
+    ENGINE_API void free_node (JobNode* node);
+
+    /* Add a JobNode to the dependents of the Job referred to by a JobHandle, unless that Job has already completed */
+    ENGINE_API bool add_dependent (JobHandle const& handle, JobNode* dependent);
+
+    /* Queue a JobNode once its last dependency is released */
+    ENGINE_API void release_node (JobNode* node);
+
+    /* The Job callback running a submitted JobNode, which completes it and releases its dependents */
+    static ENGINE_API void execute_node (JobNode* node);
+
+    /* Spin briefly and then park the calling thread until the given condition holds, rechecking it as Jobs complete.
+     * Worker threads run other Jobs while they wait instead, as the Jobs they wait on may be in their own deque */
+    template <typename F> void block_until (F condition);
+
+    /* Count a Job as completed and wake any awaiting threads */
+    ENGINE_API void complete_job ();
   };
 }
 
@@ -25,6 +25,11 @@
 #include <type_traits>
 #include <limits>
 #include <functional>
+#include <atomic>
+
+#if defined(_MSC_VER) && !defined(__clang__)
+  #include <intrin.h>
+#endif
 
 
 #include "extern.hh"
@@ -281,6 +286,26 @@ namespace num {
     return m;
   }
 
+  /* Get the index of the lowest enabled bit of a non-zero integer */
+  static inline u32_t count_trailing_zeros (u64_t v) {
+    #if defined(__clang__) || defined(__GNUC__)
+      return static_cast<u32_t>(__builtin_ctzll(v));
+    #else
+      unsigned long index;
+      _BitScanForward64(&index, v);
+      return static_cast<u32_t>(index);
+    #endif
+  }
+
+  /* Get the number of enabled bits of an integer */
+  static inline u32_t count_set_bits (u64_t v) {
+    #if defined(__clang__) || defined(__GNUC__)
+      return static_cast<u32_t>(__builtin_popcountll(v));
+    #else
+      return static_cast<u32_t>(__popcnt64(v));
+    #endif
+  }
+
   /* Get the sign of number */
   template <typename T> constexpr T sign (T v) {
     return v < T(0)? T(-1) : T(1);
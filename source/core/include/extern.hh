@@ -46,6 +46,18 @@
 #define thrd_sleep_safe(duration, remaining) \
   m_assert(thrd_sleep(duration, remaining) == 0, "Failed to sleep Thread")
 
+#define cnd_init_safe(cnd) \
+  m_assert(cnd_init(cnd) == thrd_success, "Failed to initialize Condition")
+
+#define cnd_signal_safe(cnd) \
+  m_assert(cnd_signal(cnd) == thrd_success, "Failed to signal Condition")
+
+#define cnd_broadcast_safe(cnd) \
+  m_assert(cnd_broadcast(cnd) == thrd_success, "Failed to broadcast Condition")
+
+#define cnd_wait_safe(cnd, mtx) \
+  m_assert(cnd_wait(cnd, mtx) == thrd_success, "Failed to wait on Condition")
+
 
 #include <extern/sdl2/include/SDL.h>
 
@@ -318,6 +318,8 @@ namespace mod {
 
   namespace Internal {
     m_impl_sfinae_has_member(destroy); // has_destroy<T>::value
+    m_impl_sfinae_has_member(serialize); // has_serialize<T>::value
+    m_impl_sfinae_has_member(deserialize); // has_deserialize<T>::value
   }
 }
 
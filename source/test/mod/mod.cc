@@ -6,6 +6,55 @@
 
 MODULE_API void module_init ();
 
+
+struct CharacterAssets {
+  mod::RenderMesh3D mesh;
+  mod::Skeleton skeleton;
+  mod::SkeletalAnimation idle_anim;
+  mod::SkeletalAnimation walk_anim;
+  mod::SkeletalAnimation run_anim;
+};
+
+/* Read and parse the character on a worker, then create its mesh back on the main thread, which owns the GL context */
+static mod::Task<CharacterAssets> load_character (char const* path, mod::Matrix4 transform) {
+  using namespace mod;
+
+  auto [ source, length ] = co_await read_file(path);
+
+  m_asset_assert(source != NULL, path, "Failed to load source file");
+
+  static_cast<char*>(source)[length] = '\0';
+
+  DAE dae = DAE::from_str_ex(path, static_cast<char*>(source), transform);
+
+  CharacterAssets assets;
+
+  assets.skeleton = dae.load_skeleton();
+
+  assets.idle_anim = dae.load_animation("idle_attention");
+  assets.walk_anim = dae.load_animation("walk");
+  assets.run_anim = dae.load_animation("run");
+
+
+  // source animation data is corrupted on first frames
+  for (SkeletalAnimation* anim : { &assets.idle_anim, &assets.walk_anim, &assets.run_anim }) {
+    anim->keyframes[0].destroy();
+    anim->keyframes.remove(0);
+
+    anim->time_scale = 1400.f;
+  }
+
+
+  co_await main_thread();
+
+  assets.mesh = dae.load_mesh();
+
+  dae.destroy();
+
+  co_return assets;
+}
+
+
 void module_init () {
   using namespace mod;
   using namespace ImGui;
@@ -15,43 +64,34 @@ void module_init () {
   AssetManager.load_database_from_file("./assets/db.json");
 
 
-  draw_debug.init();
+  /* XML TEST */
+  Matrix4 dae_tran = Transform3D { 0, Quaternion::from_euler(Euler { Vector3f { 0, 0, num::deg_to_rad(180) } }), 1 }.compose();
 
+  Task<CharacterAssets> character_load = load_character("./assets/meshes/animated_character.dae", dae_tran);
 
-  ECS& ecs = *new ECS;
+  character_load.start();
 
 
-  
+  draw_debug.init();
 
-  /* XML TEST */
-  Matrix4 dae_tran = Transform3D { 0, Quaternion::from_euler(Euler { Vector3f { 0, 0, num::deg_to_rad(180) } }), 1 }.compose();
 
-  DAE dae = DAE::from_file("./assets/meshes/animated_character.dae", dae_tran);
+  ECS& ecs = *new ECS;
 
-  RenderMesh3D dae_mesh = dae.load_mesh();
 
-  Skeleton dae_skel = dae.load_skeleton();
+  // The mesh is created by a main thread Job, which is run here as the frame loop has not started yet
+  while (!character_load.is_complete()) {
+    if (JobSystem.run_main_thread_jobs() == 0) thrd_yield();
+  }
 
-  SkeletalAnimation dae_idle_anim = dae.load_animation("idle_attention");
-  SkeletalAnimation dae_walk_anim = dae.load_animation("walk");
-  SkeletalAnimation dae_run_anim = dae.load_animation("run");
-  
+  CharacterAssets character_assets = character_load.await();
 
-  // source animation data is corrupted on first frames
-  dae_idle_anim.keyframes[0].destroy();
-  dae_idle_anim.keyframes.remove(0);
-  dae_walk_anim.keyframes[0].destroy();
-  dae_walk_anim.keyframes.remove(0);
-  dae_run_anim.keyframes[0].destroy();
-  dae_run_anim.keyframes.remove(0);
-  
-  
-  dae_idle_anim.time_scale = 1400.f;
-  dae_walk_anim.time_scale = 1400.f;
-  dae_run_anim.time_scale = 1400.f;
-  
+  RenderMesh3D dae_mesh = character_assets.mesh;
 
-  dae.destroy();
+  Skeleton dae_skel = character_assets.skeleton;
+
+  SkeletalAnimation dae_idle_anim = character_assets.idle_anim;
+  SkeletalAnimation dae_walk_anim = character_assets.walk_anim;
+  SkeletalAnimation dae_run_anim = character_assets.run_anim;
 
 
 
@@ -86,18 +126,19 @@ void module_init () {
   // ecs.create_component_type<SkeletonState>();
   // ecs.create_component_type<Child>();
   // ecs.create_component_type<Parent>();
+  // ecs.create_component_type<WorldTransform>();
 
   ecs.create_component_type<MaterialHandle>();
   ecs.create_component_type<MaterialInstance>();
   ecs.create_component_type<MaterialSetHandle>();
-  ecs.create_component_type<MaterialSet>();
+  ecs.create_component_type<MaterialSet>(NULL, NULL, ComponentStorage::Sparse);
   ecs.create_component_type<RenderMesh3DHandle>();
   ecs.create_component_type<BasicInput>();
-  ecs.create_component_type<PointLight>();
+  ecs.create_component_type<PointLight>(NULL, NULL, ComponentStorage::Sparse);
   ecs.create_component_type<SkeletonHandle>();
   ecs.create_component_type<SkeletalAnimationHandle>();
   // ecs.create_component_type<SkeletalAnimationState>();
-  ecs.create_component_type<AudioState>();
+  ecs.create_component_type<AudioState>(NULL, NULL, ComponentStorage::Sparse);
 
 
   EntityHandle character; {
@@ -264,8 +305,8 @@ void module_init () {
   });
 
 
-  ecs.create_system("Skeletal Animator", false, { ecs.get_component_type_by_instance_type<SkeletonState>().id }, [&] (ECS*, u32_t index) {
-    ecs.get_component<SkeletonState>(index).update_pose(Application.frame_delta);
+  ecs.create_system<SkeletonState>("Skeletal Animator", false, [&] (u32_t, SkeletonState& state) {
+    state.update_pose(Application.frame_delta);
   });
 
   ecs.create_system("Skeletal Animator Debugger", false, { ecs.get_component_type_by_instance_type<SkeletonState>().id }, [&] (ECS*, u32_t index) {
@@ -342,8 +383,7 @@ void module_init () {
     ecs.get_component<Transform3D>(xent).rotation = Quaternion::from_euler(Euler { 0, 0, xer += 1 / Application.frame_delta });
   });
 
-  ecs.create_system("MovementInput", true, { ecs.get_component_type_by_instance_type<BasicInput>().id, ecs.get_component_type_by_instance_type<Transform3D>().id }, [&] (ECS*, u32_t index) {
-    BasicInput& input = ecs.get_component<BasicInput>(index);
+  System::ID movement_input = ecs.create_system<BasicInput const, Transform3D>("MovementInput", true, [&] (u32_t, BasicInput const& input, Transform3D& transform) {
     if (input.enabled) {
       Vector3f movement = { 0, 0, 0 };
 
@@ -358,10 +398,14 @@ void module_init () {
 
       movement = movement.normalize() * (input.movement_rate / Application.frame_delta);
 
-      ecs.get_component<Transform3D>(index).position += movement;
+      transform.position += movement;
     }
   });
 
+  ecs.set_system_access<BasicInput const, Transform3D>(movement_input);
+
+  ecs.create_system("World Transform", update_world_transforms);
+
 
 
   bool light_orbit = true;
@@ -473,11 +517,6 @@ void module_init () {
 
     camera_matrix = projection_matrix * view_matrix;
 
-    ComponentMask mask = ComponentMask {
-      ecs.get_component_type_by_instance_type<Transform3D>().id,
-      ecs.get_component_type_by_instance_type<RenderMesh3DHandle>().id
-    };
-
     ComponentType::ID single_mat_h_id = ecs.get_component_type_by_instance_type<MaterialHandle>().id;
     ComponentType::ID single_mat_i_id = ecs.get_component_type_by_instance_type<MaterialInstance>().id;
     ComponentType::ID mat_set_h_id = ecs.get_component_type_by_instance_type<MaterialSetHandle>().id;
@@ -486,71 +525,63 @@ void module_init () {
     ComponentType::ID skel_state_id = ecs.get_component_type_by_instance_type<SkeletonState>().id;
 
 
-    for (u32_t i = 0; i < ecs.entity_count; i ++) {
+    ecs.each<WorldTransform const, RenderMesh3DHandle const>([&] (u32_t i, WorldTransform const& world, RenderMesh3DHandle const& mesh_handle) {
       EntityHandle entity = ecs.get_handle(i);
 
-      if (entity->enabled_components.match_subset(mask)) {
-        Transform3D& transform = entity.get_component<Transform3D>();
-        
-        Matrix4 model_matrix = transform.compose();
-
-        if (entity->enabled_components.match_index(ecs.get_component_type_by_instance_type<Child>().id)) {
-          model_matrix = entity.get_component<Child>().compute_hierarchical_matrix() * model_matrix;
-        }
-        
-        RenderMesh3D& mesh = *entity.get_component<RenderMesh3DHandle>();
-        
-        Matrix3 normal_matrix = Matrix3::normal(view_matrix * model_matrix);
-
-        bool has_skel_state = entity->enabled_components.match_index(skel_state_id);
+      Matrix4 const& model_matrix = world.matrix;
+      
+      RenderMesh3D& mesh = *mesh_handle;
+      
+      Matrix3 normal_matrix = Matrix3::normal(view_matrix * model_matrix);
 
-        auto const update_mat_uniforms = [&] (Material& mat) {
-          mat.set_uniform("m_model", model_matrix);
-          mat.set_uniform("m_view", view_matrix);
-          mat.set_uniform("m_projection", projection_matrix);
-          mat.set_uniform("m_normal", normal_matrix);
+      bool has_skel_state = entity->enabled_components.match_index(skel_state_id);
 
-          if (mat.enable_skinning && has_skel_state) {
-            mat.set_uniform_array("bone_transforms", entity.get_component<SkeletonState>().pose);
-          }
+      auto const update_mat_uniforms = [&] (Material& mat) {
+        mat.set_uniform("m_model", model_matrix);
+        mat.set_uniform("m_view", view_matrix);
+        mat.set_uniform("m_projection", projection_matrix);
+        mat.set_uniform("m_normal", normal_matrix);
 
-          if (mat.supports_uniform("light_pos")) {
-            mat.set_uniform("light_pos", light.get_component<Transform3D>().position);
-            mat.set_uniform("light_color", light.get_component<PointLight>().color * light.get_component<PointLight>().brightness);
-          }
-        };
+        if (mat.enable_skinning && has_skel_state) {
+          mat.set_uniform_array("bone_transforms", entity.get_component<SkeletonState const>().pose);
+        }
 
-        if (entity->enabled_components.match_index(single_mat_h_id)) {
-          MaterialHandle& material = entity.get_component<MaterialHandle>();
+        if (mat.supports_uniform("light_pos")) {
+          mat.set_uniform("light_pos", light.get_component<Transform3D const>().position);
+          mat.set_uniform("light_color", light.get_component<PointLight const>().color * light.get_component<PointLight const>().brightness);
+        }
+      };
 
-          update_mat_uniforms(*material);
+      if (entity->enabled_components.match_index(single_mat_h_id)) {
+        MaterialHandle& material = entity.get_component<MaterialHandle>();
 
-          mesh.draw_with_material(material);
-        } else if (entity->enabled_components.match_index(single_mat_i_id)) {
-          MaterialInstance& material_instance = entity.get_component<MaterialInstance>();
+        update_mat_uniforms(*material);
 
-          update_mat_uniforms(*material_instance.base);
+        mesh.draw_with_material(material);
+      } else if (entity->enabled_components.match_index(single_mat_i_id)) {
+        MaterialInstance& material_instance = entity.get_component<MaterialInstance>();
 
-          mesh.draw_with_material_instance(material_instance);
-        } else if (entity->enabled_components.match_index(mat_set_h_id)) {
-          MaterialSetHandle& material_set = entity.get_component<MaterialSetHandle>();
+        update_mat_uniforms(*material_instance.base);
 
-          for (auto [ i, mat ] : *material_set) {
-            update_mat_uniforms(mat.is_instance? *mat.instance.base : *mat.handle);
-          }
+        mesh.draw_with_material_instance(material_instance);
+      } else if (entity->enabled_components.match_index(mat_set_h_id)) {
+        MaterialSetHandle& material_set = entity.get_component<MaterialSetHandle>();
 
-          mesh.draw_with_material_set(material_set);
-        } else if (entity->enabled_components.match_index(mat_set_id)) {
-          MaterialSet& material_set = entity.get_component<MaterialSet>();
+        for (auto [ i, mat ] : *material_set) {
+          update_mat_uniforms(mat.is_instance? *mat.instance.base : *mat.handle);
+        }
 
-          for (auto [ i, mat ] : material_set) {
-            update_mat_uniforms(mat.is_instance? *mat.instance.base : *mat.handle);
-          }
+        mesh.draw_with_material_set(material_set);
+      } else if (entity->enabled_components.match_index(mat_set_id)) {
+        MaterialSet& material_set = entity.get_component<MaterialSet>();
 
-          mesh.draw_with_material_set(&material_set);
+        for (auto [ i, mat ] : material_set) {
+          update_mat_uniforms(mat.is_instance? *mat.instance.base : *mat.handle);
         }
+
+        mesh.draw_with_material_set(&material_set);
       }
-    }
+    });
   });
 
 
@@ -565,7 +596,7 @@ void module_init () {
       EntityHandle entity = ecs.get_handle(i);
 
       if (entity->enabled_components.match_subset(mask)) {
-        Transform3D& transform = entity.get_component<Transform3D>();
+        Transform3D const& transform = entity.get_component<Transform3D const>();
 
         Matrix4 transform_matrix = transform.compose();
 
@@ -596,7 +627,7 @@ void module_init () {
       EntityHandle entity = ecs.get_handle(i);
 
       if (entity->enabled_components.match_subset(mask)) {
-        Transform3D& transform = entity.get_component<Transform3D>();
+        Transform3D const& transform = entity.get_component<Transform3D const>();
 
         Matrix4 transform_matrix = transform.compose();
 
@@ -623,7 +654,7 @@ void module_init () {
       EntityHandle entity = ecs.get_handle(i);
 
       if (entity->enabled_components.match_subset(mask)) {
-        Transform3D& transform = entity.get_component<Transform3D>();
+        Transform3D const& transform = entity.get_component<Transform3D const>();
 
         Matrix4 transform_matrix = transform.compose();
 
@@ -663,7 +694,7 @@ void module_init () {
 
       if (!entity->enabled_components.match_subset(mask)) continue;
 
-      Transform3D& transform = entity.get_component<Transform3D>();
+      Transform3D const& transform = entity.get_component<Transform3D const>();
 
       Matrix4 transform_matrix = transform.compose();
 
@@ -740,7 +771,7 @@ void module_init () {
 
   ecs.create_system("Object Picker", [&] (ECS*) {
     ComponentMask mask = ComponentMask {
-      ecs.get_component_type_by_instance_type<Transform3D>().id,
+      ecs.get_component_type_by_instance_type<WorldTransform>().id,
       ecs.get_component_type_by_instance_type<RenderMesh3DHandle>().id
     };
 
@@ -761,13 +792,8 @@ void module_init () {
     for (u32_t i = 0; i < ecs.entity_count; i ++) {
       EntityHandle entity = ecs.get_handle(i);
       if (entity->enabled_components.match_subset(mask)) {
-        Transform3D& tran = entity.get_component<Transform3D>();
-        RenderMesh3D& mesh = *entity.get_component<RenderMesh3DHandle>();
-        Matrix4 world_matrix = tran.compose();
-
-        if (entity->enabled_components.match_index(ecs.get_component_type_by_instance_type<Child>().id)) {
-          world_matrix = entity.get_component<Child>().compute_hierarchical_matrix() * world_matrix;
-        }
+        RenderMesh3D& mesh = *entity.get_component<RenderMesh3DHandle const>();
+        Matrix4 const& world_matrix = entity.get_component<WorldTransform const>().matrix;
 
         AABB3 mesh_bounds = mesh.get_aabb().apply_matrix(world_matrix);
         
@@ -802,12 +828,9 @@ void module_init () {
 
       Vector3f intersect = ray.vector_at_offset(distance);
 
-      Transform3D& t = entity.get_component<Transform3D>();
-      RenderMesh3D& m = *entity.get_component<RenderMesh3DHandle>();
-      Matrix4 m4 = t.compose();
-      if (entity->enabled_components.match_index(ecs.get_component_type_by_instance_type<Child>().id)) {
-        m4 = entity.get_component<Child>().compute_hierarchical_matrix() * m4;
-      }
+      RenderMesh3D& m = *entity.get_component<RenderMesh3DHandle const>();
+      Matrix4 const& m4 = entity.get_component<WorldTransform const>().matrix;
+      Vector3f position = m4.get_position();
 
       AABB3 b = m.get_aabb().apply_matrix(m4);
 
@@ -816,7 +839,7 @@ void module_init () {
       Text("Intersect: %.3fx%.3fx%.3f", intersect.x, intersect.y, intersect.z);
       Text("Entity:");
       Text("- ID: %u", entity->id);
-      Text("- Position: %.3fx%.3fx%.3f", t.position.x, t.position.y, t.position.z);
+      Text("- Position: %.3fx%.3fx%.3f", position.x, position.y, position.z);
       Text("- Mesh Origin: %s", m.origin);
 
       draw_debug.cube(AABB3::from_center_and_size(b.min, { 10 }), { 1, 0, 1 });
@@ -835,6 +858,9 @@ void module_init () {
   ecs.get_system_by_name("Vertex Normal Debugger").enabled = false;
   ecs.get_system_by_name("Face Edge Debugger").enabled = false;
   ecs.get_system_by_name("Object Picker").enabled = false;
+
+  bool show_profiler = false;
+  bool show_job_stats = false;
   
 
   Array<WatchedFileReport> update_reports;
@@ -863,6 +889,9 @@ void module_init () {
 
     ecs.update();
 
+    if (show_profiler) ecs.show_profiler("ECS Profiler", &show_profiler);
+    if (show_job_stats) JobSystem.get_pool().show_stats("Job System", &show_job_stats);
+
     Begin("Bone attachment");
     SliderInt("slot_index", &ecs.get_component<Child>(hand_cube).slot_index, -1, ecs.get_component<SkeletonState>(character).pose.count - 1);
     End();
@@ -874,6 +903,8 @@ void module_init () {
     Checkbox("Object Picker", &ecs.get_system_by_name("Object Picker").enabled);
     Checkbox("Animator Controls", &ecs.get_system_by_name("Skeletal Animator Debug Controller").enabled);
     Checkbox("Animated Skeleton", &ecs.get_system_by_name("Skeletal Animator Debugger").enabled);
+    Checkbox("ECS Profiler", &show_profiler);
+    Checkbox("Job System Stats", &show_job_stats);
     if (Button("Simulate Frame Drop")) SDL_Delay(16);
     if (Button("Simulate Two Frame Drop")) SDL_Delay(32);
     if (Button("Simulate Ten Frame Drop")) SDL_Delay(160);